@@ -0,0 +1,285 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "testalarmscheduler.h"
+#include "alarmscheduler.h"
+#include "memorycalendar.h"
+
+#include <QtCore/QSet>
+
+#include <algorithm>
+
+#include <qtest.h>
+QTEST_MAIN(AlarmSchedulerTest)
+
+using namespace KCalCore;
+
+static const KDateTime firstTime(QDate(2016, 1, 1), QTime(0, 0, 0), KDateTime::UTC);
+
+static Event::Ptr addEvent(MemoryCalendar &calendar, const KDateTime &dtStart,
+                           int offsetSecs, int repeatCount)
+{
+    Event::Ptr event(new Event());
+    event->setDtStart(dtStart);
+    event->setDtEnd(dtStart.addSecs(1800));
+    Alarm::Ptr alarm = event->newAlarm();
+    alarm->setStartOffset(Duration(offsetSecs));
+    if (repeatCount) {
+        alarm->setSnoozeTime(Duration(300));
+        alarm->setRepeatCount(repeatCount);
+    }
+    alarm->setEnabled(true);
+    calendar.addEvent(event);
+    return event;
+}
+
+static QSet<Alarm *> alarmSet(const Alarm::List &alarms)
+{
+    QSet<Alarm *> set;
+    foreach (const Alarm::Ptr &alarm, alarms) {
+        set.insert(alarm.data());
+    }
+    return set;
+}
+
+static void fillCalendar(MemoryCalendar &calendar)
+{
+    addEvent(calendar, firstTime.addSecs(10 * 3600), -600, 0);
+    addEvent(calendar, firstTime.addSecs(9 * 3600), -300, 2)->recurrence()->setDaily(1);
+    addEvent(calendar, firstTime.addSecs(15 * 3600 + 120), 0, 20)->recurrence()->setHourly(3);
+    Event::Ptr weekly = addEvent(calendar, firstTime.addSecs(-7 * 86400 + 3600), -3600, 4);
+    weekly->recurrence()->setWeekly(1);
+
+    Todo::Ptr todo(new Todo());
+    todo->setDtStart(firstTime.addSecs(12 * 3600));
+    todo->setDtDue(firstTime.addSecs(13 * 3600));
+    Alarm::Ptr todoAlarm = todo->newAlarm();
+    todoAlarm->setStartOffset(Duration(0));
+    todoAlarm->setEnabled(true);
+    calendar.addTodo(todo);
+}
+
+static bool lessThanTrigger(const Calendar::AlarmTrigger &t1, const Calendar::AlarmTrigger &t2)
+{
+    if (t1.time != t2.time) {
+        return t1.time < t2.time;
+    }
+    if (t1.alarm != t2.alarm) {
+        return t1.alarm.data() < t2.alarm.data();
+    }
+    return t1.occurrence < t2.occurrence;
+}
+
+void AlarmSchedulerTest::testMatchesCalendarAlarms()
+{
+    MemoryCalendar calendar(KDateTime::UTC);
+    fillCalendar(calendar);
+
+    // Take the alarms minute by minute, as a reminder daemon would
+    AlarmScheduler scheduler(&calendar, firstTime);
+    int due = 0;
+    for (KDateTime from = firstTime; from < firstTime.addDays(3); from = from.addSecs(60)) {
+        const KDateTime to = from.addSecs(59);
+        const KDateTime next = scheduler.nextAlarmTime();
+        const QSet<Alarm *> expected = alarmSet(calendar.alarms(from, to));
+        QCOMPARE(alarmSet(scheduler.takeAlarmsDue(to)), expected);
+        QCOMPARE(!expected.isEmpty(), next.isValid() && next <= to);
+        if (!expected.isEmpty()) {
+            QVERIFY(!(next < from));
+            ++due;
+        }
+    }
+    QVERIFY(due > 50);
+}
+
+void AlarmSchedulerTest::testCalendarChanges()
+{
+    MemoryCalendar calendar(KDateTime::UTC);
+    AlarmScheduler scheduler(&calendar, firstTime);
+    QVERIFY(!scheduler.nextAlarmTime().isValid());
+
+    Event::Ptr event = addEvent(calendar, firstTime.addSecs(3600), -600, 1);
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(3000));
+
+    // Repetitions are queued once the alarm is taken
+    QCOMPARE(scheduler.takeAlarmsDue(firstTime.addSecs(3000)), event->alarms());
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(3300));
+    QCOMPARE(scheduler.takeAlarmsDue(firstTime.addSecs(3300)), event->alarms());
+    QVERIFY(!scheduler.nextAlarmTime().isValid());
+
+    // Changing the event reschedules its alarm
+    event->setDtStart(firstTime.addSecs(7200));
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(6600));
+    event->alarms().first()->setEnabled(false);
+    QVERIFY(!scheduler.nextAlarmTime().isValid());
+    event->alarms().first()->setEnabled(true);
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(6600));
+
+    // Completed to-dos have no alarms
+    Todo::Ptr todo(new Todo());
+    todo->setDtStart(firstTime.addSecs(5400));
+    Alarm::Ptr alarm = todo->newAlarm();
+    alarm->setStartOffset(Duration(0));
+    alarm->setEnabled(true);
+    calendar.addTodo(todo);
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(5400));
+    todo->setCompleted(true);
+    QCOMPARE(scheduler.nextAlarmTime(), firstTime.addSecs(6600));
+
+    calendar.deleteEvent(event);
+    QVERIFY(!scheduler.nextAlarmTime().isValid());
+}
+
+void AlarmSchedulerTest::testAlarmTriggers()
+{
+    MemoryCalendar calendar(KDateTime::UTC);
+    fillCalendar(calendar);
+    AlarmScheduler scheduler(&calendar, firstTime);
+
+    const KDateTime end = firstTime.addDays(3).addSecs(-1);
+    const Calendar::AlarmTriggerList triggers = calendar.alarmTriggers(firstTime, end);
+    QVERIFY(triggers.count() > 50);
+    for (int i = 0; i < triggers.count(); ++i) {
+        const Calendar::AlarmTrigger &trigger = triggers.at(i);
+        if (i > 0) {
+            QVERIFY(!(trigger.time < triggers.at(i - 1).time));
+        }
+        QVERIFY(!(trigger.time < firstTime) && !(end < trigger.time));
+        QVERIFY(calendar.alarms(trigger.time, trigger.time).contains(trigger.alarm));
+
+        // The trigger is where the alarm and its repetitions are for the occurrence
+        const Alarm::Ptr alarm = trigger.alarm;
+        const Incidence::Ptr incidence = calendar.incidence(alarm->parentUid());
+        const KDateTime initial = alarm->startOffset().end(trigger.occurrence);
+        QVERIFY(incidence->recurs() ? incidence->recursAt(trigger.occurrence)
+                                    : trigger.occurrence == incidence->dtStart());
+        QVERIFY(trigger.repetition >= 0 && trigger.repetition <= alarm->repeatCount());
+        QCOMPARE(trigger.time, initial.addSecs(alarm->snoozeTime().asSeconds() * trigger.repetition));
+    }
+
+    // The scheduler finds the same triggers
+    Calendar::AlarmTriggerList sorted = triggers;
+    Calendar::AlarmTriggerList taken = scheduler.takeTriggersDue(end);
+    std::sort(sorted.begin(), sorted.end(), lessThanTrigger);
+    std::sort(taken.begin(), taken.end(), lessThanTrigger);
+    QCOMPARE(taken.count(), sorted.count());
+    for (int i = 0; i < taken.count(); ++i) {
+        QCOMPARE(taken.at(i).alarm, sorted.at(i).alarm);
+        QCOMPARE(taken.at(i).occurrence, sorted.at(i).occurrence);
+        QCOMPARE(taken.at(i).repetition, sorted.at(i).repetition);
+    }
+}
+
+void AlarmSchedulerTest::testOverlappingRepetitions()
+{
+    // Hourly, with repetitions every 5 minutes for 100 minutes
+    MemoryCalendar calendar(KDateTime::UTC);
+    Event::Ptr event = addEvent(calendar, firstTime, 0, 20);
+    event->recurrence()->setHourly(1);
+
+    // From 10:00, the occurrence at 09:00 repeats until 10:40, and the one at
+    // 10:00 until 10:55, so each of the triggers at the same time is returned
+    const KDateTime from = firstTime.addSecs(10 * 3600);
+    const KDateTime to = from.addSecs(3599);
+    Calendar::AlarmTriggerList triggers = calendar.alarmTriggers(from, to);
+    QCOMPARE(triggers.count(), 12 + 9);
+    int earlier = 0;
+    foreach (const Calendar::AlarmTrigger &trigger, triggers) {
+        if (trigger.occurrence == from.addSecs(-3600)) {
+            QCOMPARE(trigger.time, trigger.occurrence.addSecs(300 * trigger.repetition));
+            ++earlier;
+        } else {
+            QCOMPARE(trigger.occurrence, from);
+        }
+    }
+    QCOMPARE(earlier, 9);
+
+    // The scheduler queues one entry for each occurrence still repeating
+    AlarmScheduler scheduler(&calendar, from);
+    Calendar::AlarmTriggerList taken = scheduler.takeTriggersDue(to);
+    std::sort(triggers.begin(), triggers.end(), lessThanTrigger);
+    std::sort(taken.begin(), taken.end(), lessThanTrigger);
+    QCOMPARE(taken.count(), triggers.count());
+    for (int i = 0; i < taken.count(); ++i) {
+        QCOMPARE(taken.at(i).occurrence, triggers.at(i).occurrence);
+        QCOMPARE(taken.at(i).time, triggers.at(i).time);
+        QCOMPARE(taken.at(i).repetition, triggers.at(i).repetition);
+    }
+    QCOMPARE(scheduler.nextAlarmTime(), from.addSecs(3600));
+}
+
+void AlarmSchedulerTest::benchmarkRecurringAlarms_data()
+{
+    QTest::addColumn<int>("recurrenceType");
+    QTest::addColumn<int>("snoozeSecs");
+    QTest::addColumn<int>("repeatCount");
+
+    QTest::newRow("daily, 5 minute snooze, 3000 repeats")
+            << int(Recurrence::rDaily) << 300 << 3000;
+    QTest::newRow("daily, 7 minute snooze, 20000 repeats")
+            << int(Recurrence::rDaily) << 420 << 20000;
+    QTest::newRow("hourly, 7 minute snooze, 20000 repeats")
+            << int(Recurrence::rHourly) << 420 << 20000;
+    QTest::newRow("minutely, 150 second snooze, 2000 repeats")
+            << int(Recurrence::rMinutely) << 150 << 2000;
+}
+
+void AlarmSchedulerTest::benchmarkRecurringAlarms()
+{
+    QFETCH(int, recurrenceType);
+    QFETCH(int, snoozeSecs);
+    QFETCH(int, repeatCount);
+
+    MemoryCalendar calendar(KDateTime::UTC);
+    Event::Ptr event = addEvent(calendar, firstTime.addSecs(-100 * 86400 + 3600), -60, 0);
+    Alarm::Ptr alarm = event->alarms().first();
+    alarm->setSnoozeTime(Duration(snoozeSecs));
+    alarm->setRepeatCount(repeatCount);
+    switch (recurrenceType) {
+    case Recurrence::rDaily:
+        event->recurrence()->setDaily(1);
+        break;
+    case Recurrence::rHourly:
+        event->recurrence()->setHourly(5);
+        break;
+    default:
+        event->recurrence()->setMinutely(7);
+        break;
+    }
+
+    // Windows shorter than the snooze time, which repetitions of earlier
+    // occurrences may or may not reach
+    QList<KDateTime> windows;
+    QList<bool> expected;
+    for (int i = 0; i < 40; ++i) {
+        const KDateTime from = firstTime.addSecs(i * 3607 + 13);
+        windows.append(from);
+        expected.append(!calendar.alarmTriggers(from, from.addSecs(29)).isEmpty());
+    }
+    QVERIFY(expected.contains(true));
+
+    QList<bool> found;
+    QBENCHMARK {
+        found.clear();
+        foreach (const KDateTime &from, windows) {
+            found.append(!calendar.alarms(from, from.addSecs(29)).isEmpty());
+        }
+    }
+    QCOMPARE(found, expected);
+}
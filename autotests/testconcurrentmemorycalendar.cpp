@@ -0,0 +1,438 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "testconcurrentmemorycalendar.h"
+#include "concurrentmemorycalendar.h"
+
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+
+#include <ksystemtimezone.h>
+
+#include <qtest.h>
+QTEST_MAIN(ConcurrentMemoryCalendarTest)
+
+using namespace KCalCore;
+
+static const QDate firstDay(2016, 1, 1);
+static const int dayCount = 366;
+
+// Queries the calendar and the recurrences of the shared recurring events,
+// counting every result which differs from what a single thread computed.
+class ReaderThread : public QThread
+{
+public:
+    ReaderThread(const ConcurrentMemoryCalendar::Ptr &calendar,
+                 const QSet<Incidence *> &fixedEvents,
+                 const Event::List &recurringEvents,
+                 const QVector<DateTimeList> &expectedTimes,
+                 int seed)
+        : failures(0),
+          mCalendar(calendar),
+          mFixedEvents(fixedEvents),
+          mRecurringEvents(recurringEvents),
+          mExpectedTimes(expectedTimes),
+          mZone(KSystemTimeZones::zone(QStringLiteral("Europe/Berlin"))),
+          mSeed(seed)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        const KDateTime start(firstDay, QTime(0, 0), KDateTime::UTC);
+        const KDateTime end = start.addDays(dayCount).addSecs(-1);
+
+        for (int i = 0; i < 300; ++i) {
+            const int n = (i * 7 + mSeed) % mRecurringEvents.count();
+            const Event::Ptr recurring = mRecurringEvents.at(n);
+            if (recurring->recurrence()->timesInInterval(start, end) != mExpectedTimes.at(n)) {
+                ++failures;
+            }
+            if (recurring->isMultiDay() != (recurring->dtStart().daysTo(recurring->dtEnd()) > 1)) {
+                ++failures;
+            }
+
+            // Every day has exactly one of the fixed events
+            const QDate date = firstDay.addDays((i * 13 + mSeed) % (dayCount - 7));
+            if (countFixed(mCalendar->rawEventsForDate(date)) != 1) {
+                ++failures;
+            }
+            if (countFixed(mCalendar->rawEvents(date, date.addDays(6))) != 7) {
+                ++failures;
+            }
+
+            // The same in a time zone, where the fixed events stay on their
+            // UTC date
+            if (countFixed(mCalendar->rawEventsForDate(date, mZone)) != 1) {
+                ++failures;
+            }
+            if (countFixed(mCalendar->rawEvents(date, date.addDays(6), mZone)) != 7) {
+                ++failures;
+            }
+            if (recurring->isMultiDay(mZone) != recurring->isMultiDay()) {
+                ++failures;
+            }
+        }
+    }
+
+    int failures;
+
+private:
+    int countFixed(const Event::List &events) const
+    {
+        int count = 0;
+        foreach (const Event::Ptr &event, events) {
+            if (mFixedEvents.contains(event.data())) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    ConcurrentMemoryCalendar::Ptr mCalendar;
+    const QSet<Incidence *> mFixedEvents;
+    const Event::List mRecurringEvents;
+    const QVector<DateTimeList> mExpectedTimes;
+    const KDateTime::Spec mZone;
+    const int mSeed;
+};
+
+// Adds, modifies and deletes events of its own while the readers run.
+class WriterThread : public QThread
+{
+public:
+    explicit WriterThread(const ConcurrentMemoryCalendar::Ptr &calendar)
+        : mCalendar(calendar)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        Event::List added;
+        for (int i = 0; i < 500; ++i) {
+            Event::Ptr event(new Event());
+            const KDateTime dtStart(firstDay.addDays(i % dayCount), QTime(15, 0), KDateTime::UTC);
+            event->setDtStart(dtStart);
+            event->setDtEnd(dtStart.addSecs(3600 * (1 + i % 50)));
+            mCalendar->addEvent(event);
+            added.append(event);
+
+            // Modify a copy and replace the original with it, as readers may
+            // be reading the original
+            Event::Ptr modified(event->clone());
+            modified->setSummary(QStringLiteral("transient %1").arg(i));
+            mCalendar->deleteEvent(event);
+            mCalendar->addEvent(modified);
+            added.last() = modified;
+
+            if (i % 2) {
+                mCalendar->deleteEvent(added.takeFirst());
+            }
+        }
+    }
+
+private:
+    ConcurrentMemoryCalendar::Ptr mCalendar;
+};
+
+// Queries the calendar once.
+class QueryThread : public QThread
+{
+public:
+    explicit QueryThread(const ConcurrentMemoryCalendar::Ptr &calendar)
+        : mCalendar(calendar)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        mCalendar->rawEvents();
+    }
+
+private:
+    ConcurrentMemoryCalendar::Ptr mCalendar;
+};
+
+// Reads the types of incidence which the calendar has none of, counting
+// every query which finds any.
+class EmptyTypeReaderThread : public QThread
+{
+public:
+    explicit EmptyTypeReaderThread(const ConcurrentMemoryCalendar::Ptr &calendar)
+        : failures(0),
+          mCalendar(calendar)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        for (int i = 0; i < 1000; ++i) {
+            const QDate date = firstDay.addDays(i % dayCount);
+            if (!mCalendar->rawTodos().isEmpty()
+                    || !mCalendar->rawTodosForDate(date).isEmpty()
+                    || !mCalendar->rawJournals().isEmpty()
+                    || !mCalendar->rawJournalsForDate(date).isEmpty()
+                    || !mCalendar->deletedTodos().isEmpty()
+                    || !mCalendar->deletedJournals().isEmpty()) {
+                ++failures;
+            }
+        }
+    }
+
+    int failures;
+
+private:
+    ConcurrentMemoryCalendar::Ptr mCalendar;
+};
+
+// Takes a snapshot through a MemoryCalendar pointer.
+class SnapshotThread : public QThread
+{
+public:
+    explicit SnapshotThread(MemoryCalendar *calendar)
+        : mCalendar(calendar)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        snapshot = mCalendar->snapshot();
+    }
+
+    MemoryCalendar::Ptr snapshot;
+
+private:
+    MemoryCalendar *mCalendar;
+};
+
+// Queries the calendar whenever an incidence is added.
+class QueryingObserver : public Calendar::CalendarObserver
+{
+public:
+    explicit QueryingObserver(Calendar *calendar)
+        : found(0),
+          mCalendar(calendar)
+    {
+    }
+
+    void calendarIncidenceAdded(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE
+    {
+        if (mCalendar->incidence(incidence->uid())) {
+            ++found;
+        }
+    }
+
+    int found;
+
+private:
+    Calendar *mCalendar;
+};
+
+void ConcurrentMemoryCalendarTest::testObserverQueriesWhileWriting()
+{
+    ConcurrentMemoryCalendar::Ptr cal(new ConcurrentMemoryCalendar(KDateTime::UTC));
+    QueryingObserver observer(cal.data());
+    cal->registerObserver(&observer);
+
+    Event::Ptr event(new Event());
+    event->setDtStart(KDateTime(firstDay, QTime(10, 0), KDateTime::UTC));
+    QVERIFY(cal->addEvent(event));
+    QCOMPARE(observer.found, 1);
+
+    cal->startBatchAdding();
+    Todo::Ptr todo(new Todo());
+    QVERIFY(cal->addTodo(todo));
+    cal->endBatchAdding();
+    QCOMPARE(observer.found, 2);
+
+    // Updates are written, and the write lock is free again afterwards
+    event->setSummary(QStringLiteral("updated"));
+    QCOMPARE(cal->rawEventsForDate(firstDay), Event::List() << event);
+    event->startUpdates();
+    event->setDtStart(event->dtStart().addDays(1));
+    event->endUpdates();
+    QCOMPARE(cal->rawEventsForDate(firstDay.addDays(1)), Event::List() << event);
+
+    // Other threads can read again
+    QueryThread query(cal);
+    query.start();
+    QVERIFY(query.wait(10000));
+
+    cal->unregisterObserver(&observer);
+}
+
+void ConcurrentMemoryCalendarTest::testReadersAndWriter()
+{
+    ConcurrentMemoryCalendar::Ptr cal(new ConcurrentMemoryCalendar(KDateTime::UTC));
+
+    QSet<Incidence *> fixedEvents;
+    for (int i = 0; i < dayCount; ++i) {
+        Event::Ptr event(new Event());
+        const KDateTime dtStart(firstDay.addDays(i), QTime(9, 0), KDateTime::UTC);
+        event->setDtStart(dtStart);
+        event->setDtEnd(dtStart.addSecs(3600));
+        cal->addEvent(event);
+        fixedEvents.insert(event.data());
+    }
+
+    // The recurring events are kept out of the calendar, and only queried on
+    // copies here, so that their caches are first filled in by the concurrent
+    // readers
+    Event::List recurringEvents;
+    QVector<DateTimeList> expectedTimes;
+    const KDateTime start(firstDay, QTime(0, 0), KDateTime::UTC);
+    const KDateTime end = start.addDays(dayCount).addSecs(-1);
+    for (int i = 0; i < 30; ++i) {
+        Event::Ptr event(new Event());
+        const KDateTime dtStart(firstDay.addDays(i), QTime(12, 0), KDateTime::UTC);
+        event->setDtStart(dtStart);
+        switch (i % 3) {
+        case 0:
+            event->setDtEnd(dtStart.addSecs(1800));
+            event->recurrence()->setDaily(1);
+            event->recurrence()->setDuration(100 + i * 10);
+            break;
+        case 1:
+            event->setDtEnd(dtStart.addDays(2));
+            event->recurrence()->setWeekly(1 + i % 2);
+            break;
+        case 2:
+            event->setDtEnd(dtStart.addSecs(7200));
+            event->recurrence()->setMonthly(1);
+            event->recurrence()->addMonthlyDate(1 + i % 28);
+            event->recurrence()->setDuration(10);
+            break;
+        }
+        recurringEvents.append(event);
+
+        QScopedPointer<Event> copy(event->clone());
+        expectedTimes.append(copy->recurrence()->timesInInterval(start, end));
+        QVERIFY(!expectedTimes.last().isEmpty());
+    }
+
+    QList<ReaderThread *> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.append(new ReaderThread(cal, fixedEvents, recurringEvents, expectedTimes, i));
+    }
+    WriterThread writer(cal);
+
+    writer.start();
+    foreach (ReaderThread *reader, readers) {
+        reader->start();
+    }
+    QVERIFY(writer.wait());
+    foreach (ReaderThread *reader, readers) {
+        QVERIFY(reader->wait());
+        QCOMPARE(reader->failures, 0);
+    }
+    qDeleteAll(readers);
+
+    // The writer leaves every second event behind
+    QCOMPARE(cal->rawEvents().count(), dayCount + 250);
+}
+
+void ConcurrentMemoryCalendarTest::testSnapshotThroughBase()
+{
+    ConcurrentMemoryCalendar::Ptr cal(new ConcurrentMemoryCalendar(KDateTime::UTC));
+    Event::Ptr event(new Event());
+    event->setDtStart(KDateTime(firstDay, QTime(10, 0), KDateTime::UTC));
+    QVERIFY(cal->addEvent(event));
+
+    // The snapshot waits for the update to finish, as it takes the read lock
+    SnapshotThread thread(cal.data());
+    event->startUpdates();
+    event->setDtStart(KDateTime(firstDay.addDays(1), QTime(10, 0), KDateTime::UTC));
+    thread.start();
+    QVERIFY(!thread.wait(200));
+    event->endUpdates();
+    QVERIFY(thread.wait(10000));
+
+    QVERIFY(thread.snapshot->isSnapshot());
+    QCOMPARE(thread.snapshot->rawEventsForDate(firstDay.addDays(1)), Event::List() << event);
+    QVERIFY(thread.snapshot->rawEventsForDate(firstDay).isEmpty());
+}
+
+void ConcurrentMemoryCalendarTest::testParallelReadsOfEmptyType()
+{
+    ConcurrentMemoryCalendar::Ptr cal(new ConcurrentMemoryCalendar(KDateTime::UTC));
+    Event::Ptr event(new Event());
+    event->setDtStart(KDateTime(firstDay, QTime(10, 0), KDateTime::UTC));
+    QVERIFY(cal->addEvent(event));
+
+    QList<EmptyTypeReaderThread *> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.append(new EmptyTypeReaderThread(cal));
+    }
+    foreach (EmptyTypeReaderThread *reader, readers) {
+        reader->start();
+    }
+    foreach (EmptyTypeReaderThread *reader, readers) {
+        QVERIFY(reader->wait());
+        QCOMPARE(reader->failures, 0);
+    }
+    qDeleteAll(readers);
+
+    QCOMPARE(cal->rawEvents(), Event::List() << event);
+}
+
+void ConcurrentMemoryCalendarTest::testReadersWithSnapshot()
+{
+    ConcurrentMemoryCalendar::Ptr cal(new ConcurrentMemoryCalendar(KDateTime::UTC));
+    QList<Event::Ptr> events;
+    for (int i = 0; i < dayCount; ++i) {
+        Event::Ptr event(new Event());
+        const KDateTime dtStart(firstDay.addDays(i), QTime(9, 0), KDateTime::UTC);
+        event->setDtStart(dtStart);
+        event->setDtEnd(dtStart.addSecs(3600));
+        QVERIFY(cal->addEvent(event));
+        events.append(event);
+    }
+
+    // The live calendar shares its maps with the snapshot, which the readers
+    // must neither detach nor modify
+    const MemoryCalendar::Ptr snapshot = cal->snapshot();
+    QList<EmptyTypeReaderThread *> readers;
+    QList<QueryThread *> queries;
+    for (int i = 0; i < 4; ++i) {
+        readers.append(new EmptyTypeReaderThread(cal));
+        queries.append(new QueryThread(cal));
+    }
+    for (int i = 0; i < readers.count(); ++i) {
+        readers.at(i)->start();
+        queries.at(i)->start();
+    }
+    for (int i = 0; i < readers.count(); ++i) {
+        QVERIFY(readers.at(i)->wait());
+        QVERIFY(queries.at(i)->wait());
+        QCOMPARE(readers.at(i)->failures, 0);
+    }
+    qDeleteAll(readers);
+    qDeleteAll(queries);
+
+    QCOMPARE(snapshot->rawEvents().count(), dayCount);
+    QCOMPARE(cal->rawEvents().count(), dayCount);
+    for (int i = 0; i < dayCount; i += 30) {
+        const QDate date = firstDay.addDays(i);
+        QCOMPARE(snapshot->rawEventsForDate(date), Event::List() << events.at(i));
+        QCOMPARE(cal->rawEventsForDate(date), Event::List() << events.at(i));
+    }
+    QVERIFY(snapshot->rawTodos().isEmpty());
+}
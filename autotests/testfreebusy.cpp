@@ -20,6 +20,9 @@
 */
 #include "testfreebusy.h"
 #include "freebusy.h"
+#include "event.h"
+
+#include <algorithm>
 
 #include <qtest.h>
 QTEST_MAIN(FreeBusyTest)
@@ -83,6 +86,138 @@ void FreeBusyTest::testAddSort()
 
 }
 
+void FreeBusyTest::testCoalesce()
+{
+    const KDateTime start(QDate(2007, 7, 23), QTime(7, 0, 0), KDateTime::UTC);
+
+    FreeBusyPeriod::List periods;
+    periods << FreeBusyPeriod(start.addSecs(7200), start.addSecs(9000));
+    periods << FreeBusyPeriod(start, start.addSecs(3600));
+    // Adjacent to the first one
+    periods << FreeBusyPeriod(start.addSecs(3600), start.addSecs(5400));
+    // Overlapping, but of another type
+    FreeBusyPeriod tentative(start.addSecs(1800), start.addSecs(7800));
+    tentative.setType(FreeBusyPeriod::BusyTentative);
+    periods << tentative;
+
+    FreeBusy fb;
+    fb.addPeriods(periods);
+    QCOMPARE(fb.fullBusyPeriods().count(), 4);
+    QVERIFY(!fb.coalescePeriods());
+
+    fb.setCoalescePeriods(true);
+    FreeBusyPeriod::List result = fb.fullBusyPeriods();
+    QCOMPARE(result.count(), 3);
+    QCOMPARE(result.at(0).start(), start);
+    QCOMPARE(result.at(0).end(), start.addSecs(5400));
+    QCOMPARE(result.at(1).type(), FreeBusyPeriod::BusyTentative);
+    QCOMPARE(result.at(2).start(), start.addSecs(7200));
+
+    // Bridges the gap between the two busy periods
+    fb.addPeriod(start.addSecs(5000), start.addSecs(7200));
+    result = fb.fullBusyPeriods();
+    QCOMPARE(result.count(), 2);
+    QCOMPARE(result.at(0).start(), start);
+    QCOMPARE(result.at(0).end(), start.addSecs(9000));
+    QCOMPARE(result.at(1).type(), FreeBusyPeriod::BusyTentative);
+    QCOMPARE(result.at(1).end(), start.addSecs(7800));
+
+    // Absorbs the busy period starting within it
+    fb.addPeriod(start.addSecs(-600), start.addSecs(10000));
+    result = fb.fullBusyPeriods();
+    QCOMPARE(result.count(), 2);
+    QCOMPARE(result.at(0).start(), start.addSecs(-600));
+    QCOMPARE(result.at(0).end(), start.addSecs(10000));
+    QCOMPARE(result.at(1).type(), FreeBusyPeriod::BusyTentative);
+}
+
+void FreeBusyTest::testMerge()
+{
+    const KDateTime start(QDate(2007, 7, 23), QTime(7, 0, 0), KDateTime::UTC);
+
+    FreeBusy::Ptr fb1(new FreeBusy(start, start.addDays(1)));
+    FreeBusy::Ptr fb2(new FreeBusy(start.addSecs(-3600), start.addDays(1)));
+    for (int i = 0; i < 10; ++i) {
+        fb1->addPeriod(start.addSecs((9 - i) * 7200), Duration(3600));
+        FreeBusyPeriod period(start.addSecs(i * 7200 + 1800), Duration(600));
+        period.setType(FreeBusyPeriod::BusyUnavailable);
+        fb2->addPeriods(FreeBusyPeriod::List() << period);
+    }
+
+    fb1->merge(fb2);
+    QCOMPARE(fb1->dtStart(), start.addSecs(-3600));
+    const FreeBusyPeriod::List periods = fb1->fullBusyPeriods();
+    QCOMPARE(periods.count(), 20);
+    for (int i = 0; i < periods.count(); ++i) {
+        QCOMPARE(periods.at(i).type(),
+                 i % 2 ? FreeBusyPeriod::BusyUnavailable : FreeBusyPeriod::Unknown);
+        if (i > 0) {
+            QVERIFY(periods.at(i - 1).start() < periods.at(i).start());
+        }
+    }
+}
+
+void FreeBusyTest::testEvents()
+{
+    const KDateTime start(QDate(2007, 7, 23), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime end(QDate(2007, 7, 25), QTime(23, 59, 59), KDateTime::UTC);
+    Event::List events;
+
+    // Every 6 hours, for an hour
+    Event::Ptr subDaily(new Event());
+    subDaily->setUid(QStringLiteral("subdaily"));
+    subDaily->setDtStart(start.addSecs(-86400 + 2 * 3600));
+    subDaily->setDtEnd(start.addSecs(-86400 + 3 * 3600));
+    subDaily->recurrence()->setHourly(6);
+    events << subDaily;
+
+    // Its occurrence at 14:00 on the first day is moved to 15:00
+    Event::Ptr exception(new Event(*subDaily));
+    exception->clearRecurrence();
+    exception->setRecurrenceId(start.addSecs(14 * 3600));
+    exception->setDtStart(start.addSecs(15 * 3600));
+    exception->setDtEnd(start.addSecs(16 * 3600));
+    events << exception;
+
+    // Every other day, all day
+    Event::Ptr allDay(new Event());
+    allDay->setUid(QStringLiteral("allday"));
+    allDay->setDtStart(KDateTime(QDate(2007, 7, 20), KDateTime::UTC));
+    allDay->setDtEnd(KDateTime(QDate(2007, 7, 20), KDateTime::UTC));
+    allDay->setAllDay(true);
+    allDay->recurrence()->setDaily(2);
+    events << allDay;
+
+    // Transparent events are free
+    Event::Ptr transparent(new Event());
+    transparent->setDtStart(start.addSecs(4 * 3600));
+    transparent->setDtEnd(start.addSecs(5 * 3600));
+    transparent->setTransparency(Event::Transparent);
+    events << transparent;
+
+    FreeBusy fb(events, start, end);
+    const Period::List periods = fb.busyPeriods();
+
+    // The sub-daily occurrences, one of them moved, and the all-day event
+    // on the second day
+    Period::List expected;
+    for (int day = 0; day < 3; ++day) {
+        for (int hour = 2; hour < 24; hour += 6) {
+            const int shift = day == 0 && hour == 14 ? 1 : 0;
+            const KDateTime dt = start.addDays(day).addSecs((hour + shift) * 3600);
+            expected << Period(dt, dt.addSecs(3600));
+        }
+    }
+    expected << Period(start.addDays(1), KDateTime(QDate(2007, 7, 24), QTime(23, 59, 59, 999), KDateTime::UTC));
+    std::stable_sort(expected.begin(), expected.end());
+
+    QCOMPARE(periods.count(), expected.count());
+    for (int i = 0; i < periods.count(); ++i) {
+        QCOMPARE(periods.at(i).start(), expected.at(i).start());
+        QCOMPARE(periods.at(i).end(), expected.at(i).end());
+    }
+}
+
 void FreeBusyTest::testAssign()
 {
     const KDateTime firstDateTime(QDate(2007, 7, 23), QTime(7, 0, 0), KDateTime::UTC);
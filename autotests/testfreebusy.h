@@ -30,6 +30,9 @@ class FreeBusyTest : public QObject
 private Q_SLOTS:
     void testValidity();
     void testAddSort();
+    void testCoalesce();
+    void testMerge();
+    void testEvents();
     void testAssign();
     void testDataStream();
 };
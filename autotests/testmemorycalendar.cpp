@@ -24,6 +24,7 @@
 #include "memorycalendar.h"
 
 #include <qdebug.h>
+#include <QtAlgorithms>
 
 #include <unistd.h>
 
@@ -32,6 +33,65 @@ QTEST_MAIN(MemoryCalendarTest)
 
 using namespace KCalCore;
 
+// The non-recurring part of MemoryCalendar::rawEvents(QDate, QDate) done by visiting every event
+static Event::List rawEventsByScan(const MemoryCalendar::Ptr &cal, const QDate &start, const QDate &end)
+{
+    const KDateTime st(start, cal->timeSpec());
+    const KDateTime nd(end, cal->timeSpec());
+    Event::List result;
+    foreach (const Event::Ptr &event, cal->rawEvents()) {
+        if (!event->recurs() && !(nd < event->dtStart()) && !(event->dtEnd() < st)) {
+            result.append(event);
+        }
+    }
+    return result;
+}
+
+static MemoryCalendar::Ptr createCalendarWithEvents(int count)
+{
+    MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
+    const KDateTime start(QDate(2015, 1, 1), QTime(8, 0), KDateTime::UTC);
+    for (int i = 0; i < count; ++i) {
+        Event::Ptr event(new Event());
+        // Spread the events over ten years with lengths from half an hour to several days
+        const KDateTime dtStart = start.addSecs(qint64(i) * 3650 * 86400 / count);
+        event->setDtStart(dtStart);
+        event->setDtEnd(dtStart.addSecs(1800 + (i % 7) * 17 * 3600));
+        cal->addEvent(event);
+    }
+    return cal;
+}
+
+class AddedCounter : public Calendar::CalendarObserver
+{
+public:
+    AddedCounter() : added(0), batches(0) {}
+
+    void calendarIncidenceAdded(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE
+    {
+        Q_UNUSED(incidence);
+        ++added;
+    }
+
+    int added;
+    int batches;
+};
+
+class BatchCounter : public AddedCounter, public Calendar::BatchObserver
+{
+public:
+    void calendarIncidencesAdded(const Incidence::List &incidences) Q_DECL_OVERRIDE
+    {
+        added += incidences.count();
+        ++batches;
+    }
+};
+
+static bool lessThanUid(const Event::Ptr &e1, const Event::Ptr &e2)
+{
+    return e1->uid() < e2->uid();
+}
+
 void MemoryCalendarTest::testValidity()
 {
     MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
@@ -268,3 +328,271 @@ void MemoryCalendarTest::testChangeRecurId()
     QVERIFY(main->summary() == event1->summary());
 }
 
+
+void MemoryCalendarTest::testRawEventsInRange()
+{
+    MemoryCalendar::Ptr cal = createCalendarWithEvents(500);
+
+    // An all-day event and a floating event next to a range boundary
+    Event::Ptr allDay(new Event());
+    allDay->setDtStart(KDateTime(QDate(2016, 3, 1), KDateTime::ClockTime));
+    allDay->setAllDay(true);
+    cal->addEvent(allDay);
+    Event::Ptr recurring(new Event());
+    recurring->setDtStart(KDateTime(QDate(2014, 1, 1), QTime(10, 0), KDateTime::UTC));
+    recurring->setDtEnd(KDateTime(QDate(2014, 1, 1), QTime(11, 0), KDateTime::UTC));
+    recurring->recurrence()->setWeekly(1);
+    cal->addEvent(recurring);
+
+    const QDate from(2016, 3, 1);
+    const QDate to(2016, 3, 31);
+    Event::List expected = rawEventsByScan(cal, from, to);
+    expected.append(recurring);
+    Event::List events = cal->rawEvents(from, to);
+    qSort(expected.begin(), expected.end(), lessThanUid);
+    qSort(events.begin(), events.end(), lessThanUid);
+    QCOMPARE(events, expected);
+    QVERIFY(events.contains(allDay));
+
+    // Moving an event out of the range must update the index
+    Event::Ptr moved = events.first() == allDay || events.first() == recurring ? events.last() : events.first();
+    QVERIFY(moved != allDay && moved != recurring);
+    moved->setDtStart(KDateTime(QDate(2030, 1, 1), QTime(8, 0), KDateTime::UTC));
+    moved->setDtEnd(KDateTime(QDate(2030, 1, 1), QTime(9, 0), KDateTime::UTC));
+    QVERIFY(!cal->rawEvents(from, to).contains(moved));
+    QVERIFY(cal->rawEvents(QDate(2030, 1, 1), QDate(2030, 1, 1)).contains(moved));
+
+    // Becoming recurring moves the event out of the interval index
+    const QDate later(2031, 6, 1);
+    moved->recurrence()->setDaily(1);
+    QVERIFY(cal->rawEvents(later, later).contains(moved));
+    moved->recurrence()->clear();
+    QVERIFY(!cal->rawEvents(later, later).contains(moved));
+
+    QVERIFY(cal->deleteEvent(allDay));
+    QVERIFY(!cal->rawEvents(from, to).contains(allDay));
+}
+
+void MemoryCalendarTest::benchmarkRawEventsInRange_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("indexed");
+
+    QTest::newRow("1000 events, full scan") << 1000 << false;
+    QTest::newRow("1000 events, indexed") << 1000 << true;
+    QTest::newRow("10000 events, full scan") << 10000 << false;
+    QTest::newRow("10000 events, indexed") << 10000 << true;
+    QTest::newRow("100000 events, full scan") << 100000 << false;
+    QTest::newRow("100000 events, indexed") << 100000 << true;
+}
+
+void MemoryCalendarTest::benchmarkRawEventsInRange()
+{
+    QFETCH(int, count);
+    QFETCH(bool, indexed);
+
+    MemoryCalendar::Ptr cal = createCalendarWithEvents(count);
+    const QDate from(2019, 6, 1);
+    const QDate to(2019, 6, 30);
+    const int expected = rawEventsByScan(cal, from, to).count();
+
+    int found = 0;
+    if (indexed) {
+        QBENCHMARK {
+            found = cal->rawEvents(from, to).count();
+        }
+    } else {
+        QBENCHMARK {
+            found = rawEventsByScan(cal, from, to).count();
+        }
+    }
+    QCOMPARE(found, expected);
+}
+
+void MemoryCalendarTest::testRecurringIncidencesForDate()
+{
+    MemoryCalendar::Ptr cal = createCalendarWithEvents(100);
+    const KDateTime start(QDate(2015, 3, 2), QTime(10, 0), KDateTime::UTC);
+
+    // Every Monday in March 2015, spanning until Wednesday
+    Event::Ptr weekly(new Event());
+    weekly->setDtStart(start);
+    weekly->setDtEnd(start.addDays(2));
+    weekly->recurrence()->setWeekly(1);
+    weekly->recurrence()->setEndDate(QDate(2015, 3, 31));
+    QVERIFY(cal->addEvent(weekly));
+
+    Todo::Ptr daily(new Todo());
+    daily->setDtStart(start);
+    daily->setDtDue(start.addSecs(3600));
+    daily->recurrence()->setDaily(1);
+    daily->recurrence()->setDuration(5);
+    QVERIFY(cal->addTodo(daily));
+
+    QVERIFY(cal->rawEventsForDate(QDate(2015, 3, 9)).contains(weekly));
+    QVERIFY(cal->rawEventsForDate(QDate(2015, 3, 11)).contains(weekly));
+    QVERIFY(!cal->rawEventsForDate(QDate(2015, 3, 12)).contains(weekly));
+    QVERIFY(!cal->rawEventsForDate(QDate(2015, 4, 6)).contains(weekly));
+    QVERIFY(!cal->rawEventsForDate(QDate(2015, 2, 23)).contains(weekly));
+
+    QVERIFY(cal->rawTodosForDate(QDate(2015, 3, 6)).contains(daily));
+    QVERIFY(!cal->rawTodosForDate(QDate(2015, 3, 7)).contains(daily));
+
+    // Extending the recurrence must update the registered bounds
+    weekly->recurrence()->setEndDate(QDate(2015, 4, 30));
+    QVERIFY(cal->rawEventsForDate(QDate(2015, 4, 6)).contains(weekly));
+    QVERIFY(cal->rawEvents(QDate(2015, 4, 6), QDate(2015, 4, 7)).contains(weekly));
+
+    weekly->recurrence()->clear();
+    QVERIFY(!cal->rawEventsForDate(QDate(2015, 4, 6)).contains(weekly));
+    QVERIFY(cal->rawEventsForDate(QDate(2015, 3, 3)).contains(weekly));
+}
+
+void MemoryCalendarTest::testInstancesByRecurrenceId()
+{
+    MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
+    const KDateTime start(QDate(2015, 1, 5), QTime(9, 0), KDateTime::UTC);
+
+    Event::Ptr master(new Event());
+    master->setDtStart(start);
+    master->setDtEnd(start.addSecs(3600));
+    master->recurrence()->setDaily(1);
+    QVERIFY(cal->addEvent(master));
+
+    // Add the exceptions in reverse order
+    for (int i = 99; i >= 0; --i) {
+        Incidence::Ptr exception = cal->createException(master, start.addDays(i));
+        QVERIFY(cal->addIncidence(exception));
+    }
+
+    QCOMPARE(cal->event(master->uid()), master);
+    QCOMPARE(cal->event(master->uid(), start.addDays(42))->recurrenceId(), start.addDays(42));
+    QVERIFY(!cal->event(master->uid(), start.addDays(42).addSecs(1)));
+    // The same instant in another time zone
+    QVERIFY(cal->event(master->uid(), start.addDays(42).toTimeSpec(KDateTime::Spec::OffsetFromUTC(3600))));
+
+    const Event::List exceptions = cal->eventInstances(master);
+    QCOMPARE(exceptions.count(), 100);
+    for (int i = 0; i < exceptions.count(); ++i) {
+        QCOMPARE(exceptions.at(i)->recurrenceId(), start.addDays(i));
+    }
+    const Incidence::List instances = cal->instances(master);
+    QCOMPARE(instances.count(), 100);
+    for (int i = 0; i < instances.count(); ++i) {
+        QCOMPARE(instances.at(i)->recurrenceId(), start.addDays(i));
+    }
+
+    // Changing the uid of an exception files it under the new uid
+    Event::Ptr moved = cal->event(master->uid(), start.addDays(10));
+    moved->setUid(QStringLiteral("moved"));
+    QCOMPARE(cal->event(QStringLiteral("moved"), start.addDays(10)), moved);
+    QVERIFY(!cal->event(master->uid(), start.addDays(10)));
+    QCOMPARE(cal->eventInstances(master).count(), 99);
+    QCOMPARE(cal->instance(moved->instanceIdentifier()), Incidence::Ptr(moved));
+
+    QVERIFY(cal->deleteEventInstances(master));
+    QVERIFY(cal->eventInstances(master).isEmpty());
+    QCOMPARE(cal->event(master->uid()), master);
+    QCOMPARE(cal->rawEvents().count(), 2);
+}
+
+void MemoryCalendarTest::testBatchAdding()
+{
+    MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
+    AddedCounter perIncidence;
+    BatchCounter perBatch;
+    cal->registerObserver(&perIncidence);
+    cal->registerObserver(&perBatch);
+
+    const KDateTime start(QDate(2015, 3, 2), QTime(10, 0), KDateTime::UTC);
+    cal->startBatchAdding();
+    Event::List events;
+    for (int i = 0; i < 100; ++i) {
+        Event::Ptr event(new Event());
+        event->setDtStart(start.addDays(i));
+        event->setDtEnd(start.addDays(i).addSecs(3600));
+        QVERIFY(cal->addEvent(event));
+        events.append(event);
+    }
+    Todo::Ptr child(new Todo());
+    child->setRelatedTo(events.first()->uid());
+    QVERIFY(cal->addTodo(child));
+
+    // Lookups by uid or identifier work while adding, nobody has been notified yet
+    QCOMPARE(cal->event(events.at(42)->uid()), events.at(42));
+    QCOMPARE(cal->instance(events.at(42)->instanceIdentifier()), Incidence::Ptr(events.at(42)));
+    QCOMPARE(perIncidence.added, 0);
+    QCOMPARE(perBatch.added, 0);
+
+    // Deleted before the batch ends
+    QVERIFY(cal->deleteEvent(events.takeLast()));
+
+    // Deleted and added again, it is only indexed and notified once
+    QVERIFY(cal->deleteEvent(events.at(3)));
+    QVERIFY(cal->addEvent(events.at(3)));
+
+    cal->endBatchAdding();
+    QVERIFY(!cal->batchAdding());
+    QCOMPARE(perIncidence.added, 100);
+    QCOMPARE(perBatch.added, 100);
+    QCOMPARE(perBatch.batches, 1);
+
+    QCOMPARE(cal->rawEventsForDate(start.addDays(42).date()), Event::List() << events.at(42));
+    QCOMPARE(cal->rawEventsForDate(start.addDays(3).date()), Event::List() << events.at(3));
+    QCOMPARE(cal->rawEvents(start.date(), start.addDays(99).date()).count(), 99);
+    QCOMPARE(cal->instance(events.at(7)->instanceIdentifier()), Incidence::Ptr(events.at(7)));
+    QCOMPARE(cal->relations(events.first()->uid()).count(), 1);
+
+    cal->unregisterObserver(&perIncidence);
+    cal->unregisterObserver(&perBatch);
+}
+
+void MemoryCalendarTest::testSnapshot()
+{
+    MemoryCalendar::Ptr cal = createCalendarWithEvents(100);
+    const Event::List events = cal->rawEvents();
+    const QDate day = events.first()->dtStart().date();
+
+    MemoryCalendar::Ptr snapshot = cal->snapshot();
+    QVERIFY(snapshot->isSnapshot());
+    QVERIFY(!cal->isSnapshot());
+    QCOMPARE(snapshot->timeSpec(), cal->timeSpec());
+
+    // Changes to the calendar don't show in the snapshot
+    Event::Ptr added(new Event());
+    added->setDtStart(KDateTime(day, QTime(20, 0), KDateTime::UTC));
+    QVERIFY(cal->addEvent(added));
+    QVERIFY(cal->deleteEvent(events.first()));
+    QCOMPARE(cal->rawEvents().count(), 100);
+    QCOMPARE(cal->rawEventsForDate(day), Event::List() << added);
+
+    QCOMPARE(snapshot->rawEvents().count(), 100);
+    QCOMPARE(snapshot->rawEventsForDate(day), Event::List() << events.first());
+    QCOMPARE(snapshot->event(events.first()->uid()), events.first());
+    QVERIFY(!snapshot->event(added->uid()));
+    QCOMPARE(snapshot->instance(events.first()->instanceIdentifier()), Incidence::Ptr(events.first()));
+
+    // The snapshot can't be modified
+    Event::Ptr rejected(new Event());
+    rejected->setDtStart(KDateTime(day, QTime(21, 0), KDateTime::UTC));
+    QVERIFY(!snapshot->addEvent(rejected));
+    QVERIFY(!snapshot->deleteEvent(events.at(1)));
+    QCOMPARE(snapshot->rawEvents().count(), 100);
+    QCOMPARE(cal->rawEvents().count(), 100);
+
+    // Incidences still being batch added are part of the snapshot too
+    Event::Ptr batched(new Event());
+    batched->setDtStart(KDateTime(day.addDays(1), QTime(6, 0), KDateTime::UTC));
+    cal->startBatchAdding();
+    QVERIFY(cal->addEvent(batched));
+    MemoryCalendar::Ptr batchSnapshot = cal->snapshot();
+    cal->endBatchAdding();
+    QVERIFY(batchSnapshot->rawEventsForDate(day.addDays(1)).contains(batched));
+
+    // Closing a snapshot doesn't affect the calendar
+    snapshot->close();
+    QCOMPARE(snapshot->rawEvents().count(), 0);
+    QCOMPARE(cal->rawEvents().count(), 101);
+    added->setSummary(QStringLiteral("still observed"));
+    QCOMPARE(cal->rawEventsForDate(day), Event::List() << added);
+}
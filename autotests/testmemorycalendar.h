@@ -34,6 +34,13 @@ private Q_SLOTS:
     void testRelationsCrash();
     void testRecurrenceExceptions();
     void testChangeRecurId();
+    void testRawEventsInRange();
+    void benchmarkRawEventsInRange_data();
+    void benchmarkRawEventsInRange();
+    void testRecurringIncidencesForDate();
+    void testInstancesByRecurrenceId();
+    void testBatchAdding();
+    void testSnapshot();
 };
 
 #endif
@@ -22,6 +22,8 @@
 
 #include <qtest.h>
 #include <qdebug.h>
+#include <QtCore/QBitArray>
+#include <ksystemtimezone.h>
 QTEST_MAIN(TestOccurrenceIterator)
 
 void TestOccurrenceIterator::testIterationWithExceptions()
@@ -297,3 +299,224 @@ void TestOccurrenceIterator::testJournals()
     KCalCore::OccurrenceIterator rIt2(calendar, tomorrow, tomorrow.addDays(1));
     QVERIFY(!rIt2.hasNext());
 }
+
+void TestOccurrenceIterator::testChronologicalOrder()
+{
+    KCalCore::MemoryCalendar calendar(KDateTime::UTC);
+
+    KDateTime start(QDate(2013, 03, 10), QTime(10, 0, 0), KDateTime::UTC);
+    KDateTime actualEnd(QDate(2013, 06, 10), QTime(10, 0, 0), KDateTime::UTC);
+
+    // Hourly during the first day, every 3 days and weekly
+    KCalCore::Event::Ptr hourly(new KCalCore::Event());
+    hourly->setUid(QStringLiteral("hourly"));
+    hourly->setDtStart(start.addSecs(30 * 60));
+    hourly->recurrence()->setHourly(1);
+    hourly->recurrence()->setDuration(24);
+    calendar.addEvent(hourly);
+
+    KCalCore::Event::Ptr threeDaily(new KCalCore::Event());
+    threeDaily->setUid(QStringLiteral("threeDaily"));
+    threeDaily->setDtStart(start.addSecs(2 * 60 * 60));
+    threeDaily->recurrence()->setDaily(3);
+    calendar.addEvent(threeDaily);
+
+    KCalCore::Event::Ptr weekly(new KCalCore::Event());
+    weekly->setUid(QStringLiteral("weekly"));
+    weekly->setDtStart(start.addDays(1));
+    weekly->recurrence()->setWeekly(1);
+    calendar.addEvent(weekly);
+
+    // An occurrence moved to before the previous occurrences of other incidences
+    const KDateTime recurrenceId = start.addDays(3).addSecs(2 * 60 * 60);
+    KCalCore::Event::Ptr moved(new KCalCore::Event());
+    moved->setUid(threeDaily->uid());
+    moved->setSummary(QStringLiteral("moved"));
+    moved->setRecurrenceId(recurrenceId);
+    moved->setDtStart(start.addDays(2));
+    calendar.addEvent(moved);
+
+    KCalCore::Event::Ptr single(new KCalCore::Event());
+    single->setUid(QStringLiteral("single"));
+    single->setDtStart(start.addDays(20));
+    calendar.addEvent(single);
+
+    // 24 hourly, 31 three-daily, 14 weekly and the single event
+    const int expected = 24 + 31 + 14 + 1;
+
+    KCalCore::OccurrenceIterator rIt(calendar, start, actualEnd);
+    KDateTime previous;
+    int occurrences = 0;
+    bool foundMoved = false;
+    while (rIt.hasNext()) {
+        rIt.next();
+        ++occurrences;
+        if (previous.isValid()) {
+            QVERIFY(!(rIt.occurrenceStartDate() < previous));
+        }
+        previous = rIt.occurrenceStartDate();
+        if (rIt.incidence() == moved) {
+            QCOMPARE(rIt.recurrenceId(), recurrenceId);
+            QCOMPARE(rIt.occurrenceStartDate(), moved->dtStart());
+            foundMoved = true;
+        }
+    }
+    QVERIFY(foundMoved);
+    QCOMPARE(occurrences, expected);
+
+    // Taking the first few occurrences only
+    KCalCore::OccurrenceIterator firstIt(calendar, start, actualEnd);
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(firstIt.hasNext());
+        firstIt.next();
+        QCOMPARE(firstIt.incidence(), KCalCore::Incidence::Ptr(i == 2 ? threeDaily : hourly));
+    }
+}
+
+void TestOccurrenceIterator::testOccurrencesInRange()
+{
+    KCalCore::MemoryCalendar calendar(KDateTime::UTC);
+
+    const KDateTime start(QDate(2013, 03, 10), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime end(QDate(2014, 03, 10), QTime(0, 0, 0), KDateTime::UTC);
+
+    for (int i = 0; i < 60; ++i) {
+        KCalCore::Event::Ptr event(new KCalCore::Event());
+        event->setUid(QStringLiteral("event%1").arg(i));
+        event->setDtStart(start.addDays(i % 7).addSecs(3600 * (i % 5)));
+        event->setDtEnd(event->dtStart().addSecs(1800));
+        switch (i % 4) {
+        case 0:
+            event->recurrence()->setDaily(1 + i % 3);
+            break;
+        case 1:
+            event->recurrence()->setWeekly(1);
+            break;
+        case 2:
+            event->recurrence()->setMonthly(1);
+            event->recurrence()->setDuration(5);
+            break;
+        case 3:
+            break;
+        }
+        calendar.addEvent(event);
+    }
+
+    // An occurrence moved to the same time as others, and a to-do
+    KCalCore::Event::Ptr moved(new KCalCore::Event());
+    moved->setUid(QStringLiteral("event0"));
+    moved->setRecurrenceId(start.addDays(10));
+    moved->setDtStart(start.addDays(11).addSecs(3600));
+    calendar.addEvent(moved);
+
+    KCalCore::Todo::Ptr todo(new KCalCore::Todo());
+    todo->setDtStart(start.addDays(1));
+    todo->setDtDue(start.addDays(1).addSecs(3600));
+    todo->recurrence()->setDaily(2);
+    calendar.addTodo(todo);
+
+    KCalCore::Calendar::OccurrenceList expected;
+    KCalCore::OccurrenceIterator it(calendar, start, end);
+    while (it.hasNext()) {
+        it.next();
+        KCalCore::Calendar::Occurrence occurrence;
+        occurrence.incidence = it.incidence();
+        occurrence.recurrenceId = it.recurrenceId();
+        occurrence.startDate = it.occurrenceStartDate();
+        expected.append(occurrence);
+    }
+    QVERIFY(expected.count() > 1000);
+
+    for (int threads = 0; threads <= 4; ++threads) {
+        const KCalCore::Calendar::OccurrenceList occurrences = calendar.occurrencesInRange(start, end, threads);
+        QCOMPARE(occurrences.count(), expected.count());
+        for (int i = 0; i < occurrences.count(); ++i) {
+            QCOMPARE(occurrences.at(i).incidence, expected.at(i).incidence);
+            QCOMPARE(occurrences.at(i).recurrenceId, expected.at(i).recurrenceId);
+            QCOMPARE(occurrences.at(i).startDate, expected.at(i).startDate);
+        }
+    }
+}
+
+// Identical rules, which share their caches, expanded by several threads at
+// once while the caches are built. Run under ThreadSanitizer to check that
+// the date/times handed between the threads are not written to.
+void TestOccurrenceIterator::testOccurrencesInRangeConcurrently()
+{
+    const KDateTime::Spec berlin(KSystemTimeZones::zone(QStringLiteral("Europe/Berlin")));
+    QVERIFY(berlin.isValid());
+
+    for (int round = 0; round < 10; ++round) {
+        KCalCore::MemoryCalendar calendar(KDateTime::UTC);
+        // A new start each round, so that the caches are cold
+        const KDateTime dtStart(QDate(2013, 03, 10), QTime(8, round, 0),
+                                round % 2 ? KDateTime::Spec::UTC() : KDateTime::Spec::ClockTime());
+        for (int i = 0; i < 200; ++i) {
+            KCalCore::Event::Ptr event(new KCalCore::Event());
+            event->setDtStart(dtStart);
+            event->setDtEnd(dtStart.addSecs(1800));
+            switch (i % 3) {
+            case 0:
+                event->recurrence()->setDaily(1);
+                break;
+            case 1:
+                event->recurrence()->setHourly(5);
+                event->recurrence()->setDuration(500);
+                break;
+            case 2:
+                event->recurrence()->setWeekly(1, QBitArray(7, true));
+                break;
+            }
+            calendar.addEvent(event);
+        }
+
+        // The range is in another time spec, so that the occurrences are
+        // converted when compared with it
+        const KDateTime start(QDate(2013, 03, 20), QTime(0, 0, 0), berlin);
+        const KDateTime end(QDate(2013, 05, 20), QTime(0, 0, 0), berlin);
+        const KCalCore::Calendar::OccurrenceList occurrences = calendar.occurrencesInRange(start, end, 4);
+
+        KCalCore::OccurrenceIterator it(calendar, start, end);
+        int i = 0;
+        while (it.hasNext()) {
+            it.next();
+            QVERIFY(i < occurrences.count());
+            QCOMPARE(occurrences.at(i).incidence, it.incidence());
+            QCOMPARE(occurrences.at(i).startDate, it.occurrenceStartDate());
+            ++i;
+        }
+        QCOMPARE(i, occurrences.count());
+        QVERIFY(i > 10000);
+    }
+}
+
+void TestOccurrenceIterator::testIncompleteOccurrenceList()
+{
+    KCalCore::MemoryCalendar calendar(KDateTime::UTC);
+
+    // The rule caches its first 10000 occurrences only, up to May 2042, and
+    // lists which reach past them are marked as incomplete
+    const KDateTime start(QDate(2015, 1, 1), QTime(10, 0, 0), KDateTime::UTC);
+    KCalCore::Event::Ptr event(new KCalCore::Event());
+    event->setUid(QStringLiteral("event"));
+    event->setDtStart(start);
+    event->recurrence()->setDaily(1);
+    event->recurrence()->defaultRRule()->setByHours(QList<int>() << 10);
+    event->recurrence()->setDuration(12000);
+    calendar.addEvent(event);
+
+    const KDateTime from(QDate(2042, 1, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime to(QDate(2043, 1, 1), QTime(0, 0, 0), KDateTime::UTC);
+    KCalCore::OccurrenceIterator rIt(calendar, from, to);
+    KDateTime expected(from.date(), QTime(10, 0, 0), KDateTime::UTC);
+    int count = 0;
+    while (rIt.hasNext()) {
+        rIt.next();
+        QVERIFY(rIt.recurrenceId().isValid());
+        QCOMPARE(rIt.occurrenceStartDate(), expected);
+        expected = expected.addDays(1);
+        ++count;
+    }
+    QCOMPARE(count, 365);
+}
+
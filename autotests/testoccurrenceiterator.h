@@ -30,6 +30,10 @@ private Q_SLOTS:
     void testWithExceptionThisAndFuture();
     void testSubDailyRecurrences();
     void testJournals();
+    void testChronologicalOrder();
+    void testOccurrencesInRange();
+    void testOccurrencesInRangeConcurrently();
+    void testIncompleteOccurrenceList();
 };
 
 #endif // TESTOCCURRENCEITERATOR_H
@@ -0,0 +1,782 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "testrecurrencerule.h"
+#include "filestorage.h"
+#include "icalformat.h"
+#include "memorycalendar.h"
+#include "recurrence.h"
+#include "recurrencerule.h"
+
+#include <QtCore/QBitArray>
+#include <QtCore/QDataStream>
+#include <QtCore/QDebug>
+#include <QtCore/QDirIterator>
+#include <ksystemtimezone.h>
+
+#include <qtest.h>
+QTEST_MAIN(RecurrenceRuleTest)
+
+using namespace KCalCore;
+
+Q_DECLARE_METATYPE(KCalCore::RecurrenceRule::PeriodType)
+
+// Checks that a rule gives the same results as the generic recurrence engine.
+// Daily, weekly and monthly rules which only select days are evaluated
+// directly; an explicit BYSECOND for the second of the start time keeps the
+// rule on the generic path, without changing its meaning.
+static void compareWithGenericRule(const RecurrenceRule &rule)
+{
+    RecurrenceRule generic(rule);
+    generic.setReadOnly(false);
+    generic.setBySeconds(QList<int>() << rule.startDt().time().second());
+
+    const KDateTime::Spec spec = rule.startDt().timeSpec();
+    const KDateTime start(rule.startDt().date().addDays(-10), QTime(0, 0, 0), spec);
+    const KDateTime end = start.addDays(2 * 366);
+
+    QCOMPARE(rule.endDt(), generic.endDt());
+
+    const DateTimeList times = rule.timesInInterval(start, end);
+    QVERIFY(times == generic.timesInInterval(start, end));
+
+    foreach (const KDateTime &dt, times) {
+        QVERIFY(rule.recursAt(dt));
+        QCOMPARE(rule.recursAt(dt.addSecs(3600)), generic.recursAt(dt.addSecs(3600)));
+        QCOMPARE(rule.durationTo(dt), generic.durationTo(dt));
+        QCOMPARE(rule.durationTo(dt.addSecs(-1)), generic.durationTo(dt.addSecs(-1)));
+    }
+
+    KDateTime next = start;
+    KDateTime previous = end;
+    for (int i = 0; i < 50; ++i) {
+        const KDateTime n = rule.getNextDate(next);
+        QCOMPARE(n, generic.getNextDate(next));
+        const KDateTime p = rule.getPreviousDate(previous);
+        QCOMPARE(p, generic.getPreviousDate(previous));
+        if (!n.isValid() && !p.isValid()) {
+            break;
+        }
+        next = n.isValid() ? n : next;
+        previous = p.isValid() ? p : previous;
+    }
+
+    for (QDate date = start.date(); date <= end.date(); date = date.addDays(1)) {
+        QCOMPARE(rule.recursOn(date, spec), generic.recursOn(date, spec));
+    }
+}
+
+void RecurrenceRuleTest::testSimpleRules_data()
+{
+    QTest::addColumn<RecurrenceRule::PeriodType>("type");
+    QTest::addColumn<int>("frequency");
+    QTest::addColumn<QList<int> >("byDays");
+    QTest::addColumn<QList<int> >("byMonthDays");
+    QTest::addColumn<int>("duration");
+    QTest::addColumn<bool>("allDay");
+    QTest::addColumn<QTime>("startTime");
+
+    const QList<int> none;
+    QTest::newRow("daily") << RecurrenceRule::rDaily << 1 << none << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("daily every third day") << RecurrenceRule::rDaily << 3 << none << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("daily on weekdays") << RecurrenceRule::rDaily << 1 << (QList<int>() << 1 << 2 << 3 << 4 << 5) << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("daily every other day on weekends") << RecurrenceRule::rDaily << 2 << (QList<int>() << 6 << 7) << none << 20 << false << QTime(22, 30, 0);
+    QTest::newRow("daily count") << RecurrenceRule::rDaily << 1 << none << none << 10 << true << QTime(22, 30, 0);
+    QTest::newRow("weekly") << RecurrenceRule::rWeekly << 1 << none << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("weekly before start day") << RecurrenceRule::rWeekly << 1 << (QList<int>() << 1 << 3 << 5) << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("biweekly count") << RecurrenceRule::rWeekly << 2 << (QList<int>() << 2 << 4 << 7) << none << 25 << false << QTime(22, 30, 0);
+    QTest::newRow("weekly until") << RecurrenceRule::rWeekly << 3 << (QList<int>() << 6) << none << 0 << true << QTime(22, 30, 0);
+    QTest::newRow("monthly") << RecurrenceRule::rMonthly << 1 << none << none << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("monthly on the 31st") << RecurrenceRule::rMonthly << 1 << none << (QList<int>() << 31) << -1 << false << QTime(22, 30, 0);
+    QTest::newRow("monthly on the last days") << RecurrenceRule::rMonthly << 2 << none << (QList<int>() << -1 << -30 << 28) << 30 << false << QTime(22, 30, 0);
+    // Occurrences at midnight are on their own day only
+    QTest::newRow("daily at midnight") << RecurrenceRule::rDaily << 1 << none << none << -1 << false << QTime(0, 0, 0);
+    QTest::newRow("weekly at midnight") << RecurrenceRule::rWeekly << 1 << (QList<int>() << 1 << 3 << 5) << none << -1 << false << QTime(0, 0, 0);
+    QTest::newRow("monthly at midnight") << RecurrenceRule::rMonthly << 1 << none << (QList<int>() << 1 << -1) << 12 << false << QTime(0, 0, 0);
+    QTest::newRow("quarterly until") << RecurrenceRule::rMonthly << 3 << none << (QList<int>() << 1 << 15) << 0 << true << QTime(22, 30, 0);
+    // Europe/Berlin skips from 02:00 to 03:00 on 2015-03-29
+    QTest::newRow("daily in the DST gap") << RecurrenceRule::rDaily << 1 << none << none << -1 << false << QTime(2, 30, 0);
+    QTest::newRow("weekly in the DST gap") << RecurrenceRule::rWeekly << 1 << (QList<int>() << 7) << none << 20 << false << QTime(2, 0, 0);
+    QTest::newRow("daily after the DST gap") << RecurrenceRule::rDaily << 1 << none << none << -1 << false << QTime(3, 0, 0);
+}
+
+void RecurrenceRuleTest::testSimpleRules()
+{
+    QFETCH(RecurrenceRule::PeriodType, type);
+    QFETCH(int, frequency);
+    QFETCH(QList<int>, byDays);
+    QFETCH(QList<int>, byMonthDays);
+    QFETCH(int, duration);
+    QFETCH(bool, allDay);
+    QFETCH(QTime, startTime);
+
+    // A Wednesday, so that some weekly occurrences are before the start
+    const QDate startDate(2015, 1, 28);
+    QList<KDateTime::Spec> specs;
+    specs << KDateTime::Spec::UTC()
+          << KDateTime::Spec::OffsetFromUTC(-5 * 3600)
+          << KDateTime::Spec::ClockTime()
+          << KDateTime::Spec(KSystemTimeZones::zone(QStringLiteral("Europe/Berlin")));
+    foreach (const KDateTime::Spec &spec, specs) {
+        RecurrenceRule rule;
+        rule.setRecurrenceType(type);
+        rule.setFrequency(frequency);
+        KDateTime dtStart(startDate, startTime, spec);
+        if (allDay) {
+            dtStart.setDateOnly(true);
+        }
+        rule.setStartDt(dtStart);
+        rule.setAllDay(allDay);
+        QList<RecurrenceRule::WDayPos> days;
+        foreach (int day, byDays) {
+            days << RecurrenceRule::WDayPos(0, day);
+        }
+        rule.setByDays(days);
+        rule.setByMonthDays(byMonthDays);
+        if (duration == 0) {
+            rule.setEndDt(dtStart.addDays(300));
+        } else {
+            rule.setDuration(duration);
+        }
+
+        compareWithGenericRule(rule);
+        if (QTest::currentTestFailed()) {
+            return;
+        }
+    }
+}
+
+void RecurrenceRuleTest::testTestData_data()
+{
+    QTest::addColumn<QString>("fileName");
+
+    QDirIterator it(QStringLiteral(ICALTESTDATADIR "RecurrenceRule"),
+                    QStringList() << QStringLiteral("*.ics"),
+                    QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        const QString fileName = it.next();
+        QTest::newRow(QFile::encodeName(fileName).constData()) << fileName;
+    }
+}
+
+void RecurrenceRuleTest::testTestData()
+{
+    QFETCH(QString, fileName);
+
+    MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
+    FileStorage store(cal, fileName);
+    QVERIFY(store.load());
+
+    foreach (const Incidence::Ptr &incidence, cal->incidences()) {
+        const RecurrenceRule::List rules =
+            incidence->recurrence()->rRules() + incidence->recurrence()->exRules();
+        foreach (RecurrenceRule *rule, rules) {
+            if (!rule->bySeconds().isEmpty() || !rule->startDt().isValid()) {
+                continue;
+            }
+            compareWithGenericRule(*rule);
+            if (QTest::currentTestFailed()) {
+                qWarning() << incidence->summary() << rule->rrule();
+                return;
+            }
+        }
+    }
+}
+
+void RecurrenceRuleTest::benchmarkTimesInInterval_data()
+{
+    testTestData_data();
+}
+
+// Measures the generic recurrence engine on the rules of the test data, which
+// have no cached occurrences to fall back on.
+void RecurrenceRuleTest::benchmarkTimesInInterval()
+{
+    QFETCH(QString, fileName);
+
+    MemoryCalendar::Ptr cal(new MemoryCalendar(KDateTime::UTC));
+    FileStorage store(cal, fileName);
+    QVERIFY(store.load());
+
+    QList<RecurrenceRule *> rules;
+    foreach (const Incidence::Ptr &incidence, cal->incidences()) {
+        foreach (RecurrenceRule *rule, incidence->recurrence()->rRules()) {
+            if (rule->duration() <= 0 && rule->startDt().isValid()) {
+                rules << rule;
+            }
+        }
+    }
+    if (rules.isEmpty()) {
+        QSKIP("No rule without count");
+    }
+
+    const KDateTime start(QDate(2015, 1, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime end = start.addDays(365).addSecs(-1);
+    int expected = 0;
+    foreach (RecurrenceRule *rule, rules) {
+        expected += rule->timesInInterval(start, end).count();
+    }
+
+    const int defaultSize = RecurrenceRule::occurrenceCacheSize();
+    RecurrenceRule::setOccurrenceCacheSize(0);
+    int count = 0;
+    QBENCHMARK {
+        count = 0;
+        foreach (RecurrenceRule *rule, rules) {
+            count += rule->timesInInterval(start, end).count();
+        }
+    }
+    RecurrenceRule::setOccurrenceCacheSize(defaultSize);
+    QCOMPARE(count, expected);
+}
+
+// Queries a rule over overlapping windows which move forwards and backwards,
+// returning all the results.
+static QList<DateTimeList> queryRule(const RecurrenceRule &rule)
+{
+    QList<DateTimeList> results;
+    const KDateTime start(QDate(2015, 3, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const int offsets[] = { 0, 10, 10, 25, 70, 60, 5, 0, 200, 190 };
+    for (unsigned i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        const KDateTime from = start.addDays(offsets[i]);
+        results << rule.timesInInterval(from, from.addDays(31).addSecs(-1));
+    }
+
+    DateTimeList nextDates;
+    DateTimeList previousDates;
+    KDateTime next = start.addDays(-40);
+    KDateTime previous = start.addDays(120);
+    for (int i = 0; i < 100; ++i) {
+        next = rule.getNextDate(next);
+        previous = rule.getPreviousDate(previous);
+        nextDates << next;
+        previousDates << previous;
+    }
+    results << nextDates << previousDates;
+    return results;
+}
+
+void RecurrenceRuleTest::testOccurrenceCache()
+{
+    const int defaultSize = RecurrenceRule::occurrenceCacheSize();
+
+    RecurrenceRule rule;
+    rule.setRecurrenceType(RecurrenceRule::rWeekly);
+    rule.setFrequency(1);
+    rule.setStartDt(KDateTime(QDate(2015, 1, 28), QTime(9, 0, 0), KDateTime::UTC));
+    rule.setByDays(QList<RecurrenceRule::WDayPos>()
+                   << RecurrenceRule::WDayPos(0, 1) << RecurrenceRule::WDayPos(0, 3));
+    rule.setByHours(QList<int>() << 9 << 17);
+
+    RecurrenceRule::setOccurrenceCacheSize(0);
+    const QList<DateTimeList> expected = queryRule(rule);
+    QCOMPARE(expected.count(), 12);
+    QCOMPARE(expected.at(0).count(), 18);
+    QVERIFY(expected.last().first().isValid());
+    rule.setByHours(QList<int>() << 12);
+    const QList<DateTimeList> expectedChanged = queryRule(rule);
+    rule.setByHours(QList<int>() << 9 << 17);
+
+    // A window smaller than one query, and one which holds them all
+    const int sizes[] = { 10, 1000 };
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        RecurrenceRule::setOccurrenceCacheSize(sizes[i]);
+        QCOMPARE(RecurrenceRule::occurrenceCacheSize(), sizes[i]);
+        RecurrenceRule::resetOccurrenceCacheStatistics();
+        QCOMPARE(RecurrenceRule::occurrenceCacheHits(), 0);
+        QCOMPARE(RecurrenceRule::occurrenceCacheMisses(), 0);
+
+        QCOMPARE(queryRule(rule), expected);
+        QCOMPARE(queryRule(rule), expected);
+        QVERIFY(RecurrenceRule::occurrenceCacheHits() > 0);
+        QVERIFY(RecurrenceRule::occurrenceCacheMisses() > 0);
+
+        // Changing the rule drops the cached occurrences
+        rule.setByHours(QList<int>() << 12);
+        QCOMPARE(queryRule(rule), expectedChanged);
+        rule.setByHours(QList<int>() << 9 << 17);
+        QCOMPARE(queryRule(rule), expected);
+    }
+
+    // Rules with a fixed number of occurrences don't use the window
+    rule.setDuration(50);
+    RecurrenceRule::resetOccurrenceCacheStatistics();
+    queryRule(rule);
+    QCOMPARE(RecurrenceRule::occurrenceCacheHits(), 0);
+    QCOMPARE(RecurrenceRule::occurrenceCacheMisses(), 0);
+
+    RecurrenceRule::setOccurrenceCacheSize(defaultSize);
+}
+
+void RecurrenceRuleTest::testSharedRules()
+{
+    RecurrenceRule rule;
+    rule.setRecurrenceType(RecurrenceRule::rDaily);
+    rule.setFrequency(2);
+    rule.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0), KDateTime::UTC));
+    rule.setByHours(QList<int>() << 8 << 20);
+
+    RecurrenceRule other;
+    other.setRecurrenceType(RecurrenceRule::rDaily);
+    other.setFrequency(2);
+    other.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0), KDateTime::UTC));
+    other.setByHours(QList<int>() << 8 << 20);
+    QVERIFY(rule == other);
+
+    const KDateTime start(QDate(2015, 7, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime end = start.addDays(30);
+    RecurrenceRule::resetOccurrenceCacheStatistics();
+    const DateTimeList times = rule.timesInInterval(start, end);
+    QCOMPARE(times.count(), 30);
+    QCOMPARE(RecurrenceRule::occurrenceCacheMisses(), 1);
+
+    // The occurrences computed for the first rule serve the identical one
+    QCOMPARE(other.timesInInterval(start, end), times);
+    QCOMPARE(RecurrenceRule::occurrenceCacheHits(), 1);
+    QCOMPARE(RecurrenceRule::occurrenceCacheMisses(), 1);
+
+    // Changing one of the rules leaves the other alone
+    other.setByHours(QList<int>() << 12);
+    const DateTimeList otherTimes = other.timesInInterval(start, end);
+    QCOMPARE(otherTimes.count(), 15);
+    QCOMPARE(otherTimes.first(), KDateTime(QDate(2015, 7, 1), QTime(12, 0, 0), KDateTime::UTC));
+    QCOMPARE(rule.timesInInterval(start, end), times);
+    QCOMPARE(rule.getNextDate(start), times.first());
+
+    // Copies share the compiled rule, and stay the same when streamed
+    RecurrenceRule copy(rule);
+    QCOMPARE(copy.timesInInterval(start, end), times);
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << &rule;
+    RecurrenceRule streamed;
+    QDataStream in(data);
+    in >> &streamed;
+    QVERIFY(streamed == rule);
+    QCOMPARE(streamed.timesInInterval(start, end), times);
+    QCOMPARE(streamed.getPreviousDate(end), times.last());
+
+    // Zones are only streamed by name, so rules in different zones with the
+    // same name must not share their occurrences
+    const KTimeZone berlin = KSystemTimeZones::zone(QStringLiteral("Europe/Berlin"));
+    QVERIFY(berlin.isValid());
+    const KTimeZone fakeBerlin(QStringLiteral("Europe/Berlin"));
+    RecurrenceRule zoned;
+    zoned.setRecurrenceType(RecurrenceRule::rDaily);
+    zoned.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0), berlin));
+    RecurrenceRule fakeZoned(zoned);
+    fakeZoned.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0), fakeBerlin));
+    const DateTimeList zonedTimes = zoned.timesInInterval(start, end);
+    const DateTimeList fakeZonedTimes = fakeZoned.timesInInterval(start, end);
+    QCOMPARE(zonedTimes.count(), 30);
+    QCOMPARE(fakeZonedTimes.count(), 30);
+    QCOMPARE(zonedTimes.first().toUtc(), KDateTime(QDate(2015, 7, 1), QTime(6, 0, 0), KDateTime::UTC));
+    QCOMPARE(fakeZonedTimes.first().toUtc(), KDateTime(QDate(2015, 7, 1), QTime(8, 0, 0), KDateTime::UTC));
+
+    // while rules in the same zone do
+    RecurrenceRule zonedHours;
+    zonedHours.setRecurrenceType(RecurrenceRule::rDaily);
+    zonedHours.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0), berlin));
+    zonedHours.setByHours(QList<int>() << 8 << 20);
+    RecurrenceRule sameZonedHours;
+    sameZonedHours.setRecurrenceType(RecurrenceRule::rDaily);
+    sameZonedHours.setStartDt(KDateTime(QDate(2015, 6, 1), QTime(8, 0, 0),
+                                        KSystemTimeZones::zone(QStringLiteral("Europe/Berlin"))));
+    sameZonedHours.setByHours(QList<int>() << 8 << 20);
+    RecurrenceRule::resetOccurrenceCacheStatistics();
+    const DateTimeList zonedHoursTimes = zonedHours.timesInInterval(start, end);
+    QCOMPARE(zonedHoursTimes.count(), 60);
+    QCOMPARE(sameZonedHours.timesInInterval(start, end), zonedHoursTimes);
+    QCOMPARE(RecurrenceRule::occurrenceCacheHits(), 1);
+    QCOMPARE(RecurrenceRule::occurrenceCacheMisses(), 1);
+}
+
+void RecurrenceRuleTest::testMatchingRules_data()
+{
+    QTest::addColumn<QString>("rrule");
+
+    QTest::newRow("months and positions") << QStringLiteral("FREQ=YEARLY;BYMONTH=1,7;BYDAY=1MO,-1FR");
+    QTest::newRow("positions in the year") << QStringLiteral("FREQ=YEARLY;BYDAY=20MO,-2SU,TH");
+    QTest::newRow("monthly positions and hours") << QStringLiteral("FREQ=MONTHLY;BYDAY=2TU,-1SU;BYHOUR=9,18");
+    QTest::newRow("week numbers") << QStringLiteral("FREQ=YEARLY;BYWEEKNO=1,20,-1;BYDAY=MO,SA");
+    QTest::newRow("year days") << QStringLiteral("FREQ=YEARLY;BYYEARDAY=1,100,-1,-200");
+    QTest::newRow("month days") << QStringLiteral("FREQ=MONTHLY;INTERVAL=2;BYMONTHDAY=-1,15,31;BYHOUR=8");
+    QTest::newRow("set positions") << QStringLiteral("FREQ=MONTHLY;BYDAY=MO,TU,WE,TH,FR;BYSETPOS=-1,3");
+    QTest::newRow("half hours") << QStringLiteral("FREQ=DAILY;BYMONTH=2,3;BYMINUTE=0,30;BYHOUR=23,0");
+    QTest::newRow("duplicate values") << QStringLiteral("FREQ=WEEKLY;BYDAY=TU,TU,SA;BYHOUR=7,7");
+}
+
+void RecurrenceRuleTest::testMatchingRules()
+{
+    QFETCH(QString, rrule);
+
+    RecurrenceRule rule;
+    ICalFormat format;
+    QVERIFY(format.fromString(&rule, rrule));
+    rule.setStartDt(KDateTime(QDate(2014, 1, 10), QTime(7, 0, 0), KDateTime::UTC));
+
+    const KDateTime::Spec spec = KDateTime::Spec::UTC();
+    const QDate first(2014, 1, 1);
+    const QBitArray recurDays = rule.recursOnRange(first, first.addYears(3).addDays(-1), spec);
+    QCOMPARE(recurDays.size(), static_cast<int>(first.daysTo(first.addYears(3))));
+    int days = 0;
+    for (QDate date = first; date < first.addYears(3); date = date.addDays(1)) {
+        const KDateTime start(date, QTime(0, 0, 0), spec);
+        const DateTimeList times = rule.timesInInterval(start, start.addDays(1).addSecs(-1));
+        QCOMPARE(rule.recursOn(date, spec), !times.isEmpty());
+        QCOMPARE(recurDays.testBit(first.daysTo(date)), !times.isEmpty());
+        const TimeList recurTimes = rule.recurTimesOn(date, spec);
+        QCOMPARE(recurTimes.count(), times.count());
+        foreach (const KDateTime &dt, times) {
+            QVERIFY(rule.dateMatchesRules(dt));
+            QVERIFY(recurTimes.contains(dt.time()));
+        }
+        if (!times.isEmpty()) {
+            ++days;
+        }
+    }
+    QVERIFY(days > 3);
+}
+
+void RecurrenceRuleTest::testRecursOnRange_data()
+{
+    QTest::addColumn<bool>("allDay");
+    QTest::addColumn<int>("offset");
+
+    QTest::newRow("UTC") << false << 0;
+    QTest::newRow("ahead of UTC") << false << 3 * 3600;
+    QTest::newRow("behind UTC") << false << -10 * 3600;
+    QTest::newRow("all day") << true << 3 * 3600;
+}
+
+void RecurrenceRuleTest::testRecursOnRange()
+{
+    QFETCH(bool, allDay);
+    QFETCH(int, offset);
+
+    const KDateTime::Spec spec(KDateTime::OffsetFromUTC, offset);
+    KDateTime dtStart(QDate(2015, 3, 2), QTime(22, 30, 0), KDateTime::UTC);
+    if (allDay) {
+        dtStart.setDateOnly(true);
+    }
+    Recurrence recurrence;
+    recurrence.setStartDateTime(dtStart);
+    recurrence.setAllDay(allDay);
+    recurrence.setMonthly(1);
+    recurrence.addMonthlyDate(2);
+    recurrence.addMonthlyDate(17);
+    recurrence.addMonthlyDate(28);
+
+    RecurrenceRule *exrule = new RecurrenceRule();
+    exrule->setRecurrenceType(RecurrenceRule::rYearly);
+    exrule->setStartDt(dtStart);
+    exrule->setByMonths(QList<int>() << 6);
+    recurrence.addExRule(exrule);
+    recurrence.addExDate(QDate(2015, 4, 17));
+    recurrence.addRDate(QDate(2015, 4, 20));
+    recurrence.addExDateTime(KDateTime(QDate(2015, 5, 2), QTime(22, 30, 0), KDateTime::UTC));
+    recurrence.addRDateTime(KDateTime(QDate(2015, 5, 5), QTime(23, 45, 0), KDateTime::UTC));
+
+    const QDate first(2015, 2, 20);
+    const QDate last(2016, 2, 20);
+    const QBitArray recurDays = recurrence.recursOnRange(first, last, spec);
+    QCOMPARE(recurDays.size(), static_cast<int>(first.daysTo(last)) + 1);
+    int days = 0;
+    for (QDate date = first; date <= last; date = date.addDays(1)) {
+        QCOMPARE(recurDays.testBit(first.daysTo(date)), recurrence.recursOn(date, spec));
+        if (recurDays.testBit(first.daysTo(date))) {
+            ++days;
+        }
+    }
+    QVERIFY(days > 20);
+
+    QVERIFY(recurrence.recursOnRange(last, first, spec).isEmpty());
+    QCOMPARE(recurrence.recursOnRange(first, first.addDays(9), spec).count(true), 0);
+}
+
+void RecurrenceRuleTest::testManyExceptions()
+{
+    const KDateTime dtStart(QDate(2000, 1, 3), QTime(9, 0, 0), KDateTime::UTC);
+    Recurrence recurrence;
+    recurrence.setStartDateTime(dtStart);
+    recurrence.setDaily(1);
+
+    // Years of cancelled meetings, with a few extra ones
+    DateList exDates;
+    DateTimeList exDateTimes;
+    DateList rDates;
+    for (int i = 0; i < 6000; ++i) {
+        if (i % 3 == 0) {
+            exDates << dtStart.date().addDays(i);
+        } else if (i % 7 == 0) {
+            exDateTimes << dtStart.addDays(i);
+        } else if (i % 100 == 1) {
+            exDateTimes << dtStart.addDays(i).addSecs(60);   // no such occurrence
+            rDates << dtStart.date().addDays(i);              // already an occurrence
+        }
+    }
+    recurrence.setExDates(exDates);
+    recurrence.setExDateTimes(exDateTimes);
+    recurrence.setRDates(rDates);
+    recurrence.addRDateTime(dtStart.addDays(10).addSecs(3600));
+
+    const KDateTime start = dtStart.addDays(1000);
+    const KDateTime end = dtStart.addDays(4000).addSecs(-1);
+    const DateTimeList times = recurrence.timesInInterval(start, end);
+
+    DateTimeList expected;
+    for (int i = 1000; i < 4000; ++i) {
+        if (i % 3 != 0 && i % 7 != 0) {
+            expected << dtStart.addDays(i);
+        }
+    }
+    QCOMPARE(times.count(), expected.count());
+    QCOMPARE(times, expected);
+    foreach (const KDateTime &dt, times) {
+        QVERIFY(recurrence.recursAt(dt));
+    }
+
+    // The extra time is only included if it's in the interval
+    const DateTimeList first = recurrence.timesInInterval(dtStart, dtStart.addDays(11));
+    QVERIFY(first.contains(dtStart.addDays(10).addSecs(3600)));
+    QCOMPARE(first.count(), 8);
+}
+
+void RecurrenceRuleTest::testOldSubDailyRules_data()
+{
+    QTest::addColumn<QString>("rrule");
+    QTest::addColumn<int>("count");
+    QTest::addColumn<KDateTime>("first");
+    QTest::addColumn<KDateTime>("last");
+
+    const KDateTime::Spec utc = KDateTime::Spec::UTC();
+    QTest::newRow("hours on Mondays")
+            << QStringLiteral("FREQ=MINUTELY;INTERVAL=15;BYHOUR=9,17;BYDAY=MO") << 40
+            << KDateTime(QDate(2025, 3, 3), QTime(9, 0, 0), utc)
+            << KDateTime(QDate(2025, 3, 31), QTime(17, 45, 0), utc);
+    QTest::newRow("minutes")
+            << QStringLiteral("FREQ=MINUTELY;BYMINUTE=0,30;BYHOUR=12") << 62
+            << KDateTime(QDate(2025, 3, 1), QTime(12, 0, 0), utc)
+            << KDateTime(QDate(2025, 3, 31), QTime(12, 30, 0), utc);
+    QTest::newRow("set position")
+            << QStringLiteral("FREQ=HOURLY;BYHOUR=6;BYMONTHDAY=15;BYSETPOS=1") << 1
+            << KDateTime(QDate(2025, 3, 15), QTime(6, 0, 0), utc)
+            << KDateTime(QDate(2025, 3, 15), QTime(6, 0, 0), utc);
+    QTest::newRow("seconds")
+            << QStringLiteral("FREQ=SECONDLY;INTERVAL=20;BYMINUTE=5;BYHOUR=8;BYDAY=SU;BYMONTHDAY=1,2,3,4,5,6,7") << 3
+            << KDateTime(QDate(2025, 3, 2), QTime(8, 5, 0), utc)
+            << KDateTime(QDate(2025, 3, 2), QTime(8, 5, 40), utc);
+    QTest::newRow("none this month")
+            << QStringLiteral("FREQ=MINUTELY;BYMONTH=2;BYMONTHDAY=29;BYHOUR=0;BYMINUTE=0") << 0
+            << KDateTime() << KDateTime();
+}
+
+// Sub-daily rules which started twenty years before the time queried
+void RecurrenceRuleTest::testOldSubDailyRules()
+{
+    QFETCH(QString, rrule);
+    QFETCH(int, count);
+    QFETCH(KDateTime, first);
+    QFETCH(KDateTime, last);
+
+    RecurrenceRule rule;
+    ICalFormat format;
+    QVERIFY(format.fromString(&rule, rrule));
+    rule.setStartDt(KDateTime(QDate(2005, 1, 2), QTime(0, 0, 0), KDateTime::UTC));
+
+    const KDateTime start(QDate(2025, 3, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const KDateTime end(QDate(2025, 4, 1), QTime(0, 0, 0), KDateTime::UTC);
+    const DateTimeList times = rule.timesInInterval(start, end.addSecs(-1));
+    QCOMPARE(times.count(), count);
+    if (count == 0) {
+        // The leap days are still found, years away
+        QCOMPARE(rule.getNextDate(start), KDateTime(QDate(2028, 2, 29), QTime(0, 0, 0), KDateTime::UTC));
+        QCOMPARE(rule.getPreviousDate(start), KDateTime(QDate(2024, 2, 29), QTime(0, 0, 0), KDateTime::UTC));
+        return;
+    }
+    QCOMPARE(times.first(), first);
+    QCOMPARE(times.last(), last);
+    foreach (const KDateTime &dt, times) {
+        QVERIFY(rule.recursAt(dt));
+    }
+
+    QCOMPARE(rule.getNextDate(start), first);
+    QCOMPARE(rule.getPreviousDate(end), last);
+    DateTimeList next;
+    for (KDateTime dt = rule.getNextDate(start); dt.isValid() && dt < end; dt = rule.getNextDate(dt)) {
+        next << dt;
+    }
+    QCOMPARE(next, times);
+}
+
+void RecurrenceRuleTest::testDaylightSavings_data()
+{
+    QTest::addColumn<KDateTime>("start");
+    QTest::addColumn<int>("count");
+
+    const KDateTime::Spec berlin(KSystemTimeZones::zone(QStringLiteral("Europe/Berlin")));
+    // 02:00 to 02:59 is skipped
+    QTest::newRow("spring") << KDateTime(QDate(2015, 3, 28), QTime(22, 0, 0), berlin) << 8;
+    // 02:00 to 02:59 is repeated
+    QTest::newRow("autumn") << KDateTime(QDate(2015, 10, 24), QTime(22, 0, 0), berlin) << 10;
+}
+
+// Hourly occurrences across a daylight savings shift are an hour apart
+void RecurrenceRuleTest::testDaylightSavings()
+{
+    QFETCH(KDateTime, start);
+    QFETCH(int, count);
+    QVERIFY(start.isValid());
+
+    RecurrenceRule rule;
+    rule.setRecurrenceType(RecurrenceRule::rHourly);
+    rule.setStartDt(start);
+
+    const KDateTime end(start.date().addDays(1), QTime(6, 0, 0), start.timeSpec());
+    const DateTimeList times = rule.timesInInterval(start, end);
+    QCOMPARE(times.count(), count);
+    QCOMPARE(times.first(), start);
+    QCOMPARE(times.last(), end);
+    for (int i = 1; i < times.count(); ++i) {
+        QCOMPARE(times[i - 1].secsTo(times[i]), 3600);
+        QVERIFY(rule.recursAt(times[i]));
+        QCOMPARE(rule.getNextDate(times[i - 1]), times[i]);
+    }
+}
+
+void RecurrenceRuleTest::testCountEnd_data()
+{
+    QTest::addColumn<QString>("rrule");
+    QTest::addColumn<KDateTime>("until");
+    QTest::addColumn<bool>("complete");
+
+    const QTime midnight(0, 0, 0);
+    QTest::newRow("hourly") << QStringLiteral("FREQ=HOURLY;INTERVAL=3;COUNT=5000")
+                            << KDateTime(QDate(2007, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("weekly") << QStringLiteral("FREQ=WEEKLY;BYDAY=MO,WE,FR;COUNT=2000")
+                            << KDateTime(QDate(2018, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("monthly day") << QStringLiteral("FREQ=MONTHLY;BYMONTHDAY=31;COUNT=500")
+                                 << KDateTime(QDate(2080, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("last friday") << QStringLiteral("FREQ=MONTHLY;BYDAY=-1FR;COUNT=300")
+                                 << KDateTime(QDate(2031, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("leap day") << QStringLiteral("FREQ=YEARLY;BYMONTH=2;BYMONTHDAY=29;COUNT=20")
+                              << KDateTime(QDate(2090, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("minutely") << QStringLiteral("FREQ=MINUTELY;INTERVAL=30;BYHOUR=9,10;COUNT=1000")
+                              << KDateTime(QDate(2006, 1, 1), midnight, KDateTime::UTC) << true;
+    QTest::newRow("none") << QStringLiteral("FREQ=MONTHLY;BYMONTH=2;BYMONTHDAY=30;COUNT=3")
+                          << KDateTime(QDate(2010, 1, 1), midnight, KDateTime::UTC) << false;
+}
+
+void RecurrenceRuleTest::testCountEnd()
+{
+    QFETCH(QString, rrule);
+    QFETCH(KDateTime, until);
+    QFETCH(bool, complete);
+
+    RecurrenceRule rule;
+    ICalFormat format;
+    QVERIFY(format.fromString(&rule, rrule));
+    const KDateTime start(QDate(2005, 1, 3), QTime(10, 0, 0), KDateTime::UTC);
+    rule.setStartDt(start);
+
+    // The occurrences, found by a rule without a count
+    RecurrenceRule infinite(rule);
+    infinite.setDuration(-1);
+    const DateTimeList expected = infinite.timesInInterval(start, until).mid(0, rule.duration());
+    QCOMPARE(expected.count() == rule.duration(), complete);
+
+    // The end is found before any occurrences are cached
+    bool ok = !complete;
+    const KDateTime end = rule.endDt(&ok);
+    QCOMPARE(ok, complete);
+    if (!complete) {
+        QVERIFY(!end.isValid());
+        QCOMPARE(rule.durationTo(until), 0);
+        return;
+    }
+    QCOMPARE(end, expected.last());
+    const int step = expected.count() / 7 + 1;
+    for (int i = 0; i < expected.count(); i += step) {
+        QCOMPARE(rule.durationTo(expected[i]), i + 1);
+        QCOMPARE(rule.durationTo(expected[i].addSecs(-1)), i);
+    }
+    QCOMPARE(rule.durationTo(until), rule.duration());
+
+    // And stays the same once they are
+    QCOMPARE(rule.timesInInterval(start, until), expected);
+    QCOMPARE(rule.endDt(), end);
+    for (int i = 0; i < expected.count(); i += step) {
+        QCOMPARE(rule.durationTo(expected[i]), i + 1);
+        QCOMPARE(rule.durationTo(expected[i].addSecs(-1)), i);
+    }
+}
+
+void RecurrenceRuleTest::testCursor_data()
+{
+    QTest::addColumn<QString>("rrule");
+
+    QTest::newRow("daily") << QStringLiteral("FREQ=DAILY");
+    QTest::newRow("last friday") << QStringLiteral("FREQ=MONTHLY;BYDAY=-1FR");
+    QTest::newRow("leap day") << QStringLiteral("FREQ=YEARLY;BYMONTH=2;BYMONTHDAY=29");
+    QTest::newRow("minutely") << QStringLiteral("FREQ=MINUTELY;INTERVAL=15;BYHOUR=9;BYDAY=MO");
+    QTest::newRow("count") << QStringLiteral("FREQ=WEEKLY;BYDAY=TU,TH;COUNT=100");
+    QTest::newRow("until") << QStringLiteral("FREQ=DAILY;INTERVAL=3;UNTIL=20060701T000000Z");
+    // Many occurrences a year, so its windows only span a couple of years
+    QTest::newRow("yearly lists") << QStringLiteral("FREQ=YEARLY;BYMONTH=1,3,5,7,9,11;BYMONTHDAY=1,10,20,-1");
+}
+
+void RecurrenceRuleTest::testCursor()
+{
+    QFETCH(QString, rrule);
+
+    RecurrenceRule rule;
+    ICalFormat format;
+    QVERIFY(format.fromString(&rule, rrule));
+    rule.setStartDt(KDateTime(QDate(2005, 1, 3), QTime(10, 0, 0), KDateTime::UTC));
+
+    const KDateTime position(QDate(2006, 6, 1), QTime(0, 0, 0), KDateTime::UTC);
+    RecurrenceRule::Cursor cursor(&rule, position);
+    QCOMPARE(cursor.position(), position);
+
+    // Forwards, then backwards past the starting position
+    KDateTime expected = position;
+    for (int i = 0; i < 40; ++i) {
+        expected = rule.getNextDate(expected);
+        const KDateTime dt = cursor.next();
+        QCOMPARE(dt, expected);
+        if (!dt.isValid()) {
+            break;
+        }
+        QCOMPARE(cursor.position(), dt);
+    }
+    expected = cursor.position();
+    for (int i = 0; i < 100; ++i) {
+        expected = rule.getPreviousDate(expected);
+        const KDateTime dt = cursor.previous();
+        QCOMPARE(dt, expected);
+        if (!dt.isValid()) {
+            break;
+        }
+    }
+
+    // From the start of the rule
+    RecurrenceRule::Cursor first(&rule);
+    QVERIFY(!first.previous().isValid());
+    QCOMPARE(first.next(), rule.getNextDate(rule.startDt().addSecs(-1)));
+}
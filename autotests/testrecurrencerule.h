@@ -0,0 +1,52 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#ifndef TESTRECURRENCERULE_H
+#define TESTRECURRENCERULE_H
+
+#include <QtCore/QObject>
+
+class RecurrenceRuleTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testSimpleRules_data();
+    void testSimpleRules();
+    void testTestData_data();
+    void testTestData();
+    void benchmarkTimesInInterval_data();
+    void benchmarkTimesInInterval();
+    void testOccurrenceCache();
+    void testSharedRules();
+    void testMatchingRules_data();
+    void testMatchingRules();
+    void testRecursOnRange_data();
+    void testRecursOnRange();
+    void testManyExceptions();
+    void testOldSubDailyRules_data();
+    void testOldSubDailyRules();
+    void testDaylightSavings_data();
+    void testDaylightSavings();
+    void testCountEnd_data();
+    void testCountEnd();
+    void testCursor_data();
+    void testCursor();
+};
+
+#endif
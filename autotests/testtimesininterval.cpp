@@ -155,3 +155,57 @@ void TimesInIntervalTest::testSubDailyRecurrenceIntervalLimits()
     }
     QCOMPARE(expectedEventOccurrences.size(), 0);
 }
+
+void TimesInIntervalTest::testCursor()
+{
+    const KDateTime start(QDate(2013, 03, 10), QTime(10, 0, 0), KDateTime::UTC);
+
+    KCalCore::Event::Ptr event(new KCalCore::Event());
+    event->setUid(QStringLiteral("event"));
+    event->setDtStart(start);
+    Recurrence *recurrence = event->recurrence();
+    recurrence->setDaily(1);
+    recurrence->setDuration(200);
+    recurrence->addExDate(QDate(2013, 03, 12));
+    recurrence->addExDateTime(start.addDays(4));
+    recurrence->addRDateTime(start.addDays(2).addSecs(5 * 3600));
+    recurrence->addRDateTime(start.addDays(1000));
+
+    RecurrenceRule *exrule = new RecurrenceRule();
+    exrule->setRecurrenceType(RecurrenceRule::rWeekly);
+    exrule->setFrequency(2);
+    exrule->setStartDt(start.addDays(20));
+    recurrence->addExRule(exrule);
+
+    // All the occurrences forwards, and back again
+    Recurrence::Cursor cursor(recurrence);
+    DateTimeList forwards;
+    for (KDateTime dt = cursor.next(); dt.isValid(); dt = cursor.next()) {
+        forwards << dt;
+    }
+    QCOMPARE(cursor.position(), start.addDays(1000));
+
+    DateTimeList expected;
+    for (KDateTime dt = recurrence->getNextDateTime(start.addSecs(-1)); dt.isValid();
+            dt = recurrence->getNextDateTime(dt)) {
+        expected << dt;
+    }
+    QCOMPARE(forwards, expected);
+    QVERIFY(expected.contains(start.addDays(2).addSecs(5 * 3600)));
+    QVERIFY(!expected.contains(start.addDays(2)));
+    QVERIFY(!expected.contains(start.addDays(4)));
+    QVERIFY(!expected.contains(start.addDays(20)));
+
+    DateTimeList backwards;
+    for (KDateTime dt = cursor.previous(); dt.isValid(); dt = cursor.previous()) {
+        backwards.prepend(dt);
+    }
+    expected.removeLast();
+    QCOMPARE(backwards, expected);
+    QCOMPARE(cursor.position(), start);
+
+    // Starting between occurrences
+    Recurrence::Cursor middle(recurrence, start.addDays(50).addSecs(-60));
+    QCOMPARE(middle.next(), start.addDays(50));
+    QCOMPARE(middle.previous(), start.addDays(49));
+}
@@ -33,6 +33,7 @@ private Q_SLOTS:
     void testSubDailyRecurrenceIntervalInclusive();
     void testSubDailyRecurrence2();
     void testSubDailyRecurrenceIntervalLimits();
+    void testCursor();
 };
 
 #endif
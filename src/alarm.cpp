@@ -31,11 +31,14 @@
   @author Cornelius Schumacher \<schumacher@kde.org\>
 */
 #include "alarm.h"
+#include "alarmrepetition_p.h"
 #include "duration.h"
 #include "incidence.h"
 
 #include <QTime>
 
+#include <limits>
+
 using namespace KCalCore;
 
 /**
@@ -633,6 +636,37 @@ Duration Alarm::duration() const
                     d->mAlarmSnoozeTime.type());
 }
 
+//@cond PRIVATE
+KDateTime KCalCore::alarmRepetitionTime(const KDateTime &at, const Duration &snoozeTime, qint64 n)
+{
+    return snoozeTime.isDaily() ? at.addDays(int(n * snoozeTime.value()))
+           : at.addSecs(n * snoozeTime.value());
+}
+
+qint64 KCalCore::alarmRepetitionNumber(const KDateTime &at, const KDateTime &dt,
+                                       const Duration &snoozeTime, bool inclusive)
+{
+    if (inclusive ? !(at < dt) : at > dt) {
+        return 0;
+    }
+    const int interval = snoozeTime.value();
+    if (interval <= 0) {
+        return std::numeric_limits<qint64>::max();
+    }
+    // Start from the last repetition which can't be later than dt, and step
+    // over the at most two which are still too early: daily repetitions
+    // keep the time of day of the initial alarm, whatever the time of dt
+    qint64 n = snoozeTime.isDaily() ? at.daysTo(dt) / interval : at.secsTo(dt) / interval;
+    forever {
+        const KDateTime time = alarmRepetitionTime(at, snoozeTime, n);
+        if (inclusive ? !(time < dt) : time > dt) {
+            return n;
+        }
+        ++n;
+    }
+}
+//@endcond
+
 KDateTime Alarm::nextRepetition(const KDateTime &preTime) const
 {
     KDateTime at = nextTime(preTime);
@@ -643,24 +677,12 @@ KDateTime Alarm::nextRepetition(const KDateTime &preTime) const
         // there isn't an occurrence after the specified time
         return KDateTime();
     }
-    qint64 repetition;
-    int interval = d->mAlarmSnoozeTime.value();
-    bool daily = d->mAlarmSnoozeTime.isDaily();
-    if (daily) {
-        int daysTo = at.daysTo(preTime);
-        if (!preTime.isDateOnly() && preTime.time() <= at.time()) {
-            --daysTo;
-        }
-        repetition = daysTo / interval + 1;
-    } else {
-        repetition = at.secsTo(preTime) / interval + 1;
-    }
+    const qint64 repetition = alarmRepetitionNumber(at, preTime, d->mAlarmSnoozeTime, false);
     if (repetition > d->mAlarmRepeatCount) {
         // all repetitions have finished before the specified time
         return KDateTime();
     }
-    return daily ? at.addDays(int(repetition * interval))
-           : at.addSecs(repetition * interval);
+    return alarmRepetitionTime(at, d->mAlarmSnoozeTime, repetition);
 }
 
 KDateTime Alarm::previousRepetition(const KDateTime &afterTime) const
@@ -0,0 +1,56 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the internal functions locating the repetitions of an alarm.
+*/
+
+#ifndef KCALCORE_ALARMREPETITION_P_H
+#define KCALCORE_ALARMREPETITION_P_H
+
+#include "duration.h"
+
+#include <KDateTime>
+
+namespace KCalCore
+{
+
+//@cond PRIVATE
+/**
+  Returns the time of repetition @p n, counting the initial alarm as 0, of an
+  alarm first triggering at @p at and repeating every @p snoozeTime.
+  @internal
+*/
+KDateTime alarmRepetitionTime(const KDateTime &at, const Duration &snoozeTime, qint64 n);
+
+/**
+  Returns the number of the first repetition after @p dt, or at it if
+  @p inclusive, counting the initial alarm as 0, of an alarm first triggering
+  at @p at and repeating every @p snoozeTime. It is beyond any repeat count
+  if the alarm doesn't repeat.
+  @internal
+*/
+qint64 alarmRepetitionNumber(const KDateTime &at, const KDateTime &dt,
+                             const Duration &snoozeTime, bool inclusive);
+//@endcond
+
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the AlarmScheduler class.
+ */
+
+#include "alarmscheduler.h"
+#include "alarmrepetition_p.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QVector>
+
+#include <algorithm>
+
+using namespace KCalCore;
+
+/**
+  Private class that helps to provide binary compatibility between releases.
+  @internal
+*/
+//@cond PRIVATE
+class Q_DECL_HIDDEN KCalCore::AlarmScheduler::Private
+{
+public:
+    Private(Calendar *calendar, const KDateTime &from)
+        : mCalendar(calendar),
+          mPreTime(from),
+          mLastGeneration(0),
+          mLiveEntries(0)
+    {
+        mPreTime.setDateOnly(false);
+        mPreTime = mPreTime.addSecs(-1);
+    }
+
+    // The next trigger of an alarm for an occurrence. An alarm has an entry
+    // for each occurrence whose repetitions are still to come.
+    struct Entry {
+        qint64 key;             // trigger time, in seconds since the epoch
+        Alarm::Ptr alarm;
+        const Incidence *incidence;
+        quint64 generation;     // of the incidence when the entry was queued
+        KDateTime time;
+        KDateTime occurrence;
+        KDateTime initial;      // time of the initial alarm for the occurrence
+        int repetition;
+    };
+
+    // The entries of an incidence are stale once it is changed or deleted,
+    // and are dropped when they reach the top of the heap
+    struct IncidenceState {
+        quint64 generation;
+        int entries;
+    };
+
+    static bool entryGreater(const Entry &e1, const Entry &e2)
+    {
+        return e1.key > e2.key;
+    }
+
+    static qint64 timeKey(const KDateTime &dt)
+    {
+        KDateTime utc = dt;
+        utc.setDateOnly(false);
+        utc = utc.toUtc();
+        return (utc.date().toJulianDay() - Q_INT64_C(2440588)) * 86400 + QTime(0, 0).secsTo(utc.time());
+    }
+
+    bool isStale(const Entry &entry) const
+    {
+        const QHash<const Incidence *, IncidenceState>::const_iterator it = mIncidences.constFind(entry.incidence);
+        return it == mIncidences.constEnd() || it->generation != entry.generation;
+    }
+
+    void load(const Incidence::Ptr &incidence)
+    {
+        unload(incidence.data());
+        if (incidence->type() != Incidence::TypeEvent && incidence->type() != Incidence::TypeTodo) {
+            return;
+        }
+        if (incidence->type() == Incidence::TypeTodo && incidence.staticCast<Todo>()->isCompleted()) {
+            return;
+        }
+        IncidenceState &state = mIncidences[incidence.data()];
+        state.generation = ++mLastGeneration;
+        state.entries = 0;
+        foreach (const Alarm::Ptr &alarm, incidence->alarms()) {
+            if (alarm->enabled()) {
+                schedule(alarm, incidence.data(), state.generation, mPreTime);
+            }
+        }
+        compact();
+    }
+
+    void unload(const Incidence *incidence)
+    {
+        const QHash<const Incidence *, IncidenceState>::iterator it = mIncidences.find(incidence);
+        if (it != mIncidences.end()) {
+            mLiveEntries -= it->entries;
+            mIncidences.erase(it);
+        }
+    }
+
+    static bool isRecurring(const Entry &entry)
+    {
+        return !entry.alarm->hasTime() && entry.incidence->recurs();
+    }
+
+    void queue(Entry &entry)
+    {
+        entry.key = timeKey(entry.time);
+        mHeap.append(entry);
+        std::push_heap(mHeap.begin(), mHeap.end(), entryGreater);
+        ++mIncidences[entry.incidence].entries;
+        ++mLiveEntries;
+    }
+
+    // Queues the first repetition after preTime, including the initial
+    // alarm, of the occurrence of an entry
+    void queueRepetition(Entry &entry, const KDateTime &preTime)
+    {
+        const Duration snoozeTime = entry.alarm->snoozeTime();
+        const qint64 n = alarmRepetitionNumber(entry.initial, preTime, snoozeTime, false);
+        if (n > entry.alarm->repeatCount()) {
+            return;
+        }
+        entry.repetition = static_cast<int>(n);
+        entry.time = alarmRepetitionTime(entry.initial, snoozeTime, n);
+        queue(entry);
+    }
+
+    // Queues the triggers of an alarm which follow preTime: the next
+    // repetition of each occurrence which is still repeating, and the initial
+    // alarm of the first occurrence after them. Each occurrence is then only
+    // visited once, see scheduleNext().
+    void schedule(const Alarm::Ptr &alarm, const Incidence *incidence, quint64 generation,
+                  const KDateTime &preTime)
+    {
+        Entry entry;
+        entry.alarm = alarm;
+        entry.incidence = incidence;
+        entry.generation = generation;
+        if (!isRecurring(entry)) {
+            entry.occurrence = incidence->dtStart();
+            entry.initial = alarm->time();
+            queueRepetition(entry, preTime);
+            return;
+        }
+
+        // The alarm of each occurrence is at the same offset from its start
+        // as the alarm of the first occurrence
+        const Duration offset(incidence->dtStart(), alarm->time());
+        KDateTime earliest = (-offset).end((-alarm->duration()).end(preTime));
+        earliest.setDateOnly(false);
+        Recurrence::Cursor cursor(incidence->recurrence(), earliest);
+        for (KDateTime dt = cursor.next(); dt.isValid(); dt = cursor.next()) {
+            entry.occurrence = dt;
+            entry.initial = offset.end(dt);
+            queueRepetition(entry, preTime);
+            if (entry.initial > preTime) {
+                break;
+            }
+        }
+    }
+
+    // Queues the triggers which follow a taken one: the next repetition for
+    // its occurrence, and after the initial alarm of an occurrence, the
+    // initial alarm of the next one
+    void scheduleNext(const Entry &taken)
+    {
+        Entry entry = taken;
+        if (entry.repetition < entry.alarm->repeatCount() && entry.alarm->snoozeTime().value() > 0) {
+            ++entry.repetition;
+            entry.time = alarmRepetitionTime(entry.initial, entry.alarm->snoozeTime(), entry.repetition);
+            queue(entry);
+        }
+        if (taken.repetition == 0 && isRecurring(taken)) {
+            const Duration offset(taken.incidence->dtStart(), taken.alarm->time());
+            entry = taken;
+            entry.occurrence = taken.incidence->recurrence()->getNextDateTime(taken.occurrence);
+            if (entry.occurrence.isValid()) {
+                entry.initial = offset.end(entry.occurrence);
+                entry.time = entry.initial;
+                queue(entry);
+            }
+        }
+    }
+
+    // Removes the stale entries from the top of the heap
+    void dropStale()
+    {
+        while (!mHeap.isEmpty() && isStale(mHeap.first())) {
+            std::pop_heap(mHeap.begin(), mHeap.end(), entryGreater);
+            mHeap.removeLast();
+        }
+    }
+
+    // Removes all the stale entries once they outnumber the live ones
+    void compact()
+    {
+        if (mHeap.count() <= 2 * mLiveEntries + 64) {
+            return;
+        }
+        QVector<Entry> live;
+        live.reserve(mLiveEntries);
+        foreach (const Entry &entry, mHeap) {
+            if (!isStale(entry)) {
+                live.append(entry);
+            }
+        }
+        mHeap = live;
+        std::make_heap(mHeap.begin(), mHeap.end(), entryGreater);
+    }
+
+    Calendar *mCalendar;
+    KDateTime mPreTime;         // alarms at or before it were taken
+    QVector<Entry> mHeap;       // min-heap on the trigger time
+    QHash<const Incidence *, IncidenceState> mIncidences;
+    quint64 mLastGeneration;
+    int mLiveEntries;
+};
+//@endcond
+
+AlarmScheduler::AlarmScheduler(Calendar *calendar, const KDateTime &from)
+    : d(new KCalCore::AlarmScheduler::Private(calendar, from))
+{
+    foreach (const Incidence::Ptr &incidence, calendar->rawIncidences()) {
+        d->load(incidence);
+    }
+    calendar->registerObserver(this);
+}
+
+AlarmScheduler::~AlarmScheduler()
+{
+    d->mCalendar->unregisterObserver(this);
+    delete d;
+}
+
+KDateTime AlarmScheduler::nextAlarmTime() const
+{
+    d->dropStale();
+    return d->mHeap.isEmpty() ? KDateTime() : d->mHeap.first().time;
+}
+
+Alarm::List AlarmScheduler::takeAlarmsDue(const KDateTime &to)
+{
+    Alarm::List alarms;
+    QSet<const Alarm *> taken;
+    foreach (const Calendar::AlarmTrigger &trigger, takeTriggersDue(to)) {
+        if (!taken.contains(trigger.alarm.data())) {
+            taken.insert(trigger.alarm.data());
+            alarms.append(trigger.alarm);
+        }
+    }
+    return alarms;
+}
+
+Calendar::AlarmTriggerList AlarmScheduler::takeTriggersDue(const KDateTime &to)
+{
+    KDateTime end = to;
+    if (end.isDateOnly()) {
+        end = KDateTime(end.date(), QTime(23, 59, 59), end.timeSpec());
+    }
+    const qint64 endKey = Private::timeKey(end);
+
+    Calendar::AlarmTriggerList triggers;
+    forever {
+        d->dropStale();
+        if (d->mHeap.isEmpty() || d->mHeap.first().key > endKey) {
+            break;
+        }
+        std::pop_heap(d->mHeap.begin(), d->mHeap.end(), Private::entryGreater);
+        const Private::Entry entry = d->mHeap.takeLast();
+        --d->mIncidences[entry.incidence].entries;
+        --d->mLiveEntries;
+
+        Calendar::AlarmTrigger trigger;
+        trigger.alarm = entry.alarm;
+        trigger.occurrence = entry.occurrence;
+        trigger.time = entry.time;
+        trigger.repetition = entry.repetition;
+        triggers.append(trigger);
+
+        d->scheduleNext(entry);
+    }
+    if (d->mPreTime < end) {
+        d->mPreTime = end;
+    }
+    return triggers;
+}
+
+void AlarmScheduler::calendarIncidenceAdded(const Incidence::Ptr &incidence)
+{
+    d->load(incidence);
+}
+
+void AlarmScheduler::calendarIncidenceChanged(const Incidence::Ptr &incidence)
+{
+    d->load(incidence);
+}
+
+void AlarmScheduler::calendarIncidenceDeleted(const Incidence::Ptr &incidence)
+{
+    d->unload(incidence.data());
+}
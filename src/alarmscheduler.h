@@ -0,0 +1,115 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the AlarmScheduler class.
+*/
+#ifndef KCALCORE_ALARMSCHEDULER_H
+#define KCALCORE_ALARMSCHEDULER_H
+
+#include "kcalcore_export.h"
+#include "calendar.h"
+
+namespace KCalCore
+{
+
+/**
+  @brief
+  Keeps track of the next alarms of a calendar.
+
+  The scheduler holds the next trigger time of every enabled alarm of the
+  events and uncompleted to-dos of a calendar in a priority queue, or of each
+  occurrence of the alarm when the repetitions of several overlap, so that
+  finding the next alarm and taking the alarms which are due only costs a
+  logarithmic time in the number of alarms, instead of going through all the
+  incidences as Calendar::alarms() does.
+
+  It observes the calendar, and updates the triggers of an incidence when it
+  is added, changed or deleted. Once an alarm has been taken, its next
+  repetition for the same occurrence is queued in its place, and after the
+  initial alarm of an occurrence of a recurring incidence, the alarm of the
+  next occurrence too.
+
+  The calendar must outlive the scheduler.
+  @since 5.15
+*/
+class KCALCORE_EXPORT AlarmScheduler : public Calendar::CalendarObserver
+{
+public:
+    /**
+      Constructs a scheduler for the alarms of @p calendar which trigger at
+      or after @p from.
+    */
+    AlarmScheduler(Calendar *calendar, const KDateTime &from);
+
+    /**
+      Destroys the scheduler, and stops observing the calendar.
+    */
+    ~AlarmScheduler();
+
+    /**
+      Returns the time of the next alarm, or an invalid date/time if there
+      are no more alarms.
+    */
+    KDateTime nextAlarmTime() const;
+
+    /**
+      Returns the alarms which trigger at or before @p to, including their
+      repetitions, and queues their next triggers. Each alarm is returned
+      once, even if it triggers several times. Alarms triggering at or before
+      @p to won't be returned by later calls.
+    */
+    Alarm::List takeAlarmsDue(const KDateTime &to);
+
+    /**
+      Returns the triggers of the alarms at or before @p to, in trigger time
+      order, and queues the next triggers of their alarms. Alarm triggers at
+      or before @p to won't be returned by later calls.
+      @see Calendar::alarmTriggers()
+    */
+    Calendar::AlarmTriggerList takeTriggersDue(const KDateTime &to);
+
+    /**
+      @copydoc Calendar::CalendarObserver::calendarIncidenceAdded()
+    */
+    void calendarIncidenceAdded(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::CalendarObserver::calendarIncidenceChanged()
+    */
+    void calendarIncidenceChanged(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::CalendarObserver::calendarIncidenceDeleted()
+    */
+    void calendarIncidenceDeleted(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+private:
+    //@cond PRIVATE
+    class Private;
+    Private *const d;
+    //@endcond
+
+    Q_DISABLE_COPY(AlarmScheduler)
+};
+
+}
+
+#endif
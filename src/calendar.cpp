@@ -35,8 +35,10 @@
   @author David Jarvie \<software@astrojar.org.uk\>
 */
 #include "calendar.h"
+#include "alarmrepetition_p.h"
 #include "calfilter.h"
 #include "icaltimezones.h"
+#include "occurrenceiterator.h"
 #include "sorting.h"
 #include "visitor.h"
 
@@ -46,7 +48,13 @@ extern "C" {
 #include <icaltimezone.h>
 }
 
+#include <QtCore/QPair>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
 #include <algorithm>  // for std::remove()
+#include <limits>
 
 using namespace KCalCore;
 
@@ -208,6 +216,110 @@ public:
 private:
     T *mResource;
 };
+
+/**
+  Start of an occurrence in seconds since the epoch, with date-only values at
+  the start of their date, which is how OccurrenceIterator sorts them.
+*/
+static qint64 occurrenceKey(const KDateTime &dt)
+{
+    if (!dt.isValid()) {
+        return std::numeric_limits<qint64>::min();
+    }
+    KDateTime utc = dt;
+    utc.setDateOnly(false);
+    utc = utc.toUtc();
+    return (utc.date().toJulianDay() - Q_INT64_C(2440588)) * 86400 + QTime(0, 0).secsTo(utc.time());
+}
+
+/**
+  Returns a copy of a date/time with its own data. KDateTime copies share
+  their data, in which conversions cache their result, so a date/time may
+  not be used by several threads unless each has its own copy.
+*/
+static KDateTime detached(const KDateTime &dt)
+{
+    KDateTime copy(dt);
+    copy.detach();
+    return copy;
+}
+
+/**
+  Task expanding the occurrences of a slice of the incidences of a calendar
+  for Calendar::occurrencesInRange(), sorted by start.
+*/
+class OccurrenceTask : public QRunnable
+{
+public:
+    OccurrenceTask(const Calendar &calendar, const Incidence::List &incidences,
+                   const KDateTime &start, const KDateTime &end)
+        : mCalendar(calendar),
+          mIncidences(incidences),
+          mStart(detached(start)),
+          mEnd(detached(end))
+    {
+        setAutoDelete(false);
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        QVector<Entry> entries;
+        foreach (const Incidence::Ptr &incidence, mIncidences) {
+            OccurrenceIterator it(mCalendar, incidence, mStart, mEnd);
+            while (it.hasNext()) {
+                it.next();
+                Entry entry;
+                entry.key = occurrenceKey(it.occurrenceStartDate());
+                entry.occurrence.incidence = it.incidence();
+                entry.occurrence.recurrenceId = it.recurrenceId();
+                entry.occurrence.startDate = it.occurrenceStartDate();
+                entries.append(entry);
+            }
+        }
+
+        // Keep the order of the incidences for equal starts
+        std::stable_sort(entries.begin(), entries.end(), lessThanKey);
+        occurrences.reserve(entries.count());
+        keys.reserve(entries.count());
+        foreach (const Entry &entry, entries) {
+            occurrences.append(entry.occurrence);
+            keys.append(entry.key);
+        }
+    }
+
+    Calendar::OccurrenceList occurrences;
+    QVector<qint64> keys;   // occurrenceKey() of each occurrence
+
+private:
+    struct Entry {
+        qint64 key;
+        Calendar::Occurrence occurrence;
+    };
+
+    static bool lessThanKey(const Entry &e1, const Entry &e2)
+    {
+        return e1.key < e2.key;
+    }
+
+    const Calendar &mCalendar;
+    const Incidence::List mIncidences;
+    const KDateTime mStart;
+    const KDateTime mEnd;
+};
+
+/**
+  Position in the occurrences of an OccurrenceTask, when merging them.
+*/
+struct TaskPosition {
+    qint64 key;     // key of the next occurrence
+    int task;
+    int index;
+};
+
+static bool taskPositionGreater(const TaskPosition &p1, const TaskPosition &p2)
+{
+    return p1.key > p2.key || (p1.key == p2.key && p1.task > p2.task);
+}
 //@endcond
 
 Calendar::Calendar(const KDateTime::Spec &timeSpec)
@@ -429,6 +541,85 @@ Incidence::List Calendar::instances(const Incidence::Ptr &incidence) const
     }
 }
 
+Calendar::OccurrenceList Calendar::occurrencesInRange(const KDateTime &start,
+                                                      const KDateTime &end,
+                                                      int threads) const
+{
+    // The same incidences as an OccurrenceIterator over the range
+    Event::List events = rawEvents(start.date(), end.date(), start.timeSpec());
+    Todo::List todos = rawTodos(start.date(), end.date(), start.timeSpec());
+    Journal::List journals;
+    foreach (const Journal::Ptr &journal, rawJournals()) {
+        const QDate journalStart = journal->dtStart().toTimeSpec(start.timeSpec()).date();
+        if (journal->dtStart().isValid() &&
+                journalStart >= start.date() && journalStart <= end.date()) {
+            journals << journal;
+        }
+    }
+    if (filter()) {
+        filter()->apply(&events);
+        filter()->apply(&todos);
+        filter()->apply(&journals);
+    }
+    const Incidence::List incidences = mergeIncidenceList(events, todos, journals);
+    if (incidences.isEmpty()) {
+        return OccurrenceList();
+    }
+
+    // Each task expands consecutive incidences, and there are a few tasks per
+    // thread to even out the load
+    if (threads <= 0) {
+        threads = QThread::idealThreadCount();
+    }
+    const int taskCount = qMin(incidences.count(), threads > 1 ? threads * 4 : 1);
+    QVector<OccurrenceTask *> tasks;
+    tasks.reserve(taskCount);
+    for (int i = 0; i < taskCount; ++i) {
+        const int from = incidences.count() * i / taskCount;
+        const int to = incidences.count() * (i + 1) / taskCount;
+        tasks.append(new OccurrenceTask(*this, incidences.mid(from, to - from), start, end));
+    }
+    if (taskCount == 1) {
+        tasks.first()->run();
+    } else {
+        QThreadPool pool;
+        pool.setMaxThreadCount(threads);
+        foreach (OccurrenceTask *task, tasks) {
+            pool.start(task);
+        }
+        pool.waitForDone();
+    }
+
+    // Merge the sorted occurrences of the tasks, taking the earliest task
+    // first for equal starts
+    int total = 0;
+    QVector<TaskPosition> heap;
+    for (int t = 0; t < tasks.count(); ++t) {
+        total += tasks[t]->occurrences.count();
+        if (!tasks[t]->keys.isEmpty()) {
+            const TaskPosition position = { tasks[t]->keys.first(), t, 0 };
+            heap.append(position);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), taskPositionGreater);
+    OccurrenceList occurrences;
+    occurrences.reserve(total);
+    while (!heap.isEmpty()) {
+        std::pop_heap(heap.begin(), heap.end(), taskPositionGreater);
+        TaskPosition &position = heap.last();
+        const OccurrenceTask *task = tasks.at(position.task);
+        occurrences.append(task->occurrences.at(position.index));
+        if (++position.index < task->keys.count()) {
+            position.key = task->keys.at(position.index);
+            std::push_heap(heap.begin(), heap.end(), taskPositionGreater);
+        } else {
+            heap.removeLast();
+        }
+    }
+    qDeleteAll(tasks);
+    return occurrences;
+}
+
 Incidence::List Calendar::duplicates(const Incidence::Ptr &incidence)
 {
     if (incidence) {
@@ -1193,6 +1384,10 @@ Calendar::CalendarObserver::calendarIncidenceAdditionCanceled(const Incidence::P
     Q_UNUSED(incidence);
 }
 
+Calendar::BatchObserver::~BatchObserver()
+{
+}
+
 void Calendar::registerObserver(CalendarObserver *observer)
 {
     if (!observer) {
@@ -1285,6 +1480,28 @@ void Calendar::notifyIncidenceAdded(const Incidence::Ptr &incidence)
     }
 }
 
+void Calendar::notifyIncidencesAdded(const Incidence::List &incidences)
+{
+    if (incidences.isEmpty()) {
+        return;
+    }
+
+    if (!d->mObserversEnabled) {
+        return;
+    }
+
+    foreach (CalendarObserver *observer, d->mObservers) {
+        BatchObserver *batchObserver = dynamic_cast<BatchObserver *>(observer);
+        if (batchObserver) {
+            batchObserver->calendarIncidencesAdded(incidences);
+        } else {
+            foreach (const Incidence::Ptr &incidence, incidences) {
+                observer->calendarIncidenceAdded(incidence);
+            }
+        }
+    }
+}
+
 void Calendar::notifyIncidenceChanged(const Incidence::Ptr &incidence)
 {
     if (!incidence) {
@@ -1386,6 +1603,89 @@ void Calendar::setObserversEnabled(bool enabled)
     d->mObserversEnabled = enabled;
 }
 
+//@cond PRIVATE
+typedef QVector<QPair<qint64, Calendar::AlarmTrigger> > KeyedTriggerList;
+
+static bool lessThanTriggerTime(const QPair<qint64, Calendar::AlarmTrigger> &t1,
+                                const QPair<qint64, Calendar::AlarmTrigger> &t2)
+{
+    return t1.first < t2.first;
+}
+
+// Appends the triggers from 'from' to 'to' of an alarm first triggering at
+// 'at' for an occurrence, and of its repetitions
+static void appendRepetitions(KeyedTriggerList &triggers, Calendar::AlarmTrigger trigger,
+                              const KDateTime &at, const KDateTime &from, const KDateTime &to)
+{
+    const Duration snoozeTime = trigger.alarm->snoozeTime();
+    const int repeatCount = snoozeTime.value() > 0 ? trigger.alarm->repeatCount() : 0;
+    for (qint64 n = alarmRepetitionNumber(at, from, snoozeTime, true); n <= repeatCount; ++n) {
+        trigger.time = alarmRepetitionTime(at, snoozeTime, n);
+        if (trigger.time > to) {
+            break;
+        }
+        trigger.repetition = static_cast<int>(n);
+        triggers.append(qMakePair(occurrenceKey(trigger.time), trigger));
+    }
+}
+//@endcond
+
+Calendar::AlarmTriggerList Calendar::alarmTriggers(const KDateTime &from, const KDateTime &to) const
+{
+    // The same incidences as alarms()
+    Incidence::List incidences;
+    foreach (const Event::Ptr &event, rawEvents()) {
+        incidences.append(event);
+    }
+    foreach (const Todo::Ptr &todo, rawTodos()) {
+        if (!todo->isCompleted()) {
+            incidences.append(todo);
+        }
+    }
+
+    KDateTime start = from;
+    start.setDateOnly(false);
+    KeyedTriggerList triggers;
+    foreach (const Incidence::Ptr &incidence, incidences) {
+        foreach (const Alarm::Ptr &alarm, incidence->alarms()) {
+            if (!alarm->enabled()) {
+                continue;
+            }
+            AlarmTrigger trigger;
+            trigger.alarm = alarm;
+            if (alarm->hasTime() || !incidence->recurs()) {
+                trigger.occurrence = incidence->dtStart();
+                appendRepetitions(triggers, trigger, alarm->time(), start, to);
+                continue;
+            }
+
+            // Walk the occurrences once, from the first one whose repetitions
+            // reach the start of the range. The alarm of each occurrence is at
+            // the same offset from its start as the alarm of the first one.
+            const Duration offset(incidence->dtStart(), alarm->time());
+            KDateTime earliest = (-offset).end((-alarm->duration()).end(start));
+            earliest.setDateOnly(false);
+            Recurrence::Cursor cursor(incidence->recurrence(), earliest.addSecs(-1));
+            for (KDateTime dt = cursor.next(); dt.isValid(); dt = cursor.next()) {
+                const KDateTime at = offset.end(dt);
+                if (at > to) {
+                    break;
+                }
+                trigger.occurrence = dt;
+                appendRepetitions(triggers, trigger, at, start, to);
+            }
+        }
+    }
+
+    std::stable_sort(triggers.begin(), triggers.end(), lessThanTriggerTime);
+    AlarmTriggerList result;
+    result.reserve(triggers.count());
+    for (int i = 0, iend = triggers.count(); i < iend; ++i) {
+        result.append(triggers.at(i).second);
+    }
+    return result;
+}
+
 void Calendar::appendAlarms(Alarm::List &alarms, const Incidence::Ptr &incidence,
                             const KDateTime &from, const KDateTime &to) const
 {
@@ -1403,6 +1703,64 @@ void Calendar::appendAlarms(Alarm::List &alarms, const Incidence::Ptr &incidence
     }
 }
 
+//@cond PRIVATE
+// The first repetition at or after 'from', including the initial one, of an
+// alarm first triggering at 'at', or invalid if they have all finished
+static KDateTime repetitionFrom(const KDateTime &at, const KDateTime &from,
+                                const Duration &snoozeTime, int repeatCount)
+{
+    const qint64 n = alarmRepetitionNumber(at, from, snoozeTime, true);
+    return n > repeatCount ? KDateTime() : alarmRepetitionTime(at, snoozeTime, n);
+}
+
+// The number of consecutive recurrences after which the offsets of their
+// repetitions from any time repeat, or -1 if they never do. This is only
+// the case for recurrences with a fixed period in seconds.
+static int repetitionCycle(const Recurrence *recurrence, const Duration &snoozeTime)
+{
+    if (snoozeTime.isDaily() || snoozeTime.value() <= 0 ||
+            recurrence->rRules().count() != 1 || !recurrence->exRules().isEmpty() ||
+            !recurrence->rDateTimes().isEmpty() || !recurrence->rDates().isEmpty() ||
+            !recurrence->exDateTimes().isEmpty() || !recurrence->exDates().isEmpty()) {
+        return -1;
+    }
+    const RecurrenceRule *rule = recurrence->rRules().first();
+    if (!rule->bySeconds().isEmpty() || !rule->byMinutes().isEmpty() ||
+            !rule->byHours().isEmpty() || !rule->byDays().isEmpty() ||
+            !rule->byMonthDays().isEmpty() || !rule->byYearDays().isEmpty() ||
+            !rule->byWeekNumbers().isEmpty() || !rule->byMonths().isEmpty() ||
+            !rule->bySetPos().isEmpty()) {
+        return -1;
+    }
+    qint64 period;
+    switch (rule->recurrenceType()) {
+    case RecurrenceRule::rSecondly:
+        period = 1;
+        break;
+    case RecurrenceRule::rMinutely:
+        period = 60;
+        break;
+    case RecurrenceRule::rHourly:
+        period = 3600;
+        break;
+    default:
+        return -1;
+    }
+    period *= rule->frequency();
+    if (period <= 0) {
+        return -1;
+    }
+    qint64 a = period;
+    qint64 b = snoozeTime.value();
+    while (b) {
+        const qint64 r = a % b;
+        a = b;
+        b = r;
+    }
+    return int(snoozeTime.value() / a);
+}
+//@endcond
+
 void Calendar::appendRecurringAlarms(Alarm::List &alarms,
                                      const Incidence::Ptr &incidence,
                                      const KDateTime &from,
@@ -1411,7 +1769,6 @@ void Calendar::appendRecurringAlarms(Alarm::List &alarms,
     KDateTime dt;
     bool endOffsetValid = false;
     Duration endOffset(0);
-    Duration period(from, to);
 
     Alarm::List alarmlist = incidence->alarms();
     for (int i = 0, iend = alarmlist.count();  i < iend;  ++i) {
@@ -1464,44 +1821,25 @@ void Calendar::appendRecurringAlarms(Alarm::List &alarms,
                     }
 
                     // The alarm has repetitions, so check whether repetitions of previous
-                    // recurrences fall within the time period.
+                    // recurrences fall within the time period. Only the recurrences whose
+                    // last repetition is at or after 'alarmStart' can, so go forwards from
+                    // the earliest of them instead of backwards from 'baseStart'.
+                    const Duration snoozeTime = a->snoozeTime();
+                    const int cycle = offset.isDaily() || endOffset.isDaily() ? -1 :
+                                      repetitionCycle(incidence->recurrence(), snoozeTime);
+                    KDateTime earliest = (-a->duration()).end(baseStart);
+                    earliest.setDateOnly(false);
+                    Recurrence::Cursor cursor(incidence->recurrence(), earliest.addSecs(-1));
                     bool found = false;
-                    Duration alarmDuration = a->duration();
-                    for (KDateTime base = baseStart;
-                            (dt = incidence->recurrence()->getPreviousDateTime(base)).isValid();
-                            base = dt) {
-                        if (a->duration().end(dt) < base) {
-                            break;  // this recurrence's last repetition is too early, so give up
-                        }
-
-                        // The last repetition of this recurrence is at or after 'alarmStart' time.
-                        // Check if a repetition occurs between 'alarmStart' and 'to'.
-                        int snooze = a->snoozeTime().value();   // in seconds or days
-                        if (a->snoozeTime().isDaily()) {
-                            Duration toFromDuration(dt, base);
-                            int toFrom = toFromDuration.asDays();
-                            if (a->snoozeTime().end(from) <= to ||
-                                    (toFromDuration.isDaily() && toFrom % snooze == 0) ||
-                                    (toFrom / snooze + 1) * snooze <= toFrom + period.asDays()) {
-                                found = true;
-#ifndef NDEBUG
-                                // for debug output
-                                dt = offset.end(dt).addDays(((toFrom - 1) / snooze + 1) * snooze);
-#endif
-                                break;
-                            }
-                        } else {
-                            int toFrom = dt.secsTo(base);
-                            if (period.asSeconds() >= snooze ||
-                                    toFrom % snooze == 0 ||
-                                    (toFrom / snooze + 1) * snooze <= toFrom + period.asSeconds()) {
-                                found = true;
-#ifndef NDEBUG
-                                // for debug output
-                                dt = offset.end(dt).addSecs(((toFrom - 1) / snooze + 1) * snooze);
-#endif
-                                break;
-                            }
+                    int missed = 0;
+                    for (KDateTime base = cursor.next();
+                            base.isValid() && base < baseStart && missed != cycle;
+                            base = cursor.next(), ++missed) {
+                        dt = repetitionFrom(endOffset.end(offset.end(base)), from,
+                                            snoozeTime, a->repeatCount());
+                        if (dt.isValid() && dt <= to) {
+                            found = true;
+                            break;
                         }
                     }
                     if (!found) {
@@ -56,6 +56,7 @@ This API needs serious cleaning up:
 #include "todo.h"
 
 #include <QtCore/QObject>
+#include <QtCore/QVector>
 
 namespace KCalCore
 {
@@ -394,6 +395,10 @@ public:
        Call this to tell the calendar that you're adding a batch of incidences.
        So it doesn't, for example, ask the destination for each incidence.
 
+       Calendars may defer indexing the incidences and notifying observers
+       until endBatchAdding() is called, observers are then notified once
+       through BatchObserver::calendarIncidencesAdded().
+
         @see endBatchAdding()
     */
     virtual void startBatchAdding();
@@ -460,10 +465,51 @@ public:
 
       @param incidence incidence to check
 
-      @return the list of all unfiltered exceptions.
+      @return the list of all unfiltered exceptions, which calendars may
+      return sorted by recurrence id.
     */
     virtual Incidence::List instances(const Incidence::Ptr &incidence) const;
 
+    /**
+      An occurrence of an incidence, as returned by occurrencesInRange().
+      @since 5.15
+    */
+    struct Occurrence {
+        /** The incidence, or the exception which replaces the occurrence. */
+        Incidence::Ptr incidence;
+        /** The recurrence id of the occurrence, invalid if it doesn't recur. */
+        KDateTime recurrenceId;
+        /** The start date/time of the occurrence. */
+        KDateTime startDate;
+    };
+
+    /**
+      List of occurrences.
+      @since 5.15
+    */
+    typedef QVector<Occurrence> OccurrenceList;
+
+    /**
+      Returns the occurrences of the incidences between @p start and @p end
+      inclusive, sorted by start date/time.
+
+      The occurrences are the same, and in the same order, as those of an
+      OccurrenceIterator over the range, but the recurrences of the incidences
+      are expanded concurrently, which is faster for large calendars.
+      Neither the calendar nor its incidences may be modified until the call
+      returns.
+
+      @param start is the start of the range.
+      @param end is the end of the range.
+      @param threads is the maximum number of threads to use, or 0 to use as
+      many as there are processor cores.
+
+      @return the list of occurrences.
+      @since 5.15
+    */
+    OccurrenceList occurrencesInRange(const KDateTime &start, const KDateTime &end,
+                                      int threads = 0) const;
+
     // Notebook Specific Methods //
 
     /**
@@ -1298,6 +1344,46 @@ public:
     */
     virtual Alarm::List alarms(const KDateTime &from, const KDateTime &to, bool excludeBlockedAlarms = false) const = 0;
 
+    /**
+      A trigger of an alarm, as returned by alarmTriggers().
+      @since 5.15
+    */
+    struct AlarmTrigger {
+        /** The alarm. */
+        Alarm::Ptr alarm;
+        /** The start date/time of the occurrence of the incidence which the
+            alarm is for. */
+        KDateTime occurrence;
+        /** The date/time at which the alarm triggers. */
+        KDateTime time;
+        /** The repetition number, 0 for the initial alarm of the occurrence. */
+        int repetition;
+    };
+
+    /**
+      List of alarm triggers.
+      @since 5.15
+    */
+    typedef QVector<AlarmTrigger> AlarmTriggerList;
+
+    /**
+      Returns the triggers of the alarms of this Calendar within a time range,
+      sorted by trigger time.
+
+      The alarms are those which alarms() returns for the same range, but each
+      of their triggers in the range is returned, with the occurrence and the
+      repetition which it is for, so that they don't need to be computed again
+      with Alarm::nextTime() or Alarm::nextRepetition(). When the repetitions
+      of several occurrences trigger at the same time, each is returned.
+
+      @param from is the starting timestamp.
+      @param to is the ending timestamp.
+
+      @return the list of alarm triggers for the specified time range.
+      @since 5.15
+    */
+    AlarmTriggerList alarmTriggers(const KDateTime &from, const KDateTime &to) const;
+
     // Observer Specific Methods //
 
     /**
@@ -1347,6 +1433,31 @@ public:
         virtual void calendarIncidenceAdditionCanceled(const Incidence::Ptr &incidence);
     };
 
+    /**
+      The Observer interface for observers which are notified once of a batch
+      of inserted Incidences, rather than once per Incidence.
+
+      An observer implements it in addition to CalendarObserver, and is
+      registered with registerObserver(). Observers which don't implement it
+      get CalendarObserver::calendarIncidenceAdded() for each Incidence.
+      @since 5.15
+    */
+    class KCALCORE_EXPORT BatchObserver //krazy:exclude=dpointer
+    {
+    public:
+        /**
+          Destructor.
+        */
+        virtual ~BatchObserver();
+
+        /**
+          Notify the Observer that a batch of Incidences has been inserted
+          between Calendar::startBatchAdding() and Calendar::endBatchAdding().
+          @param incidences is a list of the Incidences that were inserted.
+        */
+        virtual void calendarIncidencesAdded(const Incidence::List &incidences) = 0;
+    };
+
     /**
       Registers an Observer for this Calendar.
 
@@ -1390,6 +1501,14 @@ protected:
     */
     void notifyIncidenceAdded(const Incidence::Ptr &incidence);
 
+    /**
+      Let Calendar subclasses notify that they inserted a batch of Incidences.
+      @param incidences is a list of the Incidences that were inserted.
+      @see startBatchAdding()
+      @since 5.15
+    */
+    void notifyIncidencesAdded(const Incidence::List &incidences);
+
     /**
       Let Calendar subclasses notify that they modified an Incidence.
       @param incidence is a pointer to the Incidence object that was modified.
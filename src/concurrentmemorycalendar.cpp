@@ -0,0 +1,489 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the ConcurrentMemoryCalendar class.
+ */
+
+#include "concurrentmemorycalendar.h"
+
+#include <QtCore/QAtomicPointer>
+#include <QtCore/QMutex>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QThread>
+
+using namespace KCalCore;
+
+/**
+  Private class that helps to provide binary compatibility between releases.
+  @internal
+*/
+//@cond PRIVATE
+class Q_DECL_HIDDEN KCalCore::ConcurrentMemoryCalendar::Private
+{
+public:
+    Private()
+        : mLock(QReadWriteLock::Recursive),
+          mConversionMutex(QMutex::Recursive),
+          mWriteDepth(0),
+          mUpdateDepth(0)
+    {
+    }
+
+    // QReadWriteLock cannot take a read lock in a thread which holds the
+    // write lock, which happens whenever MemoryCalendar calls one of its own
+    // virtual lookups, or an observer queries the calendar, while writing.
+    // So the write lock is made reentrant here, and readers running in the
+    // writing thread do not lock at all.
+    bool ownsWriteLock() const
+    {
+        return mWriter.load() == QThread::currentThread();
+    }
+
+    void lockForWrite()
+    {
+        if (ownsWriteLock()) {
+            ++mWriteDepth;
+            return;
+        }
+        mLock.lockForWrite();
+        mWriter.store(QThread::currentThread());
+        mWriteDepth = 1;
+    }
+
+    void unlockWrite()
+    {
+        Q_ASSERT(ownsWriteLock());
+        if (--mWriteDepth == 0) {
+            mWriter.store(0);
+            mLock.unlock();
+        }
+    }
+
+    // KDateTime copies share their data, in which conversions cache their
+    // result. The UTC values of the incidence date/times are cached while
+    // the write lock is held, so that readers comparing them only read that
+    // data, while conversions to other time specifications are serialized
+    // by ConversionLocker.
+    static void cacheUtc(const Incidence::Ptr &incidence)
+    {
+        if (!incidence) {
+            return;
+        }
+        incidence->dtStart().toUtc();
+        incidence->dateTime(Incidence::RoleEnd).toUtc();
+        if (incidence->recurs()) {
+            const Recurrence *recurrence = incidence->recurrence();
+            foreach (const KDateTime &dt, recurrence->rDateTimes()) {
+                dt.toUtc();
+            }
+            foreach (const KDateTime &dt, recurrence->exDateTimes()) {
+                dt.toUtc();
+            }
+        }
+    }
+
+    class ReadLocker;
+    class WriteLocker;
+    class ConversionLocker;
+
+    mutable QReadWriteLock mLock;
+    mutable QMutex mConversionMutex;   // queries converting to a time spec
+    QAtomicPointer<QThread> mWriter;   // thread holding the write lock
+    int mWriteDepth;                   // only accessed by mWriter
+    int mUpdateDepth;                  // incidence updates holding the lock
+};
+
+class ConcurrentMemoryCalendar::Private::ReadLocker
+{
+public:
+    explicit ReadLocker(const Private *d)
+        : mLock(d->ownsWriteLock() ? 0 : &d->mLock)
+    {
+        if (mLock) {
+            mLock->lockForRead();
+        }
+    }
+
+    ~ReadLocker()
+    {
+        if (mLock) {
+            mLock->unlock();
+        }
+    }
+
+private:
+    QReadWriteLock *mLock;
+    Q_DISABLE_COPY(ReadLocker)
+};
+
+class ConcurrentMemoryCalendar::Private::WriteLocker
+{
+public:
+    explicit WriteLocker(Private *d)
+        : d(d)
+    {
+        d->lockForWrite();
+    }
+
+    ~WriteLocker()
+    {
+        d->unlockWrite();
+    }
+
+private:
+    Private *const d;
+    Q_DISABLE_COPY(WriteLocker)
+};
+// Taken with the read lock by the queries which convert the incidence
+// date/times to a time specification other than UTC.
+class ConcurrentMemoryCalendar::Private::ConversionLocker
+{
+public:
+    ConversionLocker(const Private *d, const KDateTime::Spec &spec)
+        : mMutex(spec.isUtc() || d->ownsWriteLock() ? 0 : &d->mConversionMutex)
+    {
+        if (mMutex) {
+            mMutex->lock();
+        }
+    }
+
+    ~ConversionLocker()
+    {
+        if (mMutex) {
+            mMutex->unlock();
+        }
+    }
+
+private:
+    QMutex *mMutex;
+    Q_DISABLE_COPY(ConversionLocker)
+};
+//@endcond
+
+ConcurrentMemoryCalendar::ConcurrentMemoryCalendar(const KDateTime::Spec &timeSpec)
+    : MemoryCalendar(timeSpec),
+      d(new KCalCore::ConcurrentMemoryCalendar::Private)
+{
+}
+
+ConcurrentMemoryCalendar::ConcurrentMemoryCalendar(const QString &timeZoneId)
+    : MemoryCalendar(timeZoneId),
+      d(new KCalCore::ConcurrentMemoryCalendar::Private)
+{
+}
+
+ConcurrentMemoryCalendar::~ConcurrentMemoryCalendar()
+{
+    delete d;
+}
+
+void ConcurrentMemoryCalendar::close()
+{
+    Private::WriteLocker locker(d);
+    MemoryCalendar::close();
+}
+
+void ConcurrentMemoryCalendar::virtual_hook(int id, void *data)
+{
+    if (id == SnapshotHook) {
+        Private::ReadLocker locker(d);
+        MemoryCalendar::virtual_hook(id, data);
+    } else {
+        MemoryCalendar::virtual_hook(id, data);
+    }
+}
+
+bool ConcurrentMemoryCalendar::deleteIncidence(const Incidence::Ptr &incidence)
+{
+    Private::WriteLocker locker(d);
+    return MemoryCalendar::deleteIncidence(incidence);
+}
+
+bool ConcurrentMemoryCalendar::deleteIncidenceInstances(const Incidence::Ptr &incidence)
+{
+    Private::WriteLocker locker(d);
+    return MemoryCalendar::deleteIncidenceInstances(incidence);
+}
+
+bool ConcurrentMemoryCalendar::addIncidence(const Incidence::Ptr &incidence)
+{
+    Private::WriteLocker locker(d);
+    if (!MemoryCalendar::addIncidence(incidence)) {
+        return false;
+    }
+    Private::cacheUtc(incidence);
+    return true;
+}
+
+void ConcurrentMemoryCalendar::startBatchAdding()
+{
+    Private::WriteLocker locker(d);
+    MemoryCalendar::startBatchAdding();
+}
+
+void ConcurrentMemoryCalendar::endBatchAdding()
+{
+    Private::WriteLocker locker(d);
+    MemoryCalendar::endBatchAdding();
+}
+
+Incidence::List ConcurrentMemoryCalendar::rawIncidences() const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::rawIncidences();
+}
+
+void ConcurrentMemoryCalendar::clearNotebookAssociations()
+{
+    Private::WriteLocker locker(d);
+    MemoryCalendar::clearNotebookAssociations();
+}
+
+bool ConcurrentMemoryCalendar::setNotebook(const Incidence::Ptr &incidence, const QString &notebook)
+{
+    Private::WriteLocker locker(d);
+    return MemoryCalendar::setNotebook(incidence, notebook);
+}
+
+QString ConcurrentMemoryCalendar::notebook(const Incidence::Ptr &incidence) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::notebook(incidence);
+}
+
+QString ConcurrentMemoryCalendar::notebook(const QString &uid) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::notebook(uid);
+}
+
+QStringList ConcurrentMemoryCalendar::notebooks() const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::notebooks();
+}
+
+Incidence::List ConcurrentMemoryCalendar::incidences(const QString &notebook) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::incidences(notebook);
+}
+
+Event::List ConcurrentMemoryCalendar::rawEvents(EventSortField sortField,
+                                                SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::rawEvents(sortField, sortDirection);
+}
+
+Event::List ConcurrentMemoryCalendar::rawEvents(const QDate &start, const QDate &end,
+                                                const KDateTime::Spec &timeSpec,
+                                                bool inclusive) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, timeSpec.isValid() ? timeSpec : this->timeSpec());
+    return MemoryCalendar::rawEvents(start, end, timeSpec, inclusive);
+}
+
+Event::List ConcurrentMemoryCalendar::rawEventsForDate(const QDate &date,
+                                                       const KDateTime::Spec &timeSpec,
+                                                       EventSortField sortField,
+                                                       SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, timeSpec.isValid() ? timeSpec : this->timeSpec());
+    return MemoryCalendar::rawEventsForDate(date, timeSpec, sortField, sortDirection);
+}
+
+Event::List ConcurrentMemoryCalendar::rawEventsForDate(const KDateTime &dt) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, dt.timeSpec());
+    return MemoryCalendar::rawEventsForDate(dt);
+}
+
+Incidence::Ptr ConcurrentMemoryCalendar::instance(const QString &identifier) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::instance(identifier);
+}
+
+Incidence::List ConcurrentMemoryCalendar::instances(const Incidence::Ptr &incidence) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::instances(incidence);
+}
+
+Event::Ptr ConcurrentMemoryCalendar::event(const QString &uid,
+                                           const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::event(uid, recurrenceId);
+}
+
+Event::Ptr ConcurrentMemoryCalendar::deletedEvent(const QString &uid,
+                                                  const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedEvent(uid, recurrenceId);
+}
+
+Event::List ConcurrentMemoryCalendar::deletedEvents(EventSortField sortField,
+                                                    SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedEvents(sortField, sortDirection);
+}
+
+Event::List ConcurrentMemoryCalendar::eventInstances(const Incidence::Ptr &event,
+                                                     EventSortField sortField,
+                                                     SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::eventInstances(event, sortField, sortDirection);
+}
+
+Todo::List ConcurrentMemoryCalendar::rawTodos(TodoSortField sortField,
+                                              SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::rawTodos(sortField, sortDirection);
+}
+
+Todo::List ConcurrentMemoryCalendar::rawTodos(const QDate &start, const QDate &end,
+                                              const KDateTime::Spec &timespec,
+                                              bool inclusive) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, timespec.isValid() ? timespec : timeSpec());
+    return MemoryCalendar::rawTodos(start, end, timespec, inclusive);
+}
+
+Todo::List ConcurrentMemoryCalendar::rawTodosForDate(const QDate &date) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, timeSpec());
+    return MemoryCalendar::rawTodosForDate(date);
+}
+
+Todo::Ptr ConcurrentMemoryCalendar::todo(const QString &uid,
+                                         const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::todo(uid, recurrenceId);
+}
+
+Todo::Ptr ConcurrentMemoryCalendar::deletedTodo(const QString &uid,
+                                                const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedTodo(uid, recurrenceId);
+}
+
+Todo::List ConcurrentMemoryCalendar::deletedTodos(TodoSortField sortField,
+                                                  SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedTodos(sortField, sortDirection);
+}
+
+Todo::List ConcurrentMemoryCalendar::todoInstances(const Incidence::Ptr &todo,
+                                                   TodoSortField sortField,
+                                                   SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::todoInstances(todo, sortField, sortDirection);
+}
+
+Journal::List ConcurrentMemoryCalendar::rawJournals(JournalSortField sortField,
+                                                    SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::rawJournals(sortField, sortDirection);
+}
+
+Journal::List ConcurrentMemoryCalendar::rawJournalsForDate(const QDate &date) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::rawJournalsForDate(date);
+}
+
+Journal::Ptr ConcurrentMemoryCalendar::journal(const QString &uid,
+                                               const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::journal(uid, recurrenceId);
+}
+
+Journal::Ptr ConcurrentMemoryCalendar::deletedJournal(const QString &uid,
+                                                      const KDateTime &recurrenceId) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedJournal(uid, recurrenceId);
+}
+
+Journal::List ConcurrentMemoryCalendar::deletedJournals(JournalSortField sortField,
+                                                        SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::deletedJournals(sortField, sortDirection);
+}
+
+Journal::List ConcurrentMemoryCalendar::journalInstances(const Incidence::Ptr &journal,
+                                                         JournalSortField sortField,
+                                                         SortDirection sortDirection) const
+{
+    Private::ReadLocker locker(d);
+    return MemoryCalendar::journalInstances(journal, sortField, sortDirection);
+}
+
+Alarm::List ConcurrentMemoryCalendar::alarms(const KDateTime &from, const KDateTime &to,
+                                             bool excludeBlockedAlarms) const
+{
+    Private::ReadLocker locker(d);
+    Private::ConversionLocker conversionLocker(d, from.timeSpec());
+    return MemoryCalendar::alarms(from, to, excludeBlockedAlarms);
+}
+
+void ConcurrentMemoryCalendar::incidenceUpdate(const QString &uid, const KDateTime &recurrenceId)
+{
+    // The incidence is out of the indexes, and its fields are being written,
+    // until incidenceUpdated(), so keep the lock until then
+    d->lockForWrite();
+    ++d->mUpdateDepth;
+    MemoryCalendar::incidenceUpdate(uid, recurrenceId);
+}
+
+void ConcurrentMemoryCalendar::incidenceUpdated(const QString &uid, const KDateTime &recurrenceId)
+{
+    if (d->ownsWriteLock() && d->mUpdateDepth > 0) {
+        MemoryCalendar::incidenceUpdated(uid, recurrenceId);
+        Private::cacheUtc(incidence(uid, recurrenceId));
+        --d->mUpdateDepth;
+        d->unlockWrite();
+    } else {
+        // Not preceded by incidenceUpdate(), e.g. the calendar started
+        // observing the incidence in between
+        Private::WriteLocker locker(d);
+        MemoryCalendar::incidenceUpdated(uid, recurrenceId);
+        Private::cacheUtc(incidence(uid, recurrenceId));
+    }
+}
@@ -0,0 +1,352 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the ConcurrentMemoryCalendar class.
+
+  A MemoryCalendar which can be shared between threads.
+ */
+#ifndef KCALCORE_CONCURRENTMEMORYCALENDAR_H
+#define KCALCORE_CONCURRENTMEMORYCALENDAR_H
+
+#include "kcalcore_export.h"
+#include "memorycalendar.h"
+
+namespace KCalCore
+{
+
+/**
+  @brief
+  This class provides a calendar stored in memory which can be accessed from
+  several threads at once.
+
+  MemoryCalendar::snapshot() takes the read lock too, even when called
+  through a MemoryCalendar or Calendar pointer. The snapshot is a plain
+  MemoryCalendar which doesn't need locking, as it can't be modified.
+
+  All the incidence lookups and queries of MemoryCalendar take a shared read
+  lock, so any number of threads can query the calendar concurrently, while
+  adding, deleting and updating incidences take an exclusive write lock.
+  The locks are reentrant: the calendar observers, which are notified with
+  the write lock held, can query the calendar from the writing thread.
+
+  The incidences themselves are shared with the readers. When an incidence
+  of the calendar is modified, the write lock is held from the
+  incidenceUpdate() to the incidenceUpdated() notification, so that other
+  threads neither query the calendar while the incidence is out of its
+  indexes nor read the fields being written through calendar queries.
+  Readers which keep a pointer to the incidence and read it outside the
+  calendar are not covered, so prefer modifying a clone of the incidence
+  and replacing the original with it. The lock does not cover the relations
+  between incidences, nor the filter and time specification of the calendar.
+
+  KDateTime caches the result of conversions in the data shared by its
+  copies. The calendar caches the UTC values of the incidence date/times
+  when they are added or updated, and the queries which convert them to
+  other time specifications run one at a time.
+
+  @since 5.15
+*/
+class KCALCORE_EXPORT ConcurrentMemoryCalendar : public MemoryCalendar
+{
+    Q_OBJECT
+public:
+
+    /**
+      A shared pointer to a ConcurrentMemoryCalendar
+    */
+    typedef QSharedPointer<ConcurrentMemoryCalendar> Ptr;
+
+    /**
+      @copydoc Calendar::Calendar(const KDateTime::Spec &)
+    */
+    explicit ConcurrentMemoryCalendar(const KDateTime::Spec &timeSpec);
+
+    /**
+      @copydoc Calendar::Calendar(const QString &)
+    */
+    explicit ConcurrentMemoryCalendar(const QString &timeZoneId);
+
+    /**
+      @copydoc Calendar::~Calendar()
+    */
+    ~ConcurrentMemoryCalendar();
+
+    /**
+      @copydoc MemoryCalendar::close()
+    */
+    void close() Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deleteIncidence()
+    */
+    bool deleteIncidence(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+    /**
+       @copydoc Calendar::deleteIncidenceInstances
+    */
+    bool deleteIncidenceInstances(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc MemoryCalendar::instances()
+    */
+    Incidence::List instances(const Incidence::Ptr &incidence) const Q_DECL_OVERRIDE;
+
+    /**
+       @copydoc Calendar::addIncidence()
+    */
+    bool addIncidence(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc MemoryCalendar::startBatchAdding()
+    */
+    void startBatchAdding() Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc MemoryCalendar::endBatchAdding()
+    */
+    void endBatchAdding() Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::rawIncidences()
+    */
+    Incidence::List rawIncidences() const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::clearNotebookAssociations()
+    */
+    void clearNotebookAssociations() Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::setNotebook()
+    */
+    bool setNotebook(const Incidence::Ptr &incidence, const QString &notebook) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::notebook(const Incidence::Ptr &)const
+    */
+    QString notebook(const Incidence::Ptr &incidence) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::notebook(const QString &)const
+    */
+    QString notebook(const QString &uid) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::notebooks()
+    */
+    QStringList notebooks() const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::incidences(const QString &)const
+    */
+    Incidence::List incidences(const QString &notebook) const Q_DECL_OVERRIDE;
+
+    using MemoryCalendar::incidences;
+
+    // Event Specific Methods //
+
+    /**
+      @copydoc Calendar::rawEvents(EventSortField, SortDirection)const
+    */
+    Event::List rawEvents(
+        EventSortField sortField = EventSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::rawEvents(const QDate &, const QDate &, const KDateTime::Spec &, bool)const
+    */
+    Event::List rawEvents(const QDate &start, const QDate &end,
+                          const KDateTime::Spec &timeSpec = KDateTime::Spec(),
+                          bool inclusive = false) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc MemoryCalendar::rawEventsForDate(const QDate &, const KDateTime::Spec &, EventSortField, SortDirection)const
+    */
+    Event::List rawEventsForDate(
+        const QDate &date, const KDateTime::Spec &timeSpec = KDateTime::Spec(),
+        EventSortField sortField = EventSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::rawEventsForDate(const KDateTime &)const
+    */
+    Event::List rawEventsForDate(const KDateTime &dt) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc MemoryCalendar::instance()
+    */
+    Incidence::Ptr instance(const QString &identifier) const;
+
+    /**
+      @copydoc Calendar::event()
+    */
+    Event::Ptr event(
+        const QString &uid,
+        const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedEvent()
+    */
+    Event::Ptr deletedEvent(
+        const QString &uid, const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedEvents(EventSortField, SortDirection)const
+    */
+    Event::List deletedEvents(
+        EventSortField sortField = EventSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::eventInstances(const Incidence::Ptr &, EventSortField, SortDirection)const
+    */
+    Event::List eventInstances(
+        const Incidence::Ptr &event,
+        EventSortField sortField = EventSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    // To-do Specific Methods //
+
+    /**
+      @copydoc Calendar::rawTodos(TodoSortField, SortDirection)const
+    */
+    Todo::List rawTodos(
+        TodoSortField sortField = TodoSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+       @copydoc Calendar::rawTodos(const QDate &, const QDate &, const KDateTime::Spec &, bool)const
+    */
+    Todo::List rawTodos(
+        const QDate &start, const QDate &end,
+        const KDateTime::Spec &timespec = KDateTime::Spec(),
+        bool inclusive = false) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::rawTodosForDate()
+    */
+    Todo::List rawTodosForDate(const QDate &date) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::todo()
+    */
+    Todo::Ptr todo(const QString &uid,
+                   const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedTodo()
+    */
+    Todo::Ptr deletedTodo(const QString &uid, const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedTodos(TodoSortField, SortDirection)const
+    */
+    Todo::List deletedTodos(
+        TodoSortField sortField = TodoSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::todoInstances(const Incidence::Ptr &, TodoSortField, SortDirection)const
+    */
+    Todo::List todoInstances(const Incidence::Ptr &todo,
+                             TodoSortField sortField = TodoSortUnsorted,
+                             SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    // Journal Specific Methods //
+
+    /**
+      @copydoc Calendar::rawJournals()
+    */
+    Journal::List rawJournals(
+        JournalSortField sortField = JournalSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::rawJournalsForDate()
+    */
+    Journal::List rawJournalsForDate(const QDate &date) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::journal()
+    */
+    Journal::Ptr journal(const QString &uid,
+                         const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedJournal()
+    */
+    Journal::Ptr deletedJournal(const QString &uid,
+                                const KDateTime &recurrenceId = KDateTime()) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::deletedJournals(JournalSortField, SortDirection)const
+    */
+    Journal::List deletedJournals(
+        JournalSortField sortField = JournalSortUnsorted,
+        SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::journalInstances(const Incidence::Ptr &,
+                                          JournalSortField, SortDirection)const
+    */
+    Journal::List journalInstances(const Incidence::Ptr &journal,
+                                   JournalSortField sortField = JournalSortUnsorted,
+                                   SortDirection sortDirection = SortDirectionAscending) const Q_DECL_OVERRIDE;
+
+    // Alarm Specific Methods //
+
+    /**
+      @copydoc Calendar::alarms()
+    */
+    Alarm::List alarms(const KDateTime &from, const KDateTime &to, bool excludeBlockedAlarms = false) const Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::incidenceUpdate(const QString &,const KDateTime &)
+
+      Takes the write lock until the matching incidenceUpdated().
+    */
+    void incidenceUpdate(const QString &uid, const KDateTime &recurrenceId) Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::incidenceUpdated(const QString &,const KDateTime &)
+    */
+    void incidenceUpdated(const QString &uid, const KDateTime &recurrenceId) Q_DECL_OVERRIDE;
+
+    using QObject::event;   // prevent warning about hidden virtual method
+
+protected:
+    /**
+      @copydoc MemoryCalendar::virtual_hook()
+    */
+    void virtual_hook(int id, void *data) Q_DECL_OVERRIDE;
+
+private:
+    //@cond PRIVATE
+    class Private;
+    Private *const d;
+    //@endcond
+
+    Q_DISABLE_COPY(ConcurrentMemoryCalendar)
+};
+
+}
+
+#endif
@@ -34,6 +34,7 @@
 
 #include "kcalcore_debug.h"
 
+#include <QAtomicInt>
 #include <QDate>
 
 using namespace KCalCore;
@@ -46,22 +47,28 @@ using namespace KCalCore;
 class Q_DECL_HIDDEN KCalCore::Event::Private
 {
 public:
+    // States of the multi-day cache. Validity and value are kept in a single
+    // atomic so that concurrent const calls to isMultiDay() never see one
+    // without the other.
+    enum MultiDayState {
+        MultiDayUnknown = 0,
+        MultiDayNo,
+        MultiDayYes
+    };
+
     Private()
         : mTransparency(Opaque),
-          mMultiDayValid(false),
-          mMultiDay(false)
+          mMultiDay(MultiDayUnknown)
     {}
     Private(const KCalCore::Event::Private &other)
         : mDtEnd(other.mDtEnd),
           mTransparency(other.mTransparency),
-          mMultiDayValid(false),
-          mMultiDay(false)
+          mMultiDay(MultiDayUnknown)
     {}
 
     KDateTime mDtEnd;
     Transparency mTransparency;
-    bool mMultiDayValid;
-    bool mMultiDay;
+    QAtomicInt mMultiDay;
 };
 //@endcond
 
@@ -127,7 +134,7 @@ QByteArray Event::typeStr() const
 
 void Event::setDtStart(const KDateTime &dt)
 {
-    d->mMultiDayValid = false;
+    d->mMultiDay.store(Private::MultiDayUnknown);
     Incidence::setDtStart(dt);
 }
 
@@ -140,7 +147,7 @@ void Event::setDtEnd(const KDateTime &dtEnd)
     update();
 
     d->mDtEnd = dtEnd;
-    d->mMultiDayValid = false;
+    d->mMultiDay.store(Private::MultiDayUnknown);
     setHasDuration(!dtEnd.isValid());
     setFieldDirty(FieldDtEnd);
     updated();
@@ -185,19 +192,25 @@ bool Event::hasEndDate() const
 bool Event::isMultiDay(const KDateTime::Spec &spec) const
 {
     // First off, if spec's not valid, we can check for cache
-    if (!spec.isValid() && d->mMultiDayValid) {
-        return d->mMultiDay;
+    if (!spec.isValid()) {
+        const int state = d->mMultiDay.loadAcquire();
+        if (state != Private::MultiDayUnknown) {
+            return state == Private::MultiDayYes;
+        }
     }
 
     // Not in cache -> do it the hard way
     KDateTime start, end;
 
-    if (!spec.isValid()) {
-        start = dtStart();
-        end = dtEnd();
-    } else {
-        start = dtStart().toTimeSpec(spec);
-        end = dtEnd().toTimeSpec(spec);
+    start = dtStart();
+    end = dtEnd();
+    if (spec.isValid()) {
+        // Convert copies with data of their own, as conversions cache their
+        // result in the date/time data, which concurrent readers share
+        start.detach();
+        end.detach();
+        start = start.toTimeSpec(spec);
+        end = end.toTimeSpec(spec);
     }
 
     bool multi = (start < end && start.date() != end.date());
@@ -211,8 +224,7 @@ bool Event::isMultiDay(const KDateTime::Spec &spec) const
 
     // Update the cache
     // Also update Cache if spec is invalid
-    d->mMultiDayValid = true;
-    d->mMultiDay = multi;
+    d->mMultiDay.storeRelease(multi ? Private::MultiDayYes : Private::MultiDayNo);
     return multi;
 }
 
@@ -343,7 +355,9 @@ QLatin1String Event::iconName(const KDateTime &) const
 void Event::serialize(QDataStream &out)
 {
     Incidence::serialize(out);
-    out << d->mDtEnd << hasEndDate() << static_cast<quint32>(d->mTransparency) << d->mMultiDayValid << d->mMultiDay;
+    const int multiDay = d->mMultiDay.load();
+    out << d->mDtEnd << hasEndDate() << static_cast<quint32>(d->mTransparency)
+        << (multiDay != Private::MultiDayUnknown) << (multiDay == Private::MultiDayYes);
 }
 
 void Event::deserialize(QDataStream &in)
@@ -354,7 +368,10 @@ void Event::deserialize(QDataStream &in)
     quint32 transp;
     in >> transp;
     d->mTransparency = static_cast<Transparency>(transp);
-    in >> d->mMultiDayValid >> d->mMultiDay;
+    bool multiDayValid, multiDay;
+    in >> multiDayValid >> multiDay;
+    d->mMultiDay.store(!multiDayValid ? Private::MultiDayUnknown
+                       : multiDay ? Private::MultiDayYes : Private::MultiDayNo);
 }
 
 bool Event::supportsGroupwareCommunication() const
@@ -36,8 +36,13 @@
 #include "icalformat.h"
 
 #include "kcalcore_debug.h"
+#include <QtCore/QHash>
+#include <QtCore/QMultiHash>
+#include <QtCore/QPair>
 #include <QTime>
 
+#include <algorithm>
+
 using namespace KCalCore;
 
 //@cond PRIVATE
@@ -46,7 +51,7 @@ class Q_DECL_HIDDEN KCalCore::FreeBusy::Private
 private:
     FreeBusy *q;
 public:
-    Private(FreeBusy *qq) : q(qq)
+    Private(FreeBusy *qq) : q(qq), mCoalesce(false)
     {}
 
     Private(const KCalCore::FreeBusy::Private &other, FreeBusy *qq) : q(qq)
@@ -55,14 +60,22 @@ public:
     }
 
     Private(const FreeBusyPeriod::List &busyPeriods, FreeBusy *qq)
-        : q(qq), mBusyPeriods(busyPeriods)
-    {}
+        : q(qq), mBusyPeriods(busyPeriods), mCoalesce(false)
+    {
+        std::stable_sort(mBusyPeriods.begin(), mBusyPeriods.end());
+    }
 
     void init(const KCalCore::FreeBusy::Private &other);
     void init(const Event::List &events, const KDateTime &start, const KDateTime &end);
 
+    void insertPeriod(const FreeBusyPeriod &period);
+    void insertPeriods(FreeBusyPeriod::List periods, bool sorted);
+    void coalesceAt(int i);
+    void coalesce();
+
     KDateTime mDtEnd;                  // end datetime
-    FreeBusyPeriod::List mBusyPeriods; // list of periods
+    FreeBusyPeriod::List mBusyPeriods; // list of periods, sorted by start
+    bool mCoalesce;                    // merge overlapping periods of the same kind
 
     // This is used for creating a freebusy object for the current user
     bool addLocalPeriod(FreeBusy *fb, const KDateTime &start, const KDateTime &end);
@@ -72,6 +85,116 @@ void KCalCore::FreeBusy::Private::init(const KCalCore::FreeBusy::Private &other)
 {
     mDtEnd = other.mDtEnd;
     mBusyPeriods = other.mBusyPeriods;
+    mCoalesce = other.mCoalesce;
+}
+
+// Inserts a period after those starting at or before it
+void KCalCore::FreeBusy::Private::insertPeriod(const FreeBusyPeriod &period)
+{
+    const FreeBusyPeriod::List::Iterator it =
+        mBusyPeriods.insert(std::upper_bound(mBusyPeriods.begin(), mBusyPeriods.end(), period),
+                            period);
+    if (mCoalesce) {
+        coalesceAt(static_cast<int>(it - mBusyPeriods.begin()));
+    }
+}
+
+// Merges a list of periods into the sorted list in linear time, once the
+// new periods are sorted
+void KCalCore::FreeBusy::Private::insertPeriods(FreeBusyPeriod::List periods, bool sorted)
+{
+    if (periods.isEmpty()) {
+        return;
+    }
+    if (!sorted) {
+        std::stable_sort(periods.begin(), periods.end());
+    }
+    if (mBusyPeriods.isEmpty()) {
+        mBusyPeriods = periods;
+    } else {
+        FreeBusyPeriod::List merged(mBusyPeriods.count() + periods.count());
+        std::merge(mBusyPeriods.constBegin(), mBusyPeriods.constEnd(),
+                   periods.constBegin(), periods.constEnd(), merged.begin());
+        mBusyPeriods = merged;
+    }
+    coalesce();
+}
+
+typedef QPair<int, QPair<QString, QString> > PeriodKind;
+
+static PeriodKind periodKind(const FreeBusyPeriod &period)
+{
+    return qMakePair(static_cast<int>(period.type()),
+                     qMakePair(period.summary(), period.location()));
+}
+
+static bool sameKind(const FreeBusyPeriod &p1, const FreeBusyPeriod &p2)
+{
+    return p1.type() == p2.type() &&
+           p1.summary() == p2.summary() &&
+           p1.location() == p2.location();
+}
+
+// Extends a period to end at 'end', if it ends earlier
+static void extendPeriod(FreeBusyPeriod &period, const KDateTime &end)
+{
+    if (period.end() < end) {
+        FreeBusyPeriod extended(period.start(), end);
+        extended.setType(period.type());
+        extended.setSummary(period.summary());
+        extended.setLocation(period.location());
+        period = extended;
+    }
+}
+
+// Merges the period at index i with the overlapping or adjacent periods of
+// the same kind, when the other periods are already coalesced. Only the
+// last period of the same kind before it can reach it, and only those
+// starting within it can follow it.
+void KCalCore::FreeBusy::Private::coalesceAt(int i)
+{
+    for (int j = i - 1; j >= 0; --j) {
+        if (sameKind(mBusyPeriods.at(j), mBusyPeriods.at(i))) {
+            if (!(mBusyPeriods.at(j).end() < mBusyPeriods.at(i).start())) {
+                extendPeriod(mBusyPeriods[j], mBusyPeriods.at(i).end());
+                mBusyPeriods.remove(i);
+                i = j;
+            }
+            break;
+        }
+    }
+    for (int j = i + 1;
+            j < mBusyPeriods.count() && !(mBusyPeriods.at(i).end() < mBusyPeriods.at(j).start());) {
+        if (sameKind(mBusyPeriods.at(j), mBusyPeriods.at(i))) {
+            extendPeriod(mBusyPeriods[i], mBusyPeriods.at(j).end());
+            mBusyPeriods.remove(j);
+        } else {
+            ++j;
+        }
+    }
+}
+
+// Merges the overlapping or adjacent periods of the same kind, in one pass
+// over the sorted list. Periods of other kinds may lie between them.
+void KCalCore::FreeBusy::Private::coalesce()
+{
+    if (!mCoalesce || mBusyPeriods.count() < 2) {
+        return;
+    }
+    FreeBusyPeriod::List result;
+    result.reserve(mBusyPeriods.count());
+    QHash<PeriodKind, int> last;    // index in result of the last period of each kind
+    foreach (const FreeBusyPeriod &period, mBusyPeriods) {
+        const PeriodKind kind = periodKind(period);
+        const QHash<PeriodKind, int>::ConstIterator it = last.constFind(kind);
+        if (it != last.constEnd() && !(result.at(it.value()).end() < period.start())) {
+            extendPeriod(result[it.value()], period.end());
+            continue;
+        }
+        last.insert(kind, result.count());
+        result.append(period);
+    }
+    mBusyPeriods = result;
 }
 //@endcond
 
@@ -106,85 +229,70 @@ FreeBusy::FreeBusy(const Event::List &events, const KDateTime &start, const KDat
 void FreeBusy::Private::init(const Event::List &eventList,
                              const KDateTime &start, const KDateTime &end)
 {
-    int extraDays, i, x, duration;
-    duration = start.daysTo(end);
-    QDate day;
-    KDateTime tmpStart;
-    KDateTime tmpEnd;
+    // Occurrences replaced by exceptions are busy as the exceptions say
+    QMultiHash<QString, KDateTime> exceptions;
+    foreach (const Event::Ptr &event, eventList) {
+        if (event->hasRecurrenceId()) {
+            exceptions.insert(event->uid(), event->recurrenceId());
+        }
+    }
 
     // Loops through every event in the calendar
-    Event::List::ConstIterator it;
-    for (it = eventList.constBegin(); it != eventList.constEnd(); ++it) {
-        Event::Ptr event = *it;
-
+    foreach (const Event::Ptr &event, eventList) {
         // If this event is transparent it shouldn't be in the freebusy list.
         if (event->transparency() == Event::Transparent) {
             continue;
         }
 
-        // The code below can not handle all-day events. Fixing this resulted
-        // in a lot of duplicated code. Instead, make a copy of the event and
-        // set the period to the full day(s). This trick works for recurring,
-        // multiday, and single day all-day events.
-        Event::Ptr allDayEvent;
-        if (event->allDay()) {
-            // addDay event. Do the hack
-            qCDebug(KCALCORE_LOG) << "All-day event";
-            allDayEvent = Event::Ptr(new Event(*event));
-
-            // Set the start and end times to be on midnight
-            KDateTime st = allDayEvent->dtStart();
-            st.setTime(QTime(0, 0));
-            KDateTime nd = allDayEvent->dtEnd();
-            nd.setTime(QTime(23, 59, 59, 999));
-            allDayEvent->setAllDay(false);
-            allDayEvent->setDtStart(st);
-            allDayEvent->setDtEnd(nd);
-
-            qCDebug(KCALCORE_LOG) << "Use:" << st.toString() << "to" << nd.toString();
-            // Finally, use this event for the setting below
-            event = allDayEvent;
+        // All-day events are busy from the start of their first day to the
+        // end of their last day
+        const bool allDay = event->allDay();
+        const KDateTime::Spec spec = event->dtStart().timeSpec();
+        const int days = event->dtStart().daysTo(event->dtEnd());
+        const Duration duration(event->dtStart(), event->dtEnd());
+
+        if (!event->recurs()) {
+            if (allDay) {
+                addLocalPeriod(q, KDateTime(event->dtStart().date(), QTime(0, 0), spec),
+                               KDateTime(event->dtEnd().date(), QTime(23, 59, 59, 999), spec));
+            } else {
+                addLocalPeriod(q, event->dtStart(), event->dtEnd());
+            }
+            continue;
         }
 
-        // This whole for loop is for recurring events, it loops through
-        // each of the days of the freebusy request
-
-        for (i = 0; i <= duration; ++i) {
-            day = start.addDays(i).date();
-            tmpStart.setDate(day);
-            tmpEnd.setDate(day);
-
-            if (event->recurs()) {
-                if (event->isMultiDay()) {
-                    // FIXME: This doesn't work for sub-daily recurrences or recurrences with
-                    //        a different time than the original event.
-                    extraDays = event->dtStart().daysTo(event->dtEnd());
-                    for (x = 0; x <= extraDays; ++x) {
-                        if (event->recursOn(day.addDays(-x), start.timeSpec())) {
-                            tmpStart.setDate(day.addDays(-x));
-                            tmpStart.setTime(event->dtStart().time());
-                            tmpEnd = event->duration().end(tmpStart);
-
-                            addLocalPeriod(q, tmpStart, tmpEnd);
-                            break;
-                        }
-                    }
-                } else {
-                    if (event->recursOn(day, start.timeSpec())) {
-                        tmpStart.setTime(event->dtStart().time());
-                        tmpEnd.setTime(event->dtEnd().time());
-
-                        addLocalPeriod(q, tmpStart, tmpEnd);
-                    }
-                }
+        // Go through the occurrences which can overlap the free/busy period,
+        // starting with the earliest which can still end within it
+        KDateTime position;
+        if (allDay) {
+            position = KDateTime(start.toTimeSpec(spec).date().addDays(-days), QTime(0, 0), spec);
+        } else {
+            position = start.addSecs(-duration.asSeconds());
+        }
+        position = position.addSecs(-1);
+        const QList<KDateTime> replaced = exceptions.values(event->uid());
+        Recurrence::Cursor cursor(event->recurrence(), position);
+        for (KDateTime dt = cursor.next(); dt.isValid(); dt = cursor.next()) {
+            KDateTime tmpStart;
+            KDateTime tmpEnd;
+            if (allDay) {
+                tmpStart = KDateTime(dt.date(), QTime(0, 0), spec);
+                tmpEnd = KDateTime(dt.date().addDays(days), QTime(23, 59, 59, 999), spec);
+            } else {
+                tmpStart = dt;
+                tmpEnd = duration.end(dt);
+            }
+            if (end < tmpStart) {
+                break;
+            }
+            if (!replaced.contains(dt)) {
+                addLocalPeriod(q, tmpStart, tmpEnd);
             }
-
         }
-        // Non-recurring events
-        addLocalPeriod(q, event->dtStart(), event->dtEnd());
     }
 
-    q->sortList();
+    std::stable_sort(mBusyPeriods.begin(), mBusyPeriods.end());
+    coalesce();
 }
 //@endcond
 
@@ -249,35 +357,43 @@ FreeBusyPeriod::List FreeBusy::fullBusyPeriods() const
 
 void FreeBusy::sortList()
 {
-    qSort(d->mBusyPeriods);
-    return;
+    std::stable_sort(d->mBusyPeriods.begin(), d->mBusyPeriods.end());
+}
+
+void FreeBusy::setCoalescePeriods(bool coalesce)
+{
+    d->mCoalesce = coalesce;
+    d->coalesce();
+}
+
+bool FreeBusy::coalescePeriods() const
+{
+    return d->mCoalesce;
 }
 
 void FreeBusy::addPeriods(const Period::List &list)
 {
-    d->mBusyPeriods.reserve(d->mBusyPeriods.count() + list.count());
+    FreeBusyPeriod::List periods;
+    periods.reserve(list.count());
     foreach (const Period &p, list) {
-        d->mBusyPeriods << FreeBusyPeriod(p);
+        periods << FreeBusyPeriod(p);
     }
-    sortList();
+    d->insertPeriods(periods, false);
 }
 
 void FreeBusy::addPeriods(const FreeBusyPeriod::List &list)
 {
-    d->mBusyPeriods += list;
-    sortList();
+    d->insertPeriods(list, false);
 }
 
 void FreeBusy::addPeriod(const KDateTime &start, const KDateTime &end)
 {
-    d->mBusyPeriods.append(FreeBusyPeriod(start, end));
-    sortList();
+    d->insertPeriod(FreeBusyPeriod(start, end));
 }
 
 void FreeBusy::addPeriod(const KDateTime &start, const Duration &duration)
 {
-    d->mBusyPeriods.append(FreeBusyPeriod(start, duration));
-    sortList();
+    d->insertPeriod(FreeBusyPeriod(start, duration));
 }
 
 void FreeBusy::merge(const FreeBusy::Ptr &freeBusy)
@@ -290,13 +406,8 @@ void FreeBusy::merge(const FreeBusy::Ptr &freeBusy)
         setDtEnd(freeBusy->dtEnd());
     }
 
-    Period::List periods = freeBusy->busyPeriods();
-    Period::List::ConstIterator it;
-    d->mBusyPeriods.reserve(d->mBusyPeriods.count() + periods.count());
-    for (it = periods.constBegin(); it != periods.constEnd(); ++it) {
-        d->mBusyPeriods.append(FreeBusyPeriod((*it).start(), (*it).end()));
-    }
-    sortList();
+    // Both lists are sorted, so they are merged in linear time
+    d->insertPeriods(freeBusy->d->mBusyPeriods, true);
 }
 
 void FreeBusy::shiftTimes(const KDateTime::Spec &oldSpec,
@@ -368,13 +479,9 @@ bool FreeBusy::Private::addLocalPeriod(FreeBusy *fb,
     KDateTime tmpStart;
     KDateTime tmpEnd;
 
-    //Check to see if the start *or* end of the event is
-    //between the start and end of the freebusy dates.
+    //Check to see if the event overlaps the freebusy dates.
     KDateTime start = fb->dtStart();
-    if (!(((start.secsTo(eventStart) >= 0) &&
-            (eventStart.secsTo(mDtEnd) >= 0)) ||
-            ((start.secsTo(eventEnd) >= 0) &&
-             (eventEnd.secsTo(mDtEnd) >= 0)))) {
+    if (start.secsTo(eventEnd) < 0 || eventStart.secsTo(mDtEnd) < 0) {
         return false;
     }
 
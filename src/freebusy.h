@@ -169,7 +169,26 @@ public:
     FreeBusyPeriod::List fullBusyPeriods() const;
 
     /**
-      Adds a period to the freebusy list and sorts the list.
+      Sets whether overlapping or adjacent periods are merged into a single
+      period when they are of the same type, and have the same summary and
+      location. Periods which are already in the list are merged at once.
+
+      @param coalesce is true to merge the periods, false to keep them apart.
+      @see coalescePeriods()
+      @since 5.15
+    */
+    void setCoalescePeriods(bool coalesce);
+
+    /**
+      Returns whether overlapping or adjacent periods of the same kind are
+      merged. The default is false.
+      @see setCoalescePeriods()
+      @since 5.15
+    */
+    bool coalescePeriods() const;
+
+    /**
+      Adds a period to the freebusy list, keeping the list sorted.
 
       @param start is the start datetime of the period.
       @param end is the end datetime of the period.
@@ -177,7 +196,7 @@ public:
     void addPeriod(const KDateTime &start, const KDateTime &end);
 
     /**
-      Adds a period to the freebusy list and sorts the list.
+      Adds a period to the freebusy list, keeping the list sorted.
 
       @param start is the start datetime of the period.
       @param duration is the Duration of the period.
@@ -204,11 +223,14 @@ public:
 
     /**
       Sorts the list of free/busy periods into ascending order.
+      The list is kept sorted as periods are added, so this is only needed
+      for compatibility.
     */
     void sortList();
 
     /**
-      Merges another free/busy into this free/busy.
+      Merges another free/busy into this free/busy, keeping the types,
+      summaries and locations of its periods.
 
       @param freebusy is a pointer to a valid FreeBusy object.
     */
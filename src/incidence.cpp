@@ -35,6 +35,7 @@
 #include "incidence.h"
 #include "calformat.h"
 
+#include <QBitArray>
 #include <QTemporaryFile>
 #include <QMimeDatabase>
 #include <QTextDocument> // for .toHtmlEscaped() and Qt::mightBeRichText()
@@ -625,9 +626,10 @@ QList<KDateTime> Incidence::startDateTimesForDate(const QDate &date,
     int days = start.daysTo(end);
     // Account for possible recurrences going over midnight, while the original event doesn't
     QDate tmpday(date.addDays(-days - 1));
+    const QBitArray recurDays = recurrence()->recursOnRange(tmpday, date, timeSpec);
     KDateTime tmp;
-    while (tmpday <= date) {
-        if (recurrence()->recursOn(tmpday, timeSpec)) {
+    for (int i = 0; tmpday <= date; ++i) {
+        if (recurDays.testBit(i)) {
             QList<QTime> times = recurrence()->recurTimesOn(tmpday, timeSpec);
             foreach (const QTime &time, times) {
                 tmp = KDateTime(tmpday, time, start.timeSpec());
@@ -664,9 +666,11 @@ QList<KDateTime> Incidence::startDateTimesForDateTime(const KDateTime &datetime)
     int days = start.daysTo(end);
     // Account for possible recurrences going over midnight, while the original event doesn't
     QDate tmpday(datetime.date().addDays(-days - 1));
+    const QBitArray recurDays =
+        recurrence()->recursOnRange(tmpday, datetime.date(), datetime.timeSpec());
     KDateTime tmp;
-    while (tmpday <= datetime.date()) {
-        if (recurrence()->recursOn(tmpday, datetime.timeSpec())) {
+    for (int i = 0; tmpday <= datetime.date(); ++i) {
+        if (recurDays.testBit(i)) {
             // Get the times during the day (in start date's time zone) when recurrences happen
             QList<QTime> times = recurrence()->recurTimesOn(tmpday, start.timeSpec());
             foreach (const QTime &time, times) {
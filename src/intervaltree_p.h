@@ -0,0 +1,270 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the internal IntervalTree class.
+*/
+
+#ifndef KCALCORE_INTERVALTREE_P_H
+#define KCALCORE_INTERVALTREE_P_H
+
+#include <QtCore/QHash>
+#include <QtCore/QVector>
+
+namespace KCalCore
+{
+
+//@cond PRIVATE
+/**
+  An augmented interval tree mapping closed intervals [start, end] to values.
+
+  The tree is a treap ordered by (start, id) where every node also records the
+  largest end point found in its subtree, so that overlap queries only descend
+  into subtrees which can contain a match. Each entry is identified by a unique
+  @c id (usually the address of the stored object), which is what removal uses;
+  the interval itself does not need to be known to remove an entry.
+
+  Nodes are kept in a QVector so that copying a tree is cheap and implicitly
+  shared.
+  @internal
+*/
+template <typename T>
+class IntervalTree
+{
+public:
+    IntervalTree()
+        : mRoot(-1), mFreeList(-1)
+    {
+    }
+
+    /**
+      Returns the number of entries in the tree.
+    */
+    int count() const
+    {
+        return mNodeForId.count();
+    }
+
+    /**
+      Returns true if the tree holds an entry with identifier @p id.
+    */
+    bool contains(quintptr id) const
+    {
+        return mNodeForId.contains(id);
+    }
+
+    /**
+      Removes all entries.
+    */
+    void clear()
+    {
+        mNodes.clear();
+        mNodeForId.clear();
+        mRoot = -1;
+        mFreeList = -1;
+    }
+
+    /**
+      Reserves space for @p size entries.
+    */
+    void reserve(int size)
+    {
+        mNodes.reserve(size);
+        mNodeForId.reserve(size);
+    }
+
+    /**
+      Inserts @p value for the interval [@p start, @p end] under the identifier @p id.
+      An existing entry with the same identifier is replaced.
+    */
+    void insert(qint64 start, qint64 end, quintptr id, const T &value)
+    {
+        remove(id);
+
+        int n;
+        if (mFreeList >= 0) {
+            n = mFreeList;
+            mFreeList = mNodes[n].right;
+        } else {
+            n = mNodes.count();
+            mNodes.append(Node());
+        }
+        Node &node = mNodes[n];
+        node.start = start;
+        node.end = qMax(start, end);
+        node.maxEnd = node.end;
+        node.id = id;
+        node.value = value;
+        node.priority = priorityFor(id);
+        node.left = -1;
+        node.right = -1;
+        mNodeForId.insert(id, n);
+
+        int less, greater;
+        split(mRoot, start, id, less, greater);
+        mRoot = merge(merge(less, n), greater);
+    }
+
+    /**
+      Removes the entry with identifier @p id.
+      @return true if the entry was found.
+    */
+    bool remove(quintptr id)
+    {
+        const int n = mNodeForId.value(id, -1);
+        if (n < 0) {
+            return false;
+        }
+        mNodeForId.remove(id);
+
+        const qint64 start = mNodes.at(n).start;
+        int less, rest, greater, single;
+        split(mRoot, start, id, less, rest);
+        split(rest, start, id + 1, single, greater);
+        Q_ASSERT(single == n);
+        mRoot = merge(less, greater);
+
+        Node &node = mNodes[n];
+        node.value = T();
+        node.left = -1;
+        node.right = mFreeList;
+        mFreeList = n;
+        return true;
+    }
+
+    /**
+      Returns the values of all entries whose interval intersects [@p from, @p to],
+      i.e. with start <= @p to and end >= @p from, in ascending order of start.
+    */
+    QVector<T> overlapping(qint64 from, qint64 to) const
+    {
+        QVector<T> result;
+        collect(mRoot, from, to, result);
+        return result;
+    }
+
+private:
+    struct Node {
+        qint64 start;
+        qint64 end;
+        qint64 maxEnd;
+        quintptr id;
+        T value;
+        uint priority;
+        int left;
+        int right;
+    };
+
+    static uint priorityFor(quintptr id)
+    {
+        // Mix the bits, identifiers are usually aligned pointers
+        quint64 x = id;
+        x ^= x >> 33;
+        x *= Q_UINT64_C(0xff51afd7ed558ccd);
+        x ^= x >> 33;
+        x *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+        x ^= x >> 33;
+        return uint(x);
+    }
+
+    void update(int n)
+    {
+        Node &node = mNodes[n];
+        node.maxEnd = node.end;
+        if (node.left >= 0) {
+            node.maxEnd = qMax(node.maxEnd, mNodes.at(node.left).maxEnd);
+        }
+        if (node.right >= 0) {
+            node.maxEnd = qMax(node.maxEnd, mNodes.at(node.right).maxEnd);
+        }
+    }
+
+    // Splits the subtree @p n into the entries ordered before (start, id) and the rest
+    void split(int n, qint64 start, quintptr id, int &less, int &greater)
+    {
+        if (n < 0) {
+            less = greater = -1;
+            return;
+        }
+        const Node &node = mNodes.at(n);
+        if (node.start < start || (node.start == start && node.id < id)) {
+            int right = node.right;
+            split(right, start, id, right, greater);
+            mNodes[n].right = right;
+            less = n;
+        } else {
+            int left = node.left;
+            split(left, start, id, less, left);
+            mNodes[n].left = left;
+            greater = n;
+        }
+        update(n);
+    }
+
+    // Joins two subtrees where all entries of @p less are ordered before @p greater
+    int merge(int less, int greater)
+    {
+        if (less < 0) {
+            return greater;
+        }
+        if (greater < 0) {
+            return less;
+        }
+        if (mNodes.at(less).priority > mNodes.at(greater).priority) {
+            const int right = merge(mNodes.at(less).right, greater);
+            mNodes[less].right = right;
+            update(less);
+            return less;
+        } else {
+            const int left = merge(less, mNodes.at(greater).left);
+            mNodes[greater].left = left;
+            update(greater);
+            return greater;
+        }
+    }
+
+    void collect(int n, qint64 from, qint64 to, QVector<T> &result) const
+    {
+        while (n >= 0) {
+            const Node &node = mNodes.at(n);
+            if (node.maxEnd < from) {
+                return;
+            }
+            collect(node.left, from, to, result);
+            if (node.start > to) {
+                return;
+            }
+            if (node.end >= from) {
+                result.append(node.value);
+            }
+            n = node.right;
+        }
+    }
+
+    QVector<Node> mNodes;
+    QHash<quintptr, int> mNodeForId;
+    int mRoot;
+    int mFreeList;
+};
+//@endcond
+
+}
+
+#endif
@@ -33,35 +33,71 @@
  */
 
 #include "memorycalendar.h"
+#include "icaltimezones.h"
+#include "intervaltree_p.h"
 
 #include "kcalcore_debug.h"
+#include <QBitArray>
 #include <QDate>
+#include <QSet>
 #include <KDateTime>
 
-template <typename K, typename V>
-static QVector<V> values(const QMultiHash<K, V> &c)
+#include <limits>
+
+using namespace KCalCore;
+
+/**
+  Returns the number of seconds between the start of the Julian period and @p dt,
+  converted to UTC. Date-only values are taken at the start of their date.
+*/
+static qint64 utcSeconds(const KDateTime &dt)
 {
-    QVector<V> v;
-    v.reserve(c.size());
-    for (typename QMultiHash<K, V>::const_iterator it = c.begin(), end = c.end(); it != end; ++it) {
-        v.push_back(it.value());
-    }
-    return v;
+    const KDateTime utc = dt.toUtc();
+    return utc.date().toJulianDay() * Q_INT64_C(86400) + QTime(0, 0).secsTo(utc.time());
 }
 
-template <typename K, typename V>
-static  QVector<V> values(const QMultiHash<K, V> &c, const K &x)
+static const qint64 secondsPerDay = 86400;
+
+/**
+  Computes the range of Julian days over which a recurring @p incidence can have
+  occurrences, widened by a day on each side to allow for time zone differences.
+  Multi-day events also cover the days spanned by their last occurrence.
+*/
+static void recurrenceBounds(const Incidence::Ptr &incidence, qint64 &first, qint64 &last)
 {
-    QVector<V> v;
-    typename QMultiHash<K, V>::const_iterator it = c.find(x);
-    while (it != c.end() && it.key() == x) {
-        v.push_back(it.value());
-        ++it;
+    first = std::numeric_limits<qint64>::min();
+    last = std::numeric_limits<qint64>::max();
+
+    const Recurrence *recurrence = incidence->recurrence();
+    const KDateTime start = recurrence->startDateTime();
+    if (!start.isValid()) {
+        return;
     }
-    return v;
-}
 
-using namespace KCalCore;
+    QDate firstDate = start.date();
+    const DateList rDates = recurrence->rDates();
+    if (!rDates.isEmpty() && rDates.first() < firstDate) {
+        firstDate = rDates.first();
+    }
+    const DateTimeList rDateTimes = recurrence->rDateTimes();
+    if (!rDateTimes.isEmpty() && rDateTimes.first().date() < firstDate) {
+        firstDate = rDateTimes.first().date();
+    }
+    first = firstDate.toJulianDay() - 1;
+
+    const KDateTime end = recurrence->endDateTime();
+    if (!end.isValid()) {
+        return;    // infinite
+    }
+    int extraDays = 0;
+    if (incidence->type() == Incidence::TypeEvent) {
+        const Event::Ptr event = incidence.staticCast<Event>();
+        if (event->isMultiDay()) {
+            extraDays = event->dtStart().date().daysTo(event->dtEnd().date());
+        }
+    }
+    last = end.date().toJulianDay() + extraDays + 1;
+}
 
 /**
   Private class that helps to provide binary compatibility between releases.
@@ -72,22 +108,49 @@ class Q_DECL_HIDDEN KCalCore::MemoryCalendar::Private
 {
 public:
     Private(MemoryCalendar *qq)
-        : q(qq), mFormat(0)
+        : q(qq), mFormat(0), mSnapshot(false)
     {
     }
     ~Private()
     {
     }
 
+    /**
+     * Orders recurrence ids by the instant they refer to. Incidences without
+     * a recurrence id have the smallest key.
+     */
+    struct RecurrenceIdKey {
+        qint64 seconds;
+        bool dateOnly;
+
+        bool operator<(const RecurrenceIdKey &other) const
+        {
+            return seconds < other.seconds || (seconds == other.seconds && dateOnly < other.dateOnly);
+        }
+    };
+
+    /**
+     * An incidence and its exceptions, ordered by recurrence id.
+     */
+    typedef QMultiMap<RecurrenceIdKey, Incidence::Ptr> Instances;
+
+    /**
+     * Incidences indexed by uid, and then by recurrence id.
+     */
+    typedef QHash<QString, Instances> IncidencesByUid;
+
     MemoryCalendar *q;
     CalFormat *mFormat;                    // calendar format
     QString mIncidenceBeingUpdated;        //  Instance identifier of Incidence currently being updated
+    QString mUidBeingUpdated;              //  Uid of the Incidence currently being updated
+    Incidence::Ptr mIncidencePtrBeingUpdated; // The Incidence currently being updated
 
     /**
      * List of all incidences.
-     * First indexed by incidence->type(), then by incidence->uid();
+     * First indexed by incidence->type(), then by incidence->uid(),
+     * then by incidence->recurrenceId();
      */
-    QMap<IncidenceBase::IncidenceType, QMultiHash<QString, Incidence::Ptr> > mIncidences;
+    QMap<IncidenceBase::IncidenceType, IncidencesByUid> mIncidences;
 
     /**
      * Has all incidences, indexed by identifier.
@@ -96,25 +159,93 @@ public:
 
     /**
      * List of all deleted incidences.
-     * First indexed by incidence->type(), then by incidence->uid();
+     * First indexed by incidence->type(), then by incidence->uid(),
+     * then by incidence->recurrenceId();
      */
-    QMap<IncidenceBase::IncidenceType, QMultiHash<QString, Incidence::Ptr> > mDeletedIncidences;
+    QMap<IncidenceBase::IncidenceType, IncidencesByUid> mDeletedIncidences;
 
     /**
      * Contains incidences ( to-dos; non-recurring, non-multiday events; journals; )
      * indexed by start/due date.
      *
      * The QMap key is the incidence->type().
-     * The QMultiHash key is the dtStart/dtDue().toString()
+     * The QMultiMap key is the Julian day of dtStart/dtDue(), so consecutive
+     * days are next to each other.
      *
      * Note: We had 3 variables, mJournalsForDate, mTodosForDate and mEventsForDate
      * but i merged them into one (indexed by type) because it simplifies code using
      * it. No need to if else based on type.
      */
-    QMap<IncidenceBase::IncidenceType, QMultiHash<QString, IncidenceBase::Ptr> > mIncidencesForDate;
+    QMap<IncidenceBase::IncidenceType, QMultiMap<qint64, Incidence::Ptr> > mIncidencesForDate;
+
+    /**
+     * The mIncidencesForDate key each incidence was inserted with, so that it can
+     * be removed again after its dates changed.
+     */
+    QHash<quintptr, qint64> mDateKeys;
+
+    /**
+     * Non-recurring events indexed by the UTC interval between their start and end,
+     * to answer range queries without visiting every event.
+     */
+    IntervalTree<Incidence::Ptr> mEventsByInterval;
+
+    /**
+     * Non-recurring events which can't be put into mEventsByInterval because they
+     * have no valid start. Range queries always check all of them.
+     */
+    QHash<quintptr, Incidence::Ptr> mUnindexedEvents;
+
+    /**
+     * Recurring incidences indexed by the Julian days between their first and
+     * last possible occurrence (see recurrenceBounds()), so that date queries
+     * only look at the recurring incidences which can occur on that date.
+     *
+     * The QMap key is the incidence->type().
+     */
+    QMap<IncidenceBase::IncidenceType, IntervalTree<Incidence::Ptr> > mRecurringIncidences;
+
+    /**
+     * Incidences added since startBatchAdding(), which are only in mIncidences
+     * and mIncidencesByIdentifier until endBatchAdding() indexes them.
+     */
+    Incidence::List mBatchIncidences;
+
+    /**
+     * The incidences in mBatchIncidences, so that an incidence deleted and
+     * added again while batch adding is only indexed once.
+     */
+    QSet<quintptr> mBatchIds;
+
+    /**
+     * True if this is a read-only calendar made by MemoryCalendar::snapshot().
+     * Snapshots share their incidences without observing them.
+     */
+    bool mSnapshot;
+
+    /**
+     * Returns the entry of @p type in one of the maps by type, or an empty one.
+     * Readers use it instead of the non-const operator[], which inserts missing
+     * entries and detaches maps shared with a snapshot: readers may run
+     * concurrently under the read lock of a ConcurrentMemoryCalendar.
+     */
+    template<typename T>
+    static const T &constValue(const QMap<IncidenceBase::IncidenceType, T> &map,
+                               IncidenceBase::IncidenceType type)
+    {
+        static const T empty;
+        const typename QMap<IncidenceBase::IncidenceType, T>::const_iterator it = map.constFind(type);
+        return it == map.constEnd() ? empty : it.value();
+    }
 
     void insertIncidence(const Incidence::Ptr &incidence);
 
+    void finishBatchAdding();
+
+    void indexIncidence(const Incidence::Ptr &incidence);
+
+    void unindexIncidence(const Incidence::Ptr &incidence);
+
     Incidence::Ptr incidence(const QString &uid,
                              const IncidenceBase::IncidenceType type,
                              const KDateTime &recurrenceId = KDateTime()) const;
@@ -125,6 +256,27 @@ public:
 
     void deleteAllIncidences(const IncidenceBase::IncidenceType type);
 
+    bool isStored(const Incidence::Ptr &incidence) const;
+
+    void finishUpdate();
+
+    MemoryCalendar::Ptr snapshot() const;
+
+    static RecurrenceIdKey recurrenceIdKey(const KDateTime &recurrenceId);
+
+    static bool insertInstance(IncidencesByUid &incidences, const Incidence::Ptr &incidence);
+
+    static bool removeInstance(IncidencesByUid &incidences, const QString &uid,
+                               const Incidence::Ptr &incidence);
+
+    static Incidence::Ptr findInstance(const IncidencesByUid &incidences, const QString &uid,
+                                       const KDateTime &recurrenceId);
+
+    template <typename T>
+    static QVector<QSharedPointer<T> > exceptions(const IncidencesByUid &incidences, const QString &uid);
+
+    template <typename T>
+    static QVector<QSharedPointer<T> > values(const IncidencesByUid &incidences);
 };
 //@endcond
 
@@ -148,6 +300,20 @@ MemoryCalendar::~MemoryCalendar()
 
 void MemoryCalendar::close()
 {
+    if (d->mSnapshot) {
+        // Only drop the references to the indexes shared with the calendar
+        d->mIncidences.clear();
+        d->mIncidencesByIdentifier.clear();
+        d->mDeletedIncidences.clear();
+        d->mIncidencesForDate.clear();
+        d->mDateKeys.clear();
+        d->mEventsByInterval.clear();
+        d->mUnindexedEvents.clear();
+        d->mRecurringIncidences.clear();
+        setModified(false);
+        return;
+    }
+
     setObserversEnabled(false);
 
     // Don't call the virtual function deleteEvents() etc, the base class might have
@@ -158,32 +324,85 @@ void MemoryCalendar::close()
 
     d->mIncidencesByIdentifier.clear();
     d->mDeletedIncidences.clear();
+    d->mBatchIncidences.clear();
+    d->mBatchIds.clear();
 
     setModified(false);
 
     setObserversEnabled(true);
 }
 
+//@cond PRIVATE
+MemoryCalendar::Ptr MemoryCalendar::Private::snapshot() const
+{
+    MemoryCalendar::Ptr snapshot(new MemoryCalendar(q->timeSpec()));
+    snapshot->setViewTimeSpec(q->viewTimeSpec());
+    snapshot->setProductId(q->productId());
+    snapshot->setTimeZones(new ICalTimeZones(*q->timeZones()));
+    snapshot->setDeletionTracking(q->deletionTracking());
+
+    // All the indexes are implicitly shared, so this doesn't copy them. They are
+    // only copied when this calendar modifies them next.
+    Private *s = snapshot->d;
+    s->mSnapshot = true;
+    s->mIncidences = mIncidences;
+    s->mIncidencesByIdentifier = mIncidencesByIdentifier;
+    s->mDeletedIncidences = mDeletedIncidences;
+    s->mIncidencesForDate = mIncidencesForDate;
+    s->mDateKeys = mDateKeys;
+    s->mEventsByInterval = mEventsByInterval;
+    s->mUnindexedEvents = mUnindexedEvents;
+    s->mRecurringIncidences = mRecurringIncidences;
+
+    // Incidences being batch added or updated are missing from some indexes
+    for (auto it = mBatchIncidences.constBegin(); it != mBatchIncidences.constEnd(); ++it) {
+        if (isStored(*it)) {
+            s->indexIncidence(*it);
+        }
+    }
+    if (mIncidencePtrBeingUpdated) {
+        s->indexIncidence(mIncidencePtrBeingUpdated);
+    }
+
+    return snapshot;
+}
+//@endcond
+
+MemoryCalendar::Ptr MemoryCalendar::snapshot() const
+{
+    // Dispatched through virtual_hook(), so that subclasses can lock
+    MemoryCalendar::Ptr result;
+    const_cast<MemoryCalendar *>(this)->virtual_hook(SnapshotHook, &result);
+    return result;
+}
+
+bool MemoryCalendar::isSnapshot() const
+{
+    return d->mSnapshot;
+}
+
 bool MemoryCalendar::deleteIncidence(const Incidence::Ptr &incidence)
 {
+    if (d->mSnapshot) {
+        qCWarning(KCALCORE_LOG) << "Cannot delete from a calendar snapshot";
+        return false;
+    }
+
     // Handle orphaned children
     // relations is an Incidence's property, not a Todo's, so
     // we remove relations in deleteIncidence, not in deleteTodo.
     removeRelations(incidence);
     const Incidence::IncidenceType type = incidence->type();
     const QString uid = incidence->uid();
-    if (d->mIncidences[type].remove(uid, incidence)) {
+    if (Private::removeInstance(d->mIncidences[type], uid, incidence)) {
         d->mIncidencesByIdentifier.remove(incidence->instanceIdentifier());
         setModified(true);
         notifyIncidenceDeleted(incidence);
         if (deletionTracking()) {
-            d->mDeletedIncidences[type].insert(uid, incidence);
+            Private::insertInstance(d->mDeletedIncidences[type], incidence);
         }
 
-        const KDateTime dt = incidence->dateTime(Incidence::RoleCalendarHashing);
-        if (dt.isValid()) {
-            d->mIncidencesForDate[type].remove(dt.date().toString(), incidence);
-        }
+        d->unindexIncidence(incidence);
         // Delete child-incidences.
         if (!incidence->hasRecurrenceId()) {
             deleteIncidenceInstances(incidence);
@@ -197,18 +416,22 @@ bool MemoryCalendar::deleteIncidence(const Incidence::Ptr &incidence)
 
 bool MemoryCalendar::deleteIncidenceInstances(const Incidence::Ptr &incidence)
 {
+    if (d->mSnapshot) {
+        qCWarning(KCALCORE_LOG) << "Cannot delete from a calendar snapshot";
+        return false;
+    }
+
     const Incidence::IncidenceType type = incidence->type();
-    Incidence::List values = ::values(d->mIncidences[type], incidence->uid());
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
+    const Incidence::List exceptions =
+        Private::exceptions<Incidence>(d->mIncidences[type], incidence->uid());
+    for (auto it = exceptions.constBegin(); it != exceptions.constEnd(); ++it) {
         Incidence::Ptr i = *it;
-        if (i->hasRecurrenceId()) {
-            qCDebug(KCALCORE_LOG) << "deleting child"
-                                  << ", type=" << int(type)
-                                  << ", uid=" << i->uid()
-//                   << ", start=" << i->dtStart()
-                                  << " from calendar";
-            deleteIncidence(i);
-        }
+        qCDebug(KCALCORE_LOG) << "deleting child"
+                              << ", type=" << int(type)
+                              << ", uid=" << i->uid()
+//               << ", start=" << i->dtStart()
+                              << " from calendar";
+        deleteIncidence(i);
     }
 
     return true;
@@ -217,34 +440,37 @@ bool MemoryCalendar::deleteIncidenceInstances(const Incidence::Ptr &incidence)
 //@cond PRIVATE
 void MemoryCalendar::Private::deleteAllIncidences(const Incidence::IncidenceType incidenceType)
 {
-    QHashIterator<QString, Incidence::Ptr>i(mIncidences[incidenceType]);
-    while (i.hasNext()) {
-        i.next();
-        q->notifyIncidenceDeleted(i.value());
-        i.value()->unRegisterObserver(q);
+    const Incidence::List incidences = values<Incidence>(mIncidences[incidenceType]);
+    for (auto it = incidences.constBegin(); it != incidences.constEnd(); ++it) {
+        q->notifyIncidenceDeleted(*it);
+        if (!mSnapshot) {
+            (*it)->unRegisterObserver(q);
+        }
     }
     mIncidences[incidenceType].clear();
+    for (auto it = mIncidencesForDate[incidenceType].constBegin(),
+         end = mIncidencesForDate[incidenceType].constEnd(); it != end; ++it) {
+        mDateKeys.remove(reinterpret_cast<quintptr>(it.value().data()));
+    }
     mIncidencesForDate[incidenceType].clear();
+    mRecurringIncidences[incidenceType].clear();
+    if (incidenceType == Incidence::TypeEvent) {
+        mEventsByInterval.clear();
+        mUnindexedEvents.clear();
+    }
+}
+
+bool MemoryCalendar::Private::isStored(const Incidence::Ptr &incidence) const
+{
+    const Instances instances = mIncidences.value(incidence->type()).value(incidence->uid());
+    return instances.contains(recurrenceIdKey(incidence->recurrenceId()), incidence);
 }
 
 Incidence::Ptr MemoryCalendar::Private::incidence(const QString &uid,
         const Incidence::IncidenceType type,
         const KDateTime &recurrenceId) const
 {
-    Incidence::List values = ::values(mIncidences[type], uid);
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
-        Incidence::Ptr i = *it;
-        if (recurrenceId.isNull()) {
-            if (!i->hasRecurrenceId()) {
-                return i;
-            }
-        } else {
-            if (i->hasRecurrenceId() && i->recurrenceId() == recurrenceId) {
-                return i;
-            }
-        }
-    }
-    return Incidence::Ptr();
+    return findInstance(mIncidences[type], uid, recurrenceId);
 }
 
 Incidence::Ptr
@@ -256,48 +482,247 @@ MemoryCalendar::Private::deletedIncidence(const QString &uid,
         return Incidence::Ptr();
     }
 
-    Incidence::List values = ::values(mDeletedIncidences[type], uid);
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
-        Incidence::Ptr i = *it;
-        if (recurrenceId.isNull()) {
-            if (!i->hasRecurrenceId()) {
-                return i;
-            }
-        } else {
-            if (i->hasRecurrenceId() && i->recurrenceId() == recurrenceId) {
-                return i;
-            }
-        }
-    }
-    return Incidence::Ptr();
+    return findInstance(mDeletedIncidences[type], uid, recurrenceId);
 }
 
 void MemoryCalendar::Private::insertIncidence(const Incidence::Ptr &incidence)
 {
-    const QString uid = incidence->uid();
     const Incidence::IncidenceType type = incidence->type();
-    if (!mIncidences[type].contains(uid, incidence)) {
-        mIncidences[type].insert(uid, incidence);
+    if (insertInstance(mIncidences[type], incidence)) {
         mIncidencesByIdentifier.insert(incidence->instanceIdentifier(), incidence);
-        const KDateTime dt = incidence->dateTime(Incidence::RoleCalendarHashing);
-        if (dt.isValid()) {
-            mIncidencesForDate[type].insert(dt.date().toString(), incidence);
+        if (!q->batchAdding()) {
+            indexIncidence(incidence);
+        } else if (!mBatchIds.contains(reinterpret_cast<quintptr>(incidence.data()))) {
+            mBatchIds.insert(reinterpret_cast<quintptr>(incidence.data()));
+            mBatchIncidences.append(incidence);
         }
 
     } else {
 #ifndef NDEBUG
         // if we already have an to-do with this UID, it must be the same incidence,
         // otherwise something's really broken
-        Q_ASSERT(mIncidences[type].value(uid) == incidence);
+        Q_ASSERT(findInstance(mIncidences[type], incidence->uid(), incidence->recurrenceId()) == incidence);
 #endif
     }
 }
+
+void MemoryCalendar::Private::indexIncidence(const Incidence::Ptr &incidence)
+{
+    // Remove any stale entry first, the incidence may have changed between
+    // recurring and non-recurring since it was indexed.
+    unindexIncidence(incidence);
+
+    const quintptr id = reinterpret_cast<quintptr>(incidence.data());
+    const KDateTime dt = incidence->dateTime(Incidence::RoleCalendarHashing);
+    if (dt.isValid()) {
+        const qint64 day = dt.date().toJulianDay();
+        mIncidencesForDate[incidence->type()].insert(day, incidence);
+        mDateKeys.insert(id, day);
+    }
+
+    if (incidence->recurs()) {
+        qint64 first, last;
+        recurrenceBounds(incidence, first, last);
+        mRecurringIncidences[incidence->type()].insert(first, last, id, incidence);
+        return;
+    }
+
+    if (incidence->type() != Incidence::TypeEvent) {
+        return;
+    }
+
+    const Event::Ptr event = incidence.staticCast<Event>();
+    const KDateTime start = event->dtStart();
+    const KDateTime end = event->dtEnd();
+    if (!start.isValid() || !end.isValid()) {
+        mUnindexedEvents.insert(id, incidence);
+        return;
+    }
+
+    // Date-only values cover their whole date
+    qint64 endSecs = utcSeconds(end);
+    if (end.isDateOnly()) {
+        endSecs += secondsPerDay - 1;
+    }
+    mEventsByInterval.insert(utcSeconds(start), endSecs, id, incidence);
+}
+
+void MemoryCalendar::Private::unindexIncidence(const Incidence::Ptr &incidence)
+{
+    const quintptr id = reinterpret_cast<quintptr>(incidence.data());
+    QHash<quintptr, qint64>::iterator key = mDateKeys.find(id);
+    if (key != mDateKeys.end()) {
+        mIncidencesForDate[incidence->type()].remove(key.value(), incidence);
+        mDateKeys.erase(key);
+    }
+
+    if (!mRecurringIncidences[incidence->type()].remove(id) &&
+        !mEventsByInterval.remove(id)) {
+        mUnindexedEvents.remove(id);
+    }
+}
+
+void MemoryCalendar::Private::finishBatchAdding()
+{
+    Incidence::List added;
+    added.reserve(mBatchIncidences.count());
+    mDateKeys.reserve(mDateKeys.count() + mBatchIncidences.count());
+    mEventsByInterval.reserve(mEventsByInterval.count() + mBatchIncidences.count());
+
+    for (auto it = mBatchIncidences.constBegin(); it != mBatchIncidences.constEnd(); ++it) {
+        const Incidence::Ptr &incidence = *it;
+        // Skip the ones deleted while batch adding
+        if (!isStored(incidence)) {
+            continue;
+        }
+        indexIncidence(incidence);
+        added.append(incidence);
+    }
+    mBatchIncidences = Incidence::List();
+    mBatchIds.clear();
+
+    for (auto it = added.constBegin(); it != added.constEnd(); ++it) {
+        q->setupRelations(*it);
+    }
+
+    q->notifyIncidencesAdded(added);
+    if (!added.isEmpty()) {
+        q->setModified(true);
+    }
+}
+
+void MemoryCalendar::Private::finishUpdate()
+{
+    const Incidence::Ptr inc = mIncidencePtrBeingUpdated;
+    // The uid or recurrence id may have changed, so file it under the current ones.
+    // If it can't be found it was deleted in the meantime.
+    if (inc && removeInstance(mIncidences[inc->type()], mUidBeingUpdated, inc)) {
+        insertInstance(mIncidences[inc->type()], inc);
+
+        if (inc->instanceIdentifier() != mIncidenceBeingUpdated) {
+            // Instance identifier changed, update our hash table
+            mIncidencesByIdentifier.remove(mIncidenceBeingUpdated);
+            mIncidencesByIdentifier.insert(inc->instanceIdentifier(), inc);
+        }
+        indexIncidence(inc);
+    }
+
+    mIncidenceBeingUpdated = QString();
+    mUidBeingUpdated = QString();
+    mIncidencePtrBeingUpdated.clear();
+}
+
+MemoryCalendar::Private::RecurrenceIdKey
+MemoryCalendar::Private::recurrenceIdKey(const KDateTime &recurrenceId)
+{
+    RecurrenceIdKey key;
+    if (recurrenceId.isValid()) {
+        key.seconds = utcSeconds(recurrenceId);
+        key.dateOnly = recurrenceId.isDateOnly();
+    } else {
+        key.seconds = std::numeric_limits<qint64>::min();
+        key.dateOnly = false;
+    }
+    return key;
+}
+
+bool MemoryCalendar::Private::insertInstance(IncidencesByUid &incidences,
+        const Incidence::Ptr &incidence)
+{
+    Instances &instances = incidences[incidence->uid()];
+    const RecurrenceIdKey key = recurrenceIdKey(incidence->recurrenceId());
+    if (instances.contains(key, incidence)) {
+        return false;
+    }
+    instances.insert(key, incidence);
+    return true;
+}
+
+bool MemoryCalendar::Private::removeInstance(IncidencesByUid &incidences, const QString &uid,
+        const Incidence::Ptr &incidence)
+{
+    IncidencesByUid::iterator it = incidences.find(uid);
+    if (it == incidences.end()) {
+        return false;
+    }
+
+    Instances &instances = it.value();
+    bool removed = instances.remove(recurrenceIdKey(incidence->recurrenceId()), incidence) > 0;
+    if (!removed) {
+        // The recurrence id changed since it was inserted
+        for (Instances::iterator i = instances.begin(); i != instances.end(); ++i) {
+            if (i.value() == incidence) {
+                instances.erase(i);
+                removed = true;
+                break;
+            }
+        }
+    }
+    if (instances.isEmpty()) {
+        incidences.erase(it);
+    }
+    return removed;
+}
+
+Incidence::Ptr MemoryCalendar::Private::findInstance(const IncidencesByUid &incidences,
+        const QString &uid,
+        const KDateTime &recurrenceId)
+{
+    if (!recurrenceId.isNull() && !recurrenceId.isValid()) {
+        return Incidence::Ptr();
+    }
+    IncidencesByUid::const_iterator it = incidences.constFind(uid);
+    if (it == incidences.constEnd()) {
+        return Incidence::Ptr();
+    }
+    return it.value().value(recurrenceIdKey(recurrenceId));
+}
+
+template <typename T>
+QVector<QSharedPointer<T> > MemoryCalendar::Private::exceptions(const IncidencesByUid &incidences,
+        const QString &uid)
+{
+    QVector<QSharedPointer<T> > list;
+    IncidencesByUid::const_iterator it = incidences.constFind(uid);
+    if (it != incidences.constEnd()) {
+        for (Instances::const_iterator i = it.value().constBegin(), end = it.value().constEnd(); i != end; ++i) {
+            if (i.value()->hasRecurrenceId()) {
+                list.append(i.value().template staticCast<T>());
+            }
+        }
+    }
+    return list;
+}
+
+template <typename T>
+QVector<QSharedPointer<T> > MemoryCalendar::Private::values(const IncidencesByUid &incidences)
+{
+    QVector<QSharedPointer<T> > list;
+    list.reserve(incidences.count());
+    for (IncidencesByUid::const_iterator it = incidences.constBegin(), end = incidences.constEnd(); it != end; ++it) {
+        for (Instances::const_iterator i = it.value().constBegin(), iend = it.value().constEnd(); i != iend; ++i) {
+            list.append(i.value().template staticCast<T>());
+        }
+    }
+    return list;
+}
 //@endcond
 
 bool MemoryCalendar::addIncidence(const Incidence::Ptr &incidence)
 {
+    if (d->mSnapshot) {
+        qCWarning(KCALCORE_LOG) << "Cannot add to a calendar snapshot";
+        return false;
+    }
+
     d->insertIncidence(incidence);
 
+    if (batchAdding()) {
+        // Indexing, relations and notifications are done by endBatchAdding()
+        incidence->registerObserver(this);
+        return true;
+    }
+
     notifyIncidenceAdded(incidence);
 
     incidence->registerObserver(this);
@@ -309,6 +734,20 @@ bool MemoryCalendar::addIncidence(const Incidence::Ptr &incidence)
     return true;
 }
 
+void MemoryCalendar::startBatchAdding()
+{
+    Calendar::startBatchAdding();
+}
+
+void MemoryCalendar::endBatchAdding()
+{
+    if (!batchAdding()) {
+        return;
+    }
+    Calendar::endBatchAdding();
+    d->finishBatchAdding();
+}
+
 bool MemoryCalendar::addEvent(const Event::Ptr &event)
 {
     return addIncidence(event);
@@ -365,13 +804,8 @@ Todo::Ptr MemoryCalendar::deletedTodo(const QString &uid,
 Todo::List MemoryCalendar::rawTodos(TodoSortField sortField,
                                     SortDirection sortDirection) const
 {
-    Todo::List todoList;
-    todoList.reserve(d->mIncidences[Incidence::TypeTodo].count());
-    QHashIterator<QString, Incidence::Ptr>i(d->mIncidences[Incidence::TypeTodo]);
-    while (i.hasNext()) {
-        i.next();
-        todoList.append(i.value().staticCast<Todo>());
-    }
+    const Todo::List todoList = Private::values<Todo>(
+        Private::constValue(d->mIncidences, Incidence::TypeTodo));
     return Calendar::sortTodos(todoList, sortField, sortDirection);
 }
 
@@ -382,13 +816,8 @@ Todo::List MemoryCalendar::deletedTodos(TodoSortField sortField,
         return Todo::List();
     }
 
-    Todo::List todoList;
-    todoList.reserve(d->mDeletedIncidences[Incidence::TypeTodo].count());
-    QHashIterator<QString, Incidence::Ptr >i(d->mDeletedIncidences[Incidence::TypeTodo]);
-    while (i.hasNext()) {
-        i.next();
-        todoList.append(i.value().staticCast<Todo>());
-    }
+    const Todo::List todoList = Private::values<Todo>(
+        Private::constValue(d->mDeletedIncidences, Incidence::TypeTodo));
     return Calendar::sortTodos(todoList, sortField, sortDirection);
 }
 
@@ -396,15 +825,8 @@ Todo::List MemoryCalendar::todoInstances(const Incidence::Ptr &todo,
         TodoSortField sortField,
         SortDirection sortDirection) const
 {
-    Todo::List list;
-
-    Incidence::List values = ::values(d->mIncidences[Incidence::TypeTodo], todo->uid());
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
-        Todo::Ptr t = (*it).staticCast<Todo>();
-        if (t->hasRecurrenceId()) {
-            list.append(t);
-        }
-    }
+    const Todo::List list = Private::exceptions<Todo>(
+        Private::constValue(d->mIncidences, Incidence::TypeTodo), todo->uid());
     return Calendar::sortTodos(list, sortField, sortDirection);
 }
 
@@ -414,24 +836,23 @@ Todo::List MemoryCalendar::rawTodosForDate(const QDate &date) const
     Todo::Ptr t;
 
     KDateTime::Spec ts = timeSpec();
-    const QString dateStr = date.toString();
-    QMultiHash<QString, IncidenceBase::Ptr >::const_iterator it =
-        d->mIncidencesForDate[Incidence::TypeTodo].constFind(dateStr);
-    while (it != d->mIncidencesForDate[Incidence::TypeTodo].constEnd() && it.key() == dateStr) {
+    const qint64 day = date.toJulianDay();
+    const QMultiMap<qint64, Incidence::Ptr> &forDate =
+        Private::constValue(d->mIncidencesForDate, Incidence::TypeTodo);
+    QMultiMap<qint64, Incidence::Ptr>::const_iterator it = forDate.constFind(day);
+    while (it != forDate.constEnd() && it.key() == day) {
         t = it.value().staticCast<Todo>();
         todoList.append(t);
         ++it;
     }
 
-    // Iterate over all todos. Look for recurring todoss that occur on this date
-    QHashIterator<QString, Incidence::Ptr >i(d->mIncidences[Incidence::TypeTodo]);
-    while (i.hasNext()) {
-        i.next();
-        t = i.value().staticCast<Todo>();
-        if (t->recurs()) {
-            if (t->recursOn(date, ts)) {
-                todoList.append(t);
-            }
+    // Look for recurring todos that occur on this date
+    const Incidence::List recurring =
+        Private::constValue(d->mRecurringIncidences, Incidence::TypeTodo).overlapping(day, day);
+    for (auto it = recurring.constBegin(), end = recurring.constEnd(); it != end; ++it) {
+        t = (*it).staticCast<Todo>();
+        if (t->recursOn(date, ts)) {
+            todoList.append(t);
         }
     }
 
@@ -451,11 +872,11 @@ Todo::List MemoryCalendar::rawTodos(const QDate &start,
     KDateTime nd(end, ts);
 
     // Get todos
-    QHashIterator<QString, Incidence::Ptr >i(d->mIncidences[Incidence::TypeTodo]);
+    const Todo::List todos = Private::values<Todo>(
+        Private::constValue(d->mIncidences, Incidence::TypeTodo));
     Todo::Ptr todo;
-    while (i.hasNext()) {
-        i.next();
-        todo = i.value().staticCast<Todo>();
+    for (auto it = todos.constBegin(); it != todos.constEnd(); ++it) {
+        todo = *it;
         if (!isVisible(todo)) {
             continue;
         }
@@ -505,11 +926,11 @@ Alarm::List MemoryCalendar::alarms(const KDateTime &from, const KDateTime &to, b
 {
     Q_UNUSED(excludeBlockedAlarms);
     Alarm::List alarmList;
-    QHashIterator<QString, Incidence::Ptr>ie(d->mIncidences[Incidence::TypeEvent]);
+    const Event::List events = Private::values<Event>(
+        Private::constValue(d->mIncidences, Incidence::TypeEvent));
     Event::Ptr e;
-    while (ie.hasNext()) {
-        ie.next();
-        e = ie.value().staticCast<Event>();
+    for (auto ie = events.constBegin(); ie != events.constEnd(); ++ie) {
+        e = *ie;
         if (e->recurs()) {
             appendRecurringAlarms(alarmList, e, from, to);
         } else {
@@ -517,11 +938,11 @@ Alarm::List MemoryCalendar::alarms(const KDateTime &from, const KDateTime &to, b
         }
     }
 
-    QHashIterator<QString, Incidence::Ptr>it(d->mIncidences[Incidence::TypeTodo]);
+    const Todo::List todos = Private::values<Todo>(
+        Private::constValue(d->mIncidences, Incidence::TypeTodo));
     Todo::Ptr t;
-    while (it.hasNext()) {
-        it.next();
-        t = it.value().staticCast<Todo>();
+    for (auto it = todos.constBegin(); it != todos.constEnd(); ++it) {
+        t = *it;
 
         if (!t->isCompleted()) {
             appendAlarms(alarmList, t, from, to);
@@ -543,44 +964,43 @@ void MemoryCalendar::incidenceUpdate(const QString &uid, const KDateTime &recurr
     if (inc) {
         if (!d->mIncidenceBeingUpdated.isEmpty()) {
             qCWarning(KCALCORE_LOG) << "Incidence::update() called twice without an updated() call in between.";
+            // Don't lose track of the first one
+            d->finishUpdate();
         }
 
         // Save it so we can detect changes to uid or recurringId.
         d->mIncidenceBeingUpdated = inc->instanceIdentifier();
+        d->mUidBeingUpdated = inc->uid();
+        d->mIncidencePtrBeingUpdated = inc;
 
-        const KDateTime dt = inc->dateTime(Incidence::RoleCalendarHashing);
-        if (dt.isValid()) {
-            const Incidence::IncidenceType type = inc->type();
-            d->mIncidencesForDate[type].remove(dt.date().toString(), inc);
-        }
+        d->unindexIncidence(inc);
     }
 }
 
 void MemoryCalendar::incidenceUpdated(const QString &uid, const KDateTime &recurrenceId)
 {
     Incidence::Ptr inc = incidence(uid, recurrenceId);
+    const Incidence::Ptr beingUpdated = d->mIncidencePtrBeingUpdated;
+    if (!inc && beingUpdated &&
+        beingUpdated->uid() == uid && beingUpdated->recurrenceId() == recurrenceId) {
+        // Its uid or recurrence id changed, so it's still filed under the old ones
+        inc = beingUpdated;
+    }
 
     if (inc) {
 
         if (d->mIncidenceBeingUpdated.isEmpty()) {
             qCWarning(KCALCORE_LOG) << "Incidence::updated() called twice without an update() call in between.";
-        } else if (inc->instanceIdentifier() != d->mIncidenceBeingUpdated) {
-            // Instance identifier changed, update our hash table
-            d->mIncidencesByIdentifier.remove(d->mIncidenceBeingUpdated);
-            d->mIncidencesByIdentifier.insert(inc->instanceIdentifier(), inc);
         }
-
-        d->mIncidenceBeingUpdated = QString();
+        d->finishUpdate();
 
         inc->setLastModified(KDateTime::currentUtcDateTime());
         // we should probably update the revision number here,
         // or internally in the Event itself when certain things change.
         // need to verify with ical documentation.
 
-        const KDateTime dt = inc->dateTime(Incidence::RoleCalendarHashing);
-        if (dt.isValid()) {
-            const Incidence::IncidenceType type = inc->type();
-            d->mIncidencesForDate[type].insert(dt.date().toString(), inc);
+        if (inc != beingUpdated) {
+            d->indexIncidence(inc);
         }
 
         notifyIncidenceChanged(inc);
@@ -603,14 +1023,15 @@ Event::List MemoryCalendar::rawEventsForDate(const QDate &date,
 
     Event::Ptr ev;
 
-    // Find the hash for the specified date
-    const QString dateStr = date.toString();
-    QMultiHash<QString, IncidenceBase::Ptr >::const_iterator it =
-        d->mIncidencesForDate[Incidence::TypeEvent].constFind(dateStr);
+    // Find the events for the specified date
+    const qint64 day = date.toJulianDay();
+    const QMultiMap<qint64, Incidence::Ptr> &forDate =
+        Private::constValue(d->mIncidencesForDate, Incidence::TypeEvent);
+    QMultiMap<qint64, Incidence::Ptr>::const_iterator it = forDate.constFind(day);
     // Iterate over all non-recurring, single-day events that start on this date
     KDateTime::Spec ts = timespec.isValid() ? timespec : timeSpec();
     KDateTime kdt(date, ts);
-    while (it != d->mIncidencesForDate[Incidence::TypeEvent].constEnd() && it.key() == dateStr) {
+    while (it != forDate.constEnd() && it.key() == day) {
         ev = it.value().staticCast<Event>();
         KDateTime end(ev->dtEnd().toTimeSpec(ev->dtStart()));
         if (ev->allDay()) {
@@ -624,30 +1045,32 @@ Event::List MemoryCalendar::rawEventsForDate(const QDate &date,
         ++it;
     }
 
-    // Iterate over all events. Look for recurring events that occur on this date
-    QHashIterator<QString, Incidence::Ptr>i(d->mIncidences[Incidence::TypeEvent]);
-    while (i.hasNext()) {
-        i.next();
-        ev = i.value().staticCast<Event>();
-        if (ev->recurs()) {
-            if (ev->isMultiDay()) {
-                int extraDays = ev->dtStart().date().daysTo(ev->dtEnd().date());
-                for (int i = 0; i <= extraDays; ++i) {
-                    if (ev->recursOn(date.addDays(-i), ts)) {
-                        eventList.append(ev);
-                        break;
-                    }
-                }
-            } else {
-                if (ev->recursOn(date, ts)) {
-                    eventList.append(ev);
-                }
+    // Look for recurring events that occur on this date
+    const Incidence::List recurring =
+        Private::constValue(d->mRecurringIncidences, Incidence::TypeEvent).overlapping(day, day);
+    for (auto it = recurring.constBegin(), end = recurring.constEnd(); it != end; ++it) {
+        ev = (*it).staticCast<Event>();
+        if (ev->isMultiDay()) {
+            int extraDays = ev->dtStart().date().daysTo(ev->dtEnd().date());
+            if (ev->recurrence()->recursOnRange(date.addDays(-extraDays), date, ts).count(true) > 0) {
+                eventList.append(ev);
             }
         } else {
-            if (ev->isMultiDay()) {
-                if (ev->dtStart().date() <= date && ev->dtEnd().date() >= date) {
-                    eventList.append(ev);
-                }
+            if (ev->recursOn(date, ts)) {
+                eventList.append(ev);
+            }
+        }
+    }
+
+    // Look for non-recurring multi-day events spanning this date
+    const Incidence::List spanning =
+        d->mEventsByInterval.overlapping(day * secondsPerDay - secondsPerDay,
+                                         (day + 2) * secondsPerDay);
+    for (auto it = spanning.constBegin(), end = spanning.constEnd(); it != end; ++it) {
+        ev = (*it).staticCast<Event>();
+        if (ev->isMultiDay()) {
+            if (ev->dtStart().date() <= date && ev->dtEnd().date() >= date) {
+                eventList.append(ev);
             }
         }
     }
@@ -664,14 +1087,23 @@ Event::List MemoryCalendar::rawEvents(const QDate &start,
     KDateTime::Spec ts = timespec.isValid() ? timespec : timeSpec();
     KDateTime st(start, ts);
     KDateTime nd(end, ts);
-    KDateTime yesterStart = st.addDays(-1);
 
-    // Get non-recurring events
-    QHashIterator<QString, Incidence::Ptr>i(d->mIncidences[Incidence::TypeEvent]);
+    // The interval tree works in UTC, so widen the query by a day on each side to
+    // cover any time zone offset and the whole of the end date; the exact checks
+    // below are done on each candidate.
+    Incidence::List candidates =
+        d->mEventsByInterval.overlapping(utcSeconds(st) - secondsPerDay,
+                                         utcSeconds(nd) + 2 * secondsPerDay);
+    candidates += Private::constValue(d->mRecurringIncidences, Incidence::TypeEvent)
+                  .overlapping(start.toJulianDay(), end.toJulianDay());
+    candidates.reserve(candidates.count() + d->mUnindexedEvents.count());
+    for (auto it = d->mUnindexedEvents.constBegin(), e = d->mUnindexedEvents.constEnd(); it != e; ++it) {
+        candidates.append(it.value());
+    }
+
     Event::Ptr event;
-    while (i.hasNext()) {
-        i.next();
-        event = i.value().staticCast<Event>();
+    for (auto it = candidates.constBegin(), e = candidates.constEnd(); it != e; ++it) {
+        event = (*it).staticCast<Event>();
         KDateTime rStart = event->dtStart();
         if (nd < rStart) {
             continue;
@@ -725,13 +1157,8 @@ Event::List MemoryCalendar::rawEventsForDate(const KDateTime &kdt) const
 Event::List MemoryCalendar::rawEvents(EventSortField sortField,
                                       SortDirection sortDirection) const
 {
-    Event::List eventList;
-    eventList.reserve(d->mIncidences[Incidence::TypeEvent].count());
-    QHashIterator<QString, Incidence::Ptr> i(d->mIncidences[Incidence::TypeEvent]);
-    while (i.hasNext()) {
-        i.next();
-        eventList.append(i.value().staticCast<Event>());
-    }
+    const Event::List eventList = Private::values<Event>(
+        Private::constValue(d->mIncidences, Incidence::TypeEvent));
     return Calendar::sortEvents(eventList, sortField, sortDirection);
 }
 
@@ -742,13 +1169,8 @@ Event::List MemoryCalendar::deletedEvents(EventSortField sortField,
         return Event::List();
     }
 
-    Event::List eventList;
-    eventList.reserve(d->mDeletedIncidences[Incidence::TypeEvent].count());
-    QHashIterator<QString, Incidence::Ptr>i(d->mDeletedIncidences[Incidence::TypeEvent]);
-    while (i.hasNext()) {
-        i.next();
-        eventList.append(i.value().staticCast<Event>());
-    }
+    const Event::List eventList = Private::values<Event>(
+        Private::constValue(d->mDeletedIncidences, Incidence::TypeEvent));
     return Calendar::sortEvents(eventList, sortField, sortDirection);
 }
 
@@ -756,15 +1178,8 @@ Event::List MemoryCalendar::eventInstances(const Incidence::Ptr &event,
         EventSortField sortField,
         SortDirection sortDirection) const
 {
-    Event::List list;
-
-    Incidence::List values = ::values(d->mIncidences[Incidence::TypeEvent], event->uid());
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
-        Event::Ptr ev = (*it).staticCast<Event>();
-        if (ev->hasRecurrenceId()) {
-            list.append(ev);
-        }
-    }
+    const Event::List list = Private::exceptions<Event>(
+        Private::constValue(d->mIncidences, Incidence::TypeEvent), event->uid());
     return Calendar::sortEvents(list, sortField, sortDirection);
 }
 
@@ -798,12 +1213,8 @@ Journal::Ptr MemoryCalendar::deletedJournal(const QString &uid,
 Journal::List MemoryCalendar::rawJournals(JournalSortField sortField,
         SortDirection sortDirection) const
 {
-    Journal::List journalList;
-    QHashIterator<QString, Incidence::Ptr>i(d->mIncidences[Incidence::TypeJournal]);
-    while (i.hasNext()) {
-        i.next();
-        journalList.append(i.value().staticCast<Journal>());
-    }
+    const Journal::List journalList = Private::values<Journal>(
+        Private::constValue(d->mIncidences, Incidence::TypeJournal));
     return Calendar::sortJournals(journalList, sortField, sortDirection);
 }
 
@@ -814,13 +1225,8 @@ Journal::List MemoryCalendar::deletedJournals(JournalSortField sortField,
         return Journal::List();
     }
 
-    Journal::List journalList;
-    journalList.reserve(d->mDeletedIncidences[Incidence::TypeJournal].count());
-    QHashIterator<QString, Incidence::Ptr>i(d->mDeletedIncidences[Incidence::TypeJournal]);
-    while (i.hasNext()) {
-        i.next();
-        journalList.append(i.value().staticCast<Journal>());
-    }
+    const Journal::List journalList = Private::values<Journal>(
+        Private::constValue(d->mDeletedIncidences, Incidence::TypeJournal));
     return Calendar::sortJournals(journalList, sortField, sortDirection);
 }
 
@@ -828,15 +1234,8 @@ Journal::List MemoryCalendar::journalInstances(const Incidence::Ptr &journal,
         JournalSortField sortField,
         SortDirection sortDirection) const
 {
-    Journal::List list;
-
-    Incidence::List values = ::values(d->mIncidences[Incidence::TypeJournal], journal->uid());
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
-        Journal::Ptr j = (*it).staticCast<Journal>();
-        if (j->hasRecurrenceId()) {
-            list.append(j);
-        }
-    }
+    const Journal::List list = Private::exceptions<Journal>(
+        Private::constValue(d->mIncidences, Incidence::TypeJournal), journal->uid());
     return Calendar::sortJournals(list, sortField, sortDirection);
 }
 
@@ -845,11 +1244,12 @@ Journal::List MemoryCalendar::rawJournalsForDate(const QDate &date) const
     Journal::List journalList;
     Journal::Ptr j;
 
-    QString dateStr = date.toString();
-    QMultiHash<QString, IncidenceBase::Ptr >::const_iterator it =
-        d->mIncidencesForDate[Incidence::TypeJournal].constFind(dateStr);
+    const qint64 day = date.toJulianDay();
+    const QMultiMap<qint64, Incidence::Ptr> &forDate =
+        Private::constValue(d->mIncidencesForDate, Incidence::TypeJournal);
+    QMultiMap<qint64, Incidence::Ptr>::const_iterator it = forDate.constFind(day);
 
-    while (it != d->mIncidencesForDate[Incidence::TypeJournal].constEnd() && it.key() == dateStr) {
+    while (it != forDate.constEnd() && it.key() == day) {
         j = it.value().staticCast<Journal>();
         journalList.append(j);
         ++it;
@@ -862,9 +1262,21 @@ Incidence::Ptr MemoryCalendar::instance(const QString &identifier) const
     return d->mIncidencesByIdentifier.value(identifier);
 }
 
+Incidence::List MemoryCalendar::instances(const Incidence::Ptr &incidence) const
+{
+    if (!incidence) {
+        return Incidence::List();
+    }
+    return Private::exceptions<Incidence>(d->mIncidences.value(incidence->type()), incidence->uid());
+}
+
 void MemoryCalendar::virtual_hook(int id, void *data)
 {
-    Q_UNUSED(id);
-    Q_UNUSED(data);
-    Q_ASSERT(false);
+    switch (id) {
+    case SnapshotHook:
+        *static_cast<MemoryCalendar::Ptr *>(data) = d->snapshot();
+        break;
+    default:
+        Q_ASSERT(false);
+    }
 }
@@ -74,6 +74,40 @@ public:
     */
     void close() Q_DECL_OVERRIDE;
 
+    /**
+      Returns a read-only copy of the calendar in its current state.
+
+      Making a snapshot takes constant time: the incidence indexes are
+      implicitly shared with this calendar, and only copied once this calendar
+      modifies them. The snapshot can therefore be exported or iterated over,
+      even from another thread, while this calendar goes on being modified.
+
+      The cost is deferred rather than avoided: while a snapshot is alive, the
+      first change to this calendar copies each index it touches, which takes
+      a time proportional to the number of incidences on the writing thread.
+      Snapshots are therefore best released once they are no longer needed,
+      and not taken between every two changes. Closing or destroying a
+      snapshot only releases its references, without notifying anybody.
+
+      The incidences themselves are shared too, so changes made to an
+      incidence in place show in the snapshot. Writers wanting to keep existing
+      snapshots unchanged should replace an incidence by a modified clone
+      instead. The relations between incidences and the notebook associations
+      are not part of the snapshot.
+
+      Adding incidences to or deleting incidences from the snapshot fails.
+
+      @see isSnapshot()
+      @since 5.15
+    */
+    MemoryCalendar::Ptr snapshot() const;
+
+    /**
+      Returns true if this calendar was made by snapshot(), and so can't be modified.
+      @since 5.15
+    */
+    bool isSnapshot() const;
+
     /**
       @copydoc Calendar::deleteIncidence()
     */
@@ -84,11 +118,34 @@ public:
     */
     bool deleteIncidenceInstances(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
 
+    /**
+      @copydoc Calendar::instances()
+
+      The exceptions are taken from the uid index, and are returned sorted
+      by recurrence id.
+      @since 5.15
+    */
+    Incidence::List instances(const Incidence::Ptr &incidence) const Q_DECL_OVERRIDE;
+
     /**
        @copydoc Calendar::addIncidence()
     */
     bool addIncidence(const Incidence::Ptr &incidence) Q_DECL_OVERRIDE;
 
+    /**
+      @copydoc Calendar::startBatchAdding()
+
+      While batch adding, incidences are only indexed by uid and recurrence id.
+      The other indexes and the relations are built for all of them at once
+      by endBatchAdding().
+    */
+    void startBatchAdding() Q_DECL_OVERRIDE;
+
+    /**
+      @copydoc Calendar::endBatchAdding()
+    */
+    void endBatchAdding() Q_DECL_OVERRIDE;
+
     // Event Specific Methods //
 
     /**
@@ -322,6 +379,14 @@ public:
     using QObject::event;   // prevent warning about hidden virtual method
 
 protected:
+    /**
+      The ids of the virtual_hook() calls of MemoryCalendar.
+      @since 5.15
+    */
+    enum MemoryCalendarHook {
+        SnapshotHook    /**< data points to a MemoryCalendar::Ptr, set to a snapshot */
+    };
+
     /**
       @copydoc IncidenceBase::virtual_hook()
     */
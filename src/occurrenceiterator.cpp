@@ -32,9 +32,13 @@
 #include "occurrenceiterator.h"
 #include "calendar.h"
 #include "calfilter.h"
+#include "occurrencewalker_p.h"
 
 #include <QDate>
 
+#include <algorithm>
+#include <limits>
+
 using namespace KCalCore;
 
 /**
@@ -47,13 +51,14 @@ class Q_DECL_HIDDEN KCalCore::OccurrenceIterator::Private
 public:
     Private(OccurrenceIterator *qq)
         : q(qq),
-          occurrenceIt(occurrenceList)
+          hideCompletedTodos(false)
     {
     }
 
     OccurrenceIterator *q;
     KDateTime start;
     KDateTime end;
+    bool hideCompletedTodos;
 
     struct Occurrence {
         Occurrence()
@@ -69,10 +74,76 @@ public:
         KDateTime recurrenceId;
         KDateTime startDate;
     };
-    QList<Occurrence> occurrenceList;
-    QListIterator<Occurrence> occurrenceIt;
     Occurrence current;
 
+    /*
+     * Generates the occurrences of a recurring incidence, in chronological order,
+     * from the start of the recurrence or one of its thisAndFuture exceptions up
+     * to the next thisAndFuture exception. The occurrence times are computed one
+     * window at a time, so only a few of them are held at once.
+     */
+    struct Generator {
+        Incidence::Ptr recurring;       // incidence owning the recurrence
+        Incidence::Ptr incidence;       // incidence of the occurrences
+        qint64 offset;                  // from recurrence id to occurrence start
+        KDateTime first;                // first recurrence id, if not the start of the recurrence
+        KDateTime before;               // recurrence id of the next thisAndFuture exception
+        QVector<qint64> exceptions;     // sorted keys of the recurrence ids generated elsewhere
+        int nextException;              // first exception not before the last recurrence id
+        bool allDay;
+        bool hideBeforeDue;             // hide the occurrences of a completed to-do
+
+        KDateTime windowStart;          // start of the next window to fetch
+        KDateTime limit;                // end of the last window
+        qint64 windowSecs;
+        bool finished;                  // no more windows to fetch
+        DateTimeList times;
+        int index;
+        KDateTime last;                 // last recurrence id seen
+    };
+    QVector<Generator> generators;
+
+    /*
+     * The next occurrence of each generator, and the occurrences which don't come
+     * from a generator (non-recurring incidences and moved exceptions), kept as a
+     * min-heap on the start date.
+     */
+    struct HeapEntry {
+        qint64 key;         // start of the occurrence, in seconds since the epoch
+        int order;          // position of the incidence, to keep ties stable
+        int generator;      // index in generators, or -1
+        Occurrence occurrence;
+    };
+    QVector<HeapEntry> heap;
+
+    static bool heapGreater(const HeapEntry &e1, const HeapEntry &e2)
+    {
+        return e1.key > e2.key || (e1.key == e2.key && e1.order > e2.order);
+    }
+
+    static qint64 sortKey(const KDateTime &dt)
+    {
+        if (!dt.isValid()) {
+            return std::numeric_limits<qint64>::min();
+        }
+        KDateTime utc = dt;
+        // Date-only values sort at the start of their date
+        utc.setDateOnly(false);
+        utc = utc.toUtc();
+        return (utc.date().toJulianDay() - Q_INT64_C(2440588)) * 86400 + QTime(0, 0).secsTo(utc.time());
+    }
+
+    void push(const Occurrence &occurrence, int order, int generator)
+    {
+        HeapEntry entry;
+        entry.key = sortKey(occurrence.startDate);
+        entry.order = order;
+        entry.generator = generator;
+        entry.occurrence = occurrence;
+        heap.append(entry);
+        std::push_heap(heap.begin(), heap.end(), heapGreater);
+    }
+
     /*
      * KCalCore::CalFilter can't handle individual occurrences.
      * When filtering completed to-dos, the CalFilter doesn't hide
@@ -82,9 +153,7 @@ public:
                             const Incidence::Ptr &inc,
                             const KDateTime &occurrenceDate)
     {
-        if ((inc->type() == Incidence::TypeTodo) &&
-                calendar.filter() &&
-                (calendar.filter()->criteria() & KCalCore::CalFilter::HideCompletedTodos)) {
+        if (hideCompletedTodos && inc->type() == Incidence::TypeTodo) {
             if (inc->recurs()) {
                 const Todo::Ptr todo = inc.staticCast<Todo>();
                 if (todo && (occurrenceDate < todo->dtDue())) {
@@ -100,84 +169,239 @@ public:
         return false;
     }
 
+    // Fetches the next window of occurrence times. An invalid last entry
+    // marks a list which stops early: the window then ends at the last valid
+    // time, and the next one starts right after it.
+    bool fetch(Generator &g)
+    {
+        while (!g.finished) {
+            KDateTime windowEnd;
+            if (!g.windowStart.isValid() || !g.limit.isValid() || g.windowSecs <= 0) {
+                // Unbounded range, everything is fetched at once
+                g.times = g.recurring->recurrence()->timesInInterval(g.windowStart, g.limit);
+                g.finished = true;
+            } else {
+                windowEnd = g.windowStart.addSecs(g.windowSecs - 1);
+                if (!(windowEnd < g.limit)) {
+                    windowEnd = g.limit;
+                    g.finished = true;
+                }
+                g.times = g.recurring->recurrence()->timesInInterval(g.windowStart, windowEnd);
+                g.windowStart = windowEnd.addSecs(1);
+            }
+            if (!g.times.isEmpty() && !g.times.last().isValid()) {
+                g.times.removeLast();
+                if (!g.times.isEmpty()) {
+                    KDateTime last = g.times.last();
+                    last.setDateOnly(false);
+                    g.windowStart = last.addSecs(1);
+                    g.finished = false;
+                }
+            }
+            g.index = 0;
+            if (!g.times.isEmpty()) {
+                return true;
+            }
+            // Sparse recurrence, look further ahead next time
+            g.windowSecs *= 2;
+        }
+        return false;
+    }
+
+    bool nextOccurrence(Generator &g, Occurrence &occurrence)
+    {
+        forever {
+            if (g.index >= g.times.count() && !fetch(g)) {
+                return false;
+            }
+            KDateTime recurrenceId = g.times.at(g.index++);
+            //timesInInterval generates always date-times,
+            //which is not what we want for all-day events
+            recurrenceId.setDateOnly(g.allDay);
+
+            // Date-only times can be returned by two consecutive windows
+            if (g.last.isValid() && !(g.last < recurrenceId)) {
+                continue;
+            }
+            g.last = recurrenceId;
+
+            if (g.first.isValid() && recurrenceId < g.first) {
+                continue;
+            }
+            if (g.before.isValid() && !(recurrenceId < g.before)) {
+                g.finished = true;
+                g.times.clear();
+                return false;
+            }
+            // The recurrence ids and the exceptions are both sorted, so they
+            // are merged in a single pass
+            const qint64 key = sortKey(recurrenceId);
+            while (g.nextException < g.exceptions.count() && g.exceptions.at(g.nextException) < key) {
+                ++g.nextException;
+            }
+            if (g.nextException < g.exceptions.count() && g.exceptions.at(g.nextException) == key) {
+                continue;
+            }
+
+            KDateTime occurrenceStartDate = recurrenceId;
+            if (g.incidence != g.recurring) {   //thisAndFuture exception is active
+                occurrenceStartDate = occurrenceStartDate.addSecs(g.offset);
+            }
+            if (g.hideBeforeDue && occurrenceStartDate < g.incidence.staticCast<Todo>()->dtDue()) {
+                continue;
+            }
+            occurrence = Occurrence(g.incidence, recurrenceId, occurrenceStartDate);
+            return true;
+        }
+    }
+
+    // Returns whether @p inc has an occurrence with @p recurrenceId in the iterated range
+    bool occursAt(const Incidence::Ptr &inc, const KDateTime &recurrenceId, const KDateTime &from, const KDateTime &to)
+    {
+        KDateTime windowStart = from;
+        KDateTime windowEnd = to;
+        if (from.isValid() && to.isValid()) {
+            KDateTime dt = recurrenceId;
+            dt.setDateOnly(false);
+            if (windowStart < dt.addDays(-1)) {
+                windowStart = dt.addDays(-1);
+            }
+            if (dt.addDays(2) < windowEnd) {
+                windowEnd = dt.addDays(2);
+            }
+        }
+        DateTimeList times = inc->recurrence()->timesInInterval(windowStart, windowEnd);
+        for (int i = 0; i < times.count(); ++i) {
+            times[i].setDateOnly(inc->allDay());
+            if (times.at(i) == recurrenceId) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void addGenerator(const Calendar &calendar, Generator generator, int order)
+    {
+        if (hideCompletedTodos && generator.incidence->type() == Incidence::TypeTodo) {
+            if (generator.incidence->recurs()) {
+                generator.hideBeforeDue = true;
+            } else if (occurrenceIsHidden(calendar, generator.incidence, KDateTime())) {
+                return;
+            }
+        }
+        generators.append(generator);
+        Occurrence occurrence;
+        if (nextOccurrence(generators.last(), occurrence)) {
+            push(occurrence, order, generators.count() - 1);
+        }
+    }
+
     void setupIterator(const Calendar &calendar, const Incidence::List &incidences)
     {
+        hideCompletedTodos = calendar.filter() &&
+                             (calendar.filter()->criteria() & KCalCore::CalFilter::HideCompletedTodos);
+
+        // Windows are fetched as date-times, so that consecutive ones don't overlap
+        KDateTime from = start;
+        KDateTime to = end;
+        if (from.isValid() && from.isDateOnly()) {
+            from.setDateOnly(false);
+        }
+        if (to.isValid() && to.isDateOnly()) {
+            to = KDateTime(to.date(), QTime(23, 59, 59), to.timeSpec());
+        }
+
+        int order = 0;
         foreach (const Incidence::Ptr &inc, incidences) {
+            ++order;
             if (inc->hasRecurrenceId()) {
                 continue;
             }
-            if (inc->recurs()) {
-                QHash<KDateTime, Incidence::Ptr> recurrenceIds;
-                KDateTime incidenceRecStart = inc->dateTime(Incidence::RoleRecurrenceStart);
-                foreach (const Incidence::Ptr &exception, calendar.instances(inc)) {
-                    if (incidenceRecStart.isValid()) {
-                        recurrenceIds.insert(exception->recurrenceId().toTimeSpec(incidenceRecStart.timeSpec()), exception);
-                    }
+            if (!inc->recurs()) {
+                push(Occurrence(inc, KDateTime(), inc->dtStart()), order, -1);
+                continue;
+            }
+
+            Generator generator;
+            generator.recurring = inc;
+            generator.incidence = inc;
+            generator.offset = 0;
+            generator.allDay = inc->allDay();
+            generator.hideBeforeDue = false;
+            generator.windowStart = from;
+            generator.limit = to;
+            generator.finished = false;
+            generator.index = 0;
+            generator.nextException = 0;
+
+            const RecurrenceRule *rule = inc->recurrence()->defaultRRuleConst();
+            generator.windowSecs = OccurrenceWalker::windowSeconds(rule);
+
+            // Exceptions replacing a single occurrence are put into the heap by
+            // themselves, as they can be moved anywhere. ThisAndFuture exceptions
+            // start a new generator. MemoryCalendar returns the exceptions in
+            // recurrence id order, so they usually don't need sorting.
+            Incidence::List thisAndFuture;
+            const KDateTime incidenceRecStart = inc->dateTime(Incidence::RoleRecurrenceStart);
+            Incidence::List exceptions;
+            if (incidenceRecStart.isValid()) {
+                exceptions = calendar.instances(inc);
+            }
+            foreach (const Incidence::Ptr &exception, exceptions) {
+                const KDateTime recurrenceId =
+                    exception->recurrenceId().toTimeSpec(incidenceRecStart.timeSpec());
+                if (exception->thisAndFuture() && exception->status() != Incidence::StatusCanceled) {
+                    thisAndFuture.append(exception);
+                    continue;
                 }
-                const bool isAllDay = inc->allDay();
-                const DateTimeList occurrences = inc->recurrence()->timesInInterval(start, end);
-                Incidence::Ptr incidence(inc), lastInc(inc);
-                qint64 offset(0), lastOffset(0);
-                KDateTime occurrenceStartDate;
-                foreach(KDateTime recurrenceId, occurrences) {    //krazy:exclude=foreach
-                    //timesInInterval generates always date-times,
-                    //which is not what we want for all-day events
-                    recurrenceId.setDateOnly(isAllDay);
-                    occurrenceStartDate = recurrenceId;
-
-                    bool resetIncidence = false;
-                    if (recurrenceIds.contains(recurrenceId)) {
-                        // TODO: exclude exceptions where the start/end is not within
-                        // (so the occurrence of the recurrence is omitted, but no exception is added)
-                        if (recurrenceIds.value(recurrenceId)->status() == Incidence::StatusCanceled) {
-                            continue;
-                        }
-
-                        incidence = recurrenceIds.value(recurrenceId);
-                        occurrenceStartDate = incidence->dtStart();
-                        resetIncidence = !incidence->thisAndFuture();
-                        offset = incidence->recurrenceId().secsTo(incidence->dtStart());
-                        if (incidence->thisAndFuture()) {
-                            lastInc = incidence;
-                            lastOffset = offset;
-                        }
-                    } else if (inc != incidence) {   //thisAndFuture exception is active
-                        occurrenceStartDate = occurrenceStartDate.addSecs(offset);
-                    }
-
-                    if (!occurrenceIsHidden(calendar, incidence, occurrenceStartDate)) {
-                        occurrenceList << Private::Occurrence(incidence, recurrenceId , occurrenceStartDate);
-                    }
-
-                    if (resetIncidence) {
-                        incidence = lastInc;
-                        offset = lastOffset;
-                    }
+                generator.exceptions.append(sortKey(recurrenceId));
+                // TODO: exclude exceptions where the start/end is not within
+                // (so the occurrence of the recurrence is omitted, but no exception is added)
+                if (exception->status() != Incidence::StatusCanceled &&
+                        occursAt(inc, recurrenceId, from, to) &&
+                        !occurrenceIsHidden(calendar, exception, exception->dtStart())) {
+                    push(Occurrence(exception, recurrenceId, exception->dtStart()), order, -1);
                 }
-            } else {
-                occurrenceList << Private::Occurrence(inc, KDateTime(), inc->dtStart());
             }
+            if (!std::is_sorted(generator.exceptions.constBegin(), generator.exceptions.constEnd())) {
+                std::sort(generator.exceptions.begin(), generator.exceptions.end());
+            }
+            if (!std::is_sorted(thisAndFuture.constBegin(), thisAndFuture.constEnd(), lessThanRecurrenceId)) {
+                std::sort(thisAndFuture.begin(), thisAndFuture.end(), lessThanRecurrenceId);
+            }
+
+            foreach (const Incidence::Ptr &exception, thisAndFuture) {
+                const KDateTime recurrenceId =
+                    exception->recurrenceId().toTimeSpec(incidenceRecStart.timeSpec());
+                generator.before = recurrenceId;
+                addGenerator(calendar, generator, order);
+
+                generator.incidence = exception;
+                generator.offset = exception->recurrenceId().secsTo(exception->dtStart());
+                generator.first = recurrenceId;
+                KDateTime segmentStart = recurrenceId;
+                segmentStart.setDateOnly(false);
+                if (from.isValid() && from < segmentStart) {
+                    generator.windowStart = segmentStart;
+                }
+            }
+            generator.before = KDateTime();
+            addGenerator(calendar, generator, order);
         }
-        occurrenceIt = QListIterator<Private::Occurrence>(occurrenceList);
+    }
+
+    static bool lessThanRecurrenceId(const Incidence::Ptr &i1, const Incidence::Ptr &i2)
+    {
+        return i1->recurrenceId() < i2->recurrenceId();
     }
 };
 //@endcond
 
-static uint qHash(const KDateTime &dt)
-{
-    return qHash(dt.toString());
-}
-
 /**
- * Right now there is little point in the iterator, but:
- * With an iterator it should be possible to solve this more memory efficiently
- * and with immediate results at the beginning of the selected timeframe.
- * Either all events are iterated simoulatneously, resulting in occurrences
- * of all events in parallel in the correct time-order, or incidence after
- * incidence, which would be even more efficient.
- *
- * By making this class a friend of calendar, we could also use the internally
- * available data structures.
+ * The occurrences of all incidences are merged in chronological order, by
+ * keeping the next occurrence of every incidence in a min-heap. Occurrences of
+ * recurring incidences are only computed when they are about to be returned,
+ * so iterating over the first few occurrences of a long range is cheap.
  */
 OccurrenceIterator::OccurrenceIterator(const Calendar &calendar,
                                        const KDateTime &start,
@@ -235,12 +459,24 @@ OccurrenceIterator::~OccurrenceIterator()
 
 bool OccurrenceIterator::hasNext() const
 {
-    return d->occurrenceIt.hasNext();
+    return !d->heap.isEmpty();
 }
 
 void OccurrenceIterator::next()
 {
-    d->current = d->occurrenceIt.next();
+    if (d->heap.isEmpty()) {
+        return;
+    }
+    std::pop_heap(d->heap.begin(), d->heap.end(), Private::heapGreater);
+    const Private::HeapEntry entry = d->heap.takeLast();
+    d->current = entry.occurrence;
+
+    if (entry.generator >= 0) {
+        Private::Occurrence occurrence;
+        if (d->nextOccurrence(d->generators[entry.generator], occurrence)) {
+            d->push(occurrence, entry.order, entry.generator);
+        }
+    }
 }
 
 Incidence::Ptr OccurrenceIterator::incidence() const
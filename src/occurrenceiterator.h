@@ -41,7 +41,9 @@ class Calendar;
  *
  * The iterator takes recurrences and exceptions to recurrences into account
  *
- * The iterator does not iterate the occurrences of all incidences chronologically.
+ * Since 5.15 the occurrences of all incidences are iterated chronologically,
+ * by start date. They are computed as the iteration goes, so stopping after
+ * the first few occurrences of a long time range is cheap.
  * @since 4.11
  */
 class KCALCORE_EXPORT OccurrenceIterator
@@ -0,0 +1,319 @@
+/*
+  This file is part of the kcalcore library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the internal OccurrenceWalker class.
+*/
+
+#ifndef KCALCORE_OCCURRENCEWALKER_P_H
+#define KCALCORE_OCCURRENCEWALKER_P_H
+
+#include "recurrencerule.h"
+
+namespace KCalCore
+{
+
+//@cond PRIVATE
+/**
+  Steps through the occurrences of a recurrence or a recurrence rule, one at
+  a time, forwards or backwards from a position.
+
+  The occurrences are fetched a window at a time with timesInInterval(), so
+  that each step only moves an index into the current window. When a window
+  holds no occurrence, the walker jumps straight to the next one found by the
+  subclass, so sparse or finished recurrences don't loop over empty windows.
+  @internal
+*/
+class OccurrenceWalker
+{
+public:
+    OccurrenceWalker(const KDateTime &position, qint64 windowSecs)
+        : mPosition(position),
+          mIndex(0),
+          mWindowSecs(windowSecs > 0 ? qMax(windowSecs, Q_INT64_C(60)) : Q_INT64_C(64) * 86400)
+    {
+        // Windows are fetched as date-times, so that consecutive ones don't
+        // overlap
+        KDateTime dt = position;
+        if (dt.isDateOnly()) {
+            dt.setDateOnly(false);
+        }
+        mStart = dt.addSecs(1);
+        mEnd = dt;
+    }
+
+    virtual ~OccurrenceWalker()
+    {
+    }
+
+    /**
+      Returns a position just before @p dt, from which next() returns @p dt
+      if it is an occurrence.
+    */
+    static KDateTime before(const KDateTime &dt)
+    {
+        KDateTime result = dt;
+        result.setDateOnly(false);
+        return result.addSecs(-1);
+    }
+
+    KDateTime position() const
+    {
+        return mPosition;
+    }
+
+    /**
+      Moves to the first occurrence after the position and returns it, or
+      returns an invalid date/time without moving if there is none.
+    */
+    KDateTime next()
+    {
+        forever {
+            // Occurrences of date-only recurrences can be returned twice
+            int i = mIndex;
+            while (i < mTimes.count() && !(mPosition < mTimes.at(i))) {
+                ++i;
+            }
+            if (i < mTimes.count()) {
+                mPosition = mTimes.at(i);
+                mIndex = i + 1;
+                return mPosition;
+            }
+            if (!fetchForward()) {
+                return KDateTime();
+            }
+        }
+    }
+
+    /**
+      Moves to the last occurrence before the position and returns it, or
+      returns an invalid date/time without moving if there is none.
+    */
+    KDateTime previous()
+    {
+        forever {
+            int i = qMin(mIndex, mTimes.count()) - 1;
+            while (i >= 0 && !(mTimes.at(i) < mPosition)) {
+                --i;
+            }
+            if (i >= 0) {
+                mPosition = mTimes.at(i);
+                mIndex = i + 1;
+                return mPosition;
+            }
+            if (!fetchBackward()) {
+                return KDateTime();
+            }
+        }
+    }
+
+    /**
+      Length of the first windows of occurrences to fetch for a rule: enough
+      for a few dozen occurrences, counting those which the BYxxx lists
+      expand each period into, or 0 if there is no rule or it has no period.
+      The walker then uses windows of 64 days.
+    */
+    static qint64 windowSeconds(const RecurrenceRule *rule)
+    {
+        if (!rule) {
+            return 0;
+        }
+        qint64 period;
+        switch (rule->recurrenceType()) {
+        case RecurrenceRule::rSecondly:
+            period = 1;
+            break;
+        case RecurrenceRule::rMinutely:
+            period = 60;
+            break;
+        case RecurrenceRule::rHourly:
+            period = 3600;
+            break;
+        case RecurrenceRule::rDaily:
+            period = 86400;
+            break;
+        case RecurrenceRule::rWeekly:
+            period = 7 * 86400;
+            break;
+        case RecurrenceRule::rMonthly:
+            period = 31 * 86400;
+            break;
+        case RecurrenceRule::rYearly:
+            period = 366 * 86400;
+            break;
+        default:
+            return 0;
+        }
+        const qint64 periods = qMax(Q_INT64_C(1), 64 / occurrencesPerPeriod(rule));
+        return period * qMax(1u, rule->frequency()) * periods;
+    }
+
+    /**
+      Estimates how many occurrences a rule has in each of its periods: the
+      BYxxx lists for units smaller than the period each expand the
+      occurrences, while BYSETPOS limits them.
+    */
+    static qint64 occurrencesPerPeriod(const RecurrenceRule *rule)
+    {
+        const RecurrenceRule::PeriodType type = rule->recurrenceType();
+        qint64 count = 1;
+        if (type > RecurrenceRule::rSecondly && !rule->bySeconds().isEmpty()) {
+            count *= rule->bySeconds().count();
+        }
+        if (type > RecurrenceRule::rMinutely && !rule->byMinutes().isEmpty()) {
+            count *= rule->byMinutes().count();
+        }
+        if (type > RecurrenceRule::rHourly && !rule->byHours().isEmpty()) {
+            count *= rule->byHours().count();
+        }
+        if (type == RecurrenceRule::rYearly) {
+            if (!rule->byMonths().isEmpty()) {
+                count *= rule->byMonths().count();
+            }
+            if (!rule->byWeekNumbers().isEmpty()) {
+                count *= rule->byWeekNumbers().count();
+            }
+            if (!rule->byYearDays().isEmpty()) {
+                count *= rule->byYearDays().count();
+            }
+        }
+        if (type >= RecurrenceRule::rMonthly && !rule->byMonthDays().isEmpty()) {
+            count *= rule->byMonthDays().count();
+        }
+        // Weekdays only limit the days of the month or of the year, if given.
+        // Otherwise those without a position occur in every week of the period.
+        if (type >= RecurrenceRule::rWeekly && !rule->byDays().isEmpty() &&
+                rule->byMonthDays().isEmpty() && rule->byYearDays().isEmpty()) {
+            qint64 weeks = 1;
+            if (type == RecurrenceRule::rMonthly ||
+                    (type == RecurrenceRule::rYearly && !rule->byMonths().isEmpty())) {
+                weeks = 4;
+            } else if (type == RecurrenceRule::rYearly && rule->byWeekNumbers().isEmpty()) {
+                weeks = 52;
+            }
+            qint64 days = 0;
+            foreach (const RecurrenceRule::WDayPos &day, rule->byDays()) {
+                days += day.pos() ? 1 : weeks;
+            }
+            count *= days;
+        }
+        if (!rule->bySetPos().isEmpty()) {
+            count = qMin(count, qint64(rule->bySetPos().count()));
+        }
+        return count;
+    }
+
+protected:
+    /** Returns the occurrences between @p start and @p end inclusive. */
+    virtual DateTimeList times(const KDateTime &start, const KDateTime &end) const = 0;
+    /** Returns the first occurrence after @p dt. */
+    virtual KDateTime nextAfter(const KDateTime &dt) const = 0;
+    /** Returns the last occurrence before @p dt. */
+    virtual KDateTime previousBefore(const KDateTime &dt) const = 0;
+
+private:
+    bool fetchForward()
+    {
+        KDateTime start = mEnd.addSecs(1);
+        forever {
+            const KDateTime end = start.addSecs(mWindowSecs - 1);
+            if (setWindow(start, end, false)) {
+                mIndex = 0;
+                return true;
+            }
+            // Nothing in this window, so jump to the next occurrence
+            KDateTime dt = nextAfter(end);
+            if (!dt.isValid()) {
+                return false;
+            }
+            dt.setDateOnly(false);
+            start = dt;
+        }
+    }
+
+    bool fetchBackward()
+    {
+        KDateTime end = mStart.addSecs(-1);
+        forever {
+            const KDateTime start = end.addSecs(1 - mWindowSecs);
+            if (setWindow(start, end, true)) {
+                mIndex = mTimes.count();
+                return true;
+            }
+            KDateTime dt = previousBefore(start);
+            if (!dt.isValid()) {
+                return false;
+            }
+            if (dt.isDateOnly()) {
+                dt = KDateTime(dt.date(), QTime(23, 59, 59), dt.timeSpec());
+            }
+            end = dt;
+        }
+    }
+
+    // Fetches the occurrences between start and end, and returns whether
+    // there are any. The window only covers what was actually fetched: an
+    // invalid last entry marks a list which stops early, after which the
+    // occurrences are unknown. Going backwards, the occurrences just before
+    // end are the ones needed, so the rest of the window is fetched instead.
+    bool setWindow(const KDateTime &start, const KDateTime &end, bool backwards)
+    {
+        KDateTime windowStart = start;
+        KDateTime windowEnd = end;
+        DateTimeList dts = times(start, end);
+        while (!dts.isEmpty() && !dts.last().isValid()) {
+            dts.removeLast();
+            if (dts.isEmpty()) {
+                break;
+            }
+            KDateTime last = dts.last();
+            last.setDateOnly(false);
+            if (!backwards) {
+                windowEnd = last;
+                break;
+            }
+            const DateTimeList rest = times(last.addSecs(1), end);
+            if (rest.isEmpty()) {
+                break;
+            }
+            windowStart = last.addSecs(1);
+            dts = rest;
+        }
+        if (dts.isEmpty()) {
+            return false;
+        }
+        mTimes = dts;
+        mStart = windowStart;
+        mEnd = windowEnd;
+        return true;
+    }
+
+    KDateTime mPosition;    // last occurrence returned, or the initial position
+    DateTimeList mTimes;    // occurrences from mStart to mEnd inclusive
+    KDateTime mStart;
+    KDateTime mEnd;
+    int mIndex;             // index in mTimes after mPosition
+    const qint64 mWindowSecs;
+};
+//@endcond
+
+}
+
+#endif
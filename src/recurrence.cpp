@@ -22,12 +22,15 @@
   Boston, MA 02110-1301, USA.
 */
 #include "recurrence.h"
+#include "occurrencewalker_p.h"
 #include "sortablelist.h"
 
 #include "kcalcore_debug.h"
 
+#include <QtCore/QAtomicInt>
 #include <QtCore/QBitArray>
 #include <QtCore/QTime>
+#include <QtCore/QVector>
 
 using namespace KCalCore;
 
@@ -48,7 +51,7 @@ public:
           mExDateTimes(p.mExDateTimes),
           mExDates(p.mExDates),
           mStartDateTime(p.mStartDateTime),
-          mCachedType(p.mCachedType),
+          mCachedType(p.mCachedType.load()),
           mAllDay(p.mAllDay),
           mRecurReadOnly(p.mRecurReadOnly)
     {
@@ -65,8 +68,9 @@ public:
     KDateTime mStartDateTime;    // date/time of first recurrence
     QList<RecurrenceObserver *> mObservers;
 
-    // Cache the type of the recurrence with the old system (e.g. MonthlyPos)
-    mutable ushort mCachedType;
+    // Cache the type of the recurrence with the old system (e.g. MonthlyPos).
+    // Atomic, as it is filled in lazily by const methods.
+    mutable QAtomicInt mCachedType;
 
     bool mAllDay;                // the recurrence has no time, just a date
     bool mRecurReadOnly;
@@ -221,7 +225,7 @@ RecurrenceRule *Recurrence::defaultRRuleConst() const
 void Recurrence::updated()
 {
     // recurrenceType() re-calculates the type if it's rMax
-    d->mCachedType = rMax;
+    d->mCachedType.store(rMax);
     for (int i = 0, end = d->mObservers.count();  i < end;  ++i) {
         if (d->mObservers[i]) {
             d->mObservers[i]->recurrenceUpdated(this);
@@ -236,10 +240,12 @@ bool Recurrence::recurs() const
 
 ushort Recurrence::recurrenceType() const
 {
-    if (d->mCachedType == rMax) {
-        d->mCachedType = recurrenceType(defaultRRuleConst());
+    int type = d->mCachedType.load();
+    if (type == rMax) {
+        type = recurrenceType(defaultRRuleConst());
+        d->mCachedType.store(type);
     }
-    return d->mCachedType;
+    return type;
 }
 
 ushort Recurrence::recurrenceType(const RecurrenceRule *rrule)
@@ -394,6 +400,55 @@ bool Recurrence::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec) cons
     }
 }
 
+QBitArray Recurrence::recursOnRange(const QDate &from, const QDate &to,
+                                     const KDateTime::Spec &timeSpec) const
+{
+    if (!from.isValid() || !to.isValid() || to < from) {
+        return QBitArray();
+    }
+    const int days = static_cast<int>(from.daysTo(to)) + 1;
+    QBitArray result(days);
+
+    int i, end;
+    QBitArray rruleDays(days);
+    for (i = 0, end = d->mRRules.count();  i < end;  ++i) {
+        rruleDays |= d->mRRules[i]->recursOnRange(from, to, timeSpec);
+    }
+    QBitArray exruleDays(days);
+    for (i = 0, end = d->mExRules.count();  i < end;  ++i) {
+        exruleDays |= d->mExRules[i]->recursOnRange(from, to, timeSpec);
+    }
+
+    // The same checks as recursOn(), with the rules evaluated for the whole range
+    for (int day = 0;  day < days;  ++day) {
+        const QDate qd = from.addDays(day);
+        if (KDateTime(qd, QTime(23, 59, 59), timeSpec) < d->mStartDateTime ||
+                d->mExDates.containsSorted(qd) ||
+                (allDay() && exruleDays.testBit(day))) {
+            continue;
+        }
+        if (d->mRDates.containsSorted(qd)) {
+            result.setBit(day);
+            continue;
+        }
+
+        bool recurs = (startDate() == qd) || rruleDays.testBit(day);
+        for (i = 0, end = d->mRDateTimes.count();  i < end && !recurs;  ++i) {
+            recurs = (d->mRDateTimes[i].toTimeSpec(timeSpec).date() == qd);
+        }
+        if (!recurs) {
+            continue;
+        }
+
+        bool exon = !allDay() && exruleDays.testBit(day);
+        for (i = 0, end = d->mExDateTimes.count();  i < end && !exon;  ++i) {
+            exon = (d->mExDateTimes[i].toTimeSpec(timeSpec).date() == qd);
+        }
+        result.setBit(day, !exon || !recurTimesOn(qd, timeSpec).isEmpty());
+    }
+    return result;
+}
+
 bool Recurrence::recursAt(const KDateTime &dt) const
 {
     // Convert to recurrence's time zone for date comparisons, and for more efficient time comparisons
@@ -561,7 +616,7 @@ void Recurrence::clear()
     d->mRDateTimes.clear();
     d->mExDates.clear();
     d->mExDateTimes.clear();
-    d->mCachedType = rMax;
+    d->mCachedType.store(rMax);
     updated();
 }
 
@@ -949,29 +1004,80 @@ TimeList Recurrence::recurTimesOn(const QDate &date, const KDateTime::Spec &time
     return times;
 }
 
+//@cond PRIVATE
+// Merges sorted lists of times into one sorted list without duplicates, in a
+// single pass which each time picks the earliest of the lists' next times.
+static DateTimeList mergeSorted(const QVector<DateTimeList> &lists)
+{
+    DateTimeList result;
+    int total = 0;
+    for (int i = 0, count = lists.count();  i < count;  ++i) {
+        total += lists[i].count();
+    }
+    result.reserve(total);
+
+    QVector<int> next(lists.count(), 0);
+    forever {
+        int earliest = -1;
+        for (int i = 0, count = lists.count();  i < count;  ++i) {
+            if (next[i] < lists[i].count() &&
+                    (earliest < 0 || lists[i][next[i]] < lists[earliest][next[earliest]])) {
+                earliest = i;
+            }
+        }
+        if (earliest < 0) {
+            return result;
+        }
+        const KDateTime &dt = lists[earliest][next[earliest]++];
+        if (result.isEmpty() || !(result.last() == dt)) {
+            result += dt;
+        }
+    }
+}
+//@endcond
+
 DateTimeList Recurrence::timesInInterval(const KDateTime &start, const KDateTime &end) const
 {
     int i, count;
-    DateTimeList times;
+
+    // Collect the included times as sorted lists, one for each source. If a
+    // rule's list is incomplete, only the times up to its last time are kept.
+    QVector<DateTimeList> included;
+    bool incomplete = false;
+    KDateTime limit;
     for (i = 0, count = d->mRRules.count();  i < count;  ++i) {
-        times += d->mRRules[i]->timesInInterval(start, end);
+        DateTimeList dts = d->mRRules[i]->timesInInterval(start, end);
+        if (!dts.isEmpty() && !dts.last().isValid()) {
+            dts.removeLast();
+            if (!dts.isEmpty() && (!incomplete || dts.last() < limit)) {
+                limit = dts.last();
+                incomplete = true;
+            }
+        }
+        included += dts;
     }
 
     // add rdatetimes that fit in the interval
-    for (i = 0, count = d->mRDateTimes.count();  i < count;  ++i) {
-        if (d->mRDateTimes[i] >= start && d->mRDateTimes[i] <= end) {
-            times += d->mRDateTimes[i];
-        }
+    DateTimeList rdts;
+    for (i = d->mRDateTimes.findGE(start), count = d->mRDateTimes.count();
+            i >= 0 && i < count && d->mRDateTimes[i] <= end;  ++i) {
+        rdts += d->mRDateTimes[i];
     }
+    included += rdts;
 
     // add rdates that fit in the interval
+    rdts.clear();
     KDateTime kdt(d->mStartDateTime);
     for (i = 0, count = d->mRDates.count();  i < count;  ++i) {
         kdt.setDate(d->mRDates[i]);
-        if (kdt >= start && kdt <= end) {
-            times += kdt;
+        if (kdt > end) {
+            break;
+        }
+        if (kdt >= start) {
+            rdts += kdt;
         }
     }
+    included += rdts;
 
     // Recurrence::timesInInterval(...) doesn't explicitly add mStartDateTime to the list
     // of times to be returned. It calls mRRules[i]->timesInInterval(...) which include
@@ -982,39 +1088,57 @@ DateTimeList Recurrence::timesInInterval(const KDateTime &start, const KDateTime
             d->mRRules.isEmpty() &&
             start <= d->mStartDateTime &&
             end >= d->mStartDateTime) {
-        times += d->mStartDateTime;
+        included += DateTimeList() << d->mStartDateTime;
     }
 
-    times.sortUnique();
+    const DateTimeList times = mergeSorted(included);
 
-    // Remove excluded times
-    int idt = 0;
-    int enddt = times.count();
-    for (i = 0, count = d->mExDates.count();  i < count && idt < enddt;  ++i) {
-        while (idt < enddt && times[idt].date() < d->mExDates[i]) {
-            ++idt;
+    // The excluded times, also as one sorted list
+    QVector<DateTimeList> excluded;
+    for (i = 0, count = d->mExRules.count();  i < count;  ++i) {
+        DateTimeList dts = d->mExRules[i]->timesInInterval(start, end);
+        if (!dts.isEmpty() && !dts.last().isValid()) {
+            dts.removeLast();
         }
-        while (idt < enddt && times[idt].date() == d->mExDates[i]) {
-            times.removeAt(idt);
-            --enddt;
+        excluded += dts;
+    }
+    DateTimeList exdts;
+    for (i = d->mExDateTimes.findGE(start), count = d->mExDateTimes.count();
+            i >= 0 && i < count && d->mExDateTimes[i] <= end;  ++i) {
+        exdts += d->mExDateTimes[i];
+    }
+    excluded += exdts;
+    const DateTimeList extimes = mergeSorted(excluded);
+
+    // Remove the excluded dates and times in the same pass, as all the lists
+    // are sorted
+    DateTimeList result;
+    result.reserve(times.count() + (incomplete ? 1 : 0));
+    int ix = 0;
+    int ixdt = 0;
+    for (i = 0, count = times.count();  i < count;  ++i) {
+        const KDateTime &dt = times[i];
+        if (incomplete && limit < dt) {
+            break;
         }
-    }
-    DateTimeList extimes;
-    for (i = 0, count = d->mExRules.count();  i < count;  ++i) {
-        extimes += d->mExRules[i]->timesInInterval(start, end);
-    }
-    extimes += d->mExDateTimes;
-    extimes.sortUnique();
-
-    int st = 0;
-    for (i = 0, count = extimes.count();  i < count;  ++i) {
-        int j = times.removeSorted(extimes[i], st);
-        if (j >= 0) {
-            st = j;
+        while (ix < d->mExDates.count() && d->mExDates[ix] < dt.date()) {
+            ++ix;
+        }
+        if (ix < d->mExDates.count() && d->mExDates[ix] == dt.date()) {
+            continue;
+        }
+        while (ixdt < extimes.count() && extimes[ixdt] < dt) {
+            ++ixdt;
+        }
+        if (ixdt < extimes.count() && extimes[ixdt] == dt) {
+            continue;
         }
+        result += dt;
     }
-
-    return times;
+    if (incomplete) {
+        result += KDateTime();    // indicate that the returned list is incomplete
+    }
+    return result;
 }
 
 KDateTime Recurrence::getNextDateTime(const KDateTime &preDateTime) const
@@ -1397,6 +1521,63 @@ Recurrence::RecurrenceObserver::~RecurrenceObserver()
 {
 }
 
+//@cond PRIVATE
+class Q_DECL_HIDDEN KCalCore::Recurrence::Cursor::Private : public OccurrenceWalker
+{
+public:
+    Private(const Recurrence *recurrence, const KDateTime &position)
+        : OccurrenceWalker(position.isValid() ? position : before(recurrence->startDateTime()),
+                           windowSeconds(recurrence->defaultRRuleConst())),
+          mRecurrence(recurrence)
+    {
+    }
+
+protected:
+    DateTimeList times(const KDateTime &start, const KDateTime &end) const Q_DECL_OVERRIDE
+    {
+        return mRecurrence->timesInInterval(start, end);
+    }
+
+    KDateTime nextAfter(const KDateTime &dt) const Q_DECL_OVERRIDE
+    {
+        return mRecurrence->getNextDateTime(dt);
+    }
+
+    KDateTime previousBefore(const KDateTime &dt) const Q_DECL_OVERRIDE
+    {
+        return mRecurrence->getPreviousDateTime(dt);
+    }
+
+private:
+    const Recurrence *const mRecurrence;
+};
+//@endcond
+
+Recurrence::Cursor::Cursor(const Recurrence *recurrence, const KDateTime &position)
+    : d(new Private(recurrence, position))
+{
+}
+
+Recurrence::Cursor::~Cursor()
+{
+    delete d;
+}
+
+KDateTime Recurrence::Cursor::next()
+{
+    return d->next();
+}
+
+KDateTime Recurrence::Cursor::previous()
+{
+    return d->previous();
+}
+
+KDateTime Recurrence::Cursor::position() const
+{
+    return d->position();
+}
+
 KCALCORE_EXPORT QDataStream &KCalCore::operator<<(QDataStream &out, KCalCore::Recurrence *r)
 {
     if (!r) {
@@ -1404,7 +1585,7 @@ KCALCORE_EXPORT QDataStream &KCalCore::operator<<(QDataStream &out, KCalCore::Re
     }
 
     out << r->d->mRDateTimes << r->d->mExDateTimes
-        << r->d->mRDates << r->d->mStartDateTime << r->d->mCachedType
+        << r->d->mRDates << r->d->mStartDateTime << static_cast<ushort>(r->d->mCachedType.load())
         << r->d->mAllDay << r->d->mRecurReadOnly << r->d->mExDates
         << r->d->mExRules.count() << r->d->mRRules.count();
 
@@ -1426,12 +1607,14 @@ KCALCORE_EXPORT QDataStream &KCalCore::operator>>(QDataStream &in, KCalCore::Rec
     }
 
     int rruleCount, exruleCount;
+    ushort cachedType;
 
     in >> r->d->mRDateTimes >> r->d->mExDateTimes
-       >> r->d->mRDates >> r->d->mStartDateTime >> r->d->mCachedType
+       >> r->d->mRDates >> r->d->mStartDateTime >> cachedType
        >> r->d->mAllDay >> r->d->mRecurReadOnly >> r->d->mExDates
        >> exruleCount >> rruleCount;
 
+    r->d->mCachedType.store(cachedType);
     r->d->mExRules.clear();
     r->d->mRRules.clear();
 
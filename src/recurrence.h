@@ -96,6 +96,62 @@ public:
         virtual void recurrenceUpdated(Recurrence *r) = 0;
     };
 
+    /**
+      A cursor stepping through the occurrences of a recurrence, forwards or
+      backwards, one at a time.
+
+      Unlike repeated calls to getNextDateTime() or getPreviousDateTime(), the
+      cursor keeps its position among the occurrences which it has already
+      computed, with the recurrence dates and exceptions merged in, so each
+      step usually costs only an index increment. Occurrences are computed a
+      window at a time as the cursor moves on.
+
+      The recurrence must not be changed or deleted while the cursor is used.
+      @see RecurrenceRule::Cursor
+      @since 5.15
+    */
+    class KCALCORE_EXPORT Cursor
+    {
+    public:
+        /**
+          Constructs a cursor on the occurrences of @p recurrence.
+          @param recurrence the recurrence whose occurrences to step through.
+          @param position the position to start from. next() returns the
+          first occurrence after it and previous() the last one before it.
+          If invalid, the cursor starts just before the start of the
+          recurrence.
+        */
+        explicit Cursor(const Recurrence *recurrence, const KDateTime &position = KDateTime());
+        ~Cursor();
+
+        /**
+          Moves to the next occurrence after the current position.
+          @return the occurrence, or an invalid date/time if there are no
+          more occurrences, in which case the position doesn't change.
+        */
+        KDateTime next();
+
+        /**
+          Moves to the previous occurrence before the current position.
+          @return the occurrence, or an invalid date/time if there are no
+          earlier occurrences, in which case the position doesn't change.
+        */
+        KDateTime previous();
+
+        /**
+          Returns the current position, which is the last occurrence returned,
+          or the position the cursor started from.
+        */
+        KDateTime position() const;
+
+    private:
+        Q_DISABLE_COPY(Cursor)
+        //@cond PRIVATE
+        class Private;
+        Private *const d;
+        //@endcond
+    };
+
     /** enumeration for describing how an event recurs, if at all. */
     enum {
         rNone = 0,
@@ -203,6 +259,23 @@ public:
     */
     bool recursOn(const QDate &date, const KDateTime::Spec &timeSpec) const;
 
+    /**
+      Returns for each day of a date range whether the event recurs on it, as
+      recursOn() does for a single date. The occurrences of the whole range
+      are computed at once, which is much faster than calling recursOn() for
+      each day.
+
+      @param from first date of the range.
+      @param to last date of the range.
+      @param timeSpec time specification for the dates.
+      @return an array with one bit per day from @p from to @p to, set for the
+              days on which the event recurs; an empty array if @p to is
+              before @p from.
+      @since 5.15
+    */
+    QBitArray recursOnRange(const QDate &from, const QDate &to,
+                            const KDateTime::Spec &timeSpec) const;
+
     /**
       Returns true if the date/time specified is one at which the event will
       recur. Times are rounded down to the nearest minute to determine the
@@ -20,18 +20,43 @@
   Boston, MA 02110-1301, USA.
 */
 #include "recurrencerule.h"
+#include "occurrencewalker_p.h"
 
 #include "kcalcore_debug.h"
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QBitArray>
+#include <QtCore/QDataStream>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QStringList>
 #include <QtCore/QTime>
 #include <QtCore/QVector>
 
+#include <algorithm>
+#include <limits>
+
 using namespace KCalCore;
 
 // Maximum number of intervals to process
 const int LOOP_LIMIT = 10000;
 
+// Julian day of the epoch, 1970-01-01, from which occurrences are counted
+const qint64 EPOCH_JULIAN_DAY = 2440588;
+
+// UTC offset recorded for a day whose offset changes during the day
+const int VARYING_OFFSET = std::numeric_limits<int>::min();
+
+// Number of periods by which the occurrence window of a rule without end is
+// extended when looking for the next or previous occurrence
+const int WINDOW_PERIODS = 16;
+
+// Occurrence window size and statistics, shared by all rules
+static QAtomicInt occurrenceCacheMaxSize(512);
+static QAtomicInt occurrenceCacheHitCount(0);
+static QAtomicInt occurrenceCacheMissCount(0);
+
 #ifndef NDEBUG
 static QString dumpTime(const KDateTime &dt);     // for debugging
 #endif
@@ -181,6 +206,167 @@ bool RecurrenceRule::WDayPos::operator!=(const RecurrenceRule::WDayPos &pos2) co
     return !operator==(pos2);
 }
 
+/**************************************************************************
+ *                               EpochTime                                *
+ **************************************************************************/
+//@cond PRIVATE
+// The recurrence engine generates, sorts and compares occurrences as integer
+// seconds since the epoch in the local time of the rule's time specification,
+// and only converts them to KDateTime when they are returned. As KDateTime
+// does, times with the same second occurrence flag are compared by their
+// local times, and otherwise by their UTC times.
+struct EpochTime
+{
+    qint64 secs;            // local seconds since 1970-01-01 00:00:00
+    bool secondOccurrence;  // the second occurrence of a time repeated by a daylight savings shift
+
+    bool operator<(const EpochTime &other) const
+    {
+        return secs < other.secs ||
+               (secs == other.secs && secondOccurrence < other.secondOccurrence);
+    }
+    bool operator==(const EpochTime &other) const
+    {
+        return secs == other.secs && secondOccurrence == other.secondOccurrence;
+    }
+};
+Q_DECLARE_TYPEINFO(EpochTime, Q_PRIMITIVE_TYPE);
+
+typedef QVector<EpochTime> EpochList;
+
+static qint64 epochSeconds(const QDate &date, const QTime &time)
+{
+    return (date.toJulianDay() - EPOCH_JULIAN_DAY) * 86400 + QTime(0, 0, 0).secsTo(time);
+}
+
+static qint64 epochDay(qint64 secs)
+{
+    return secs / 86400 - (secs % 86400 < 0 ? 1 : 0);
+}
+
+// Converts between the date/times of one time specification and EpochTime.
+// The UTC offset of each day is looked up once and remembered, so that the
+// time zone is only consulted again for the days of daylight savings shifts.
+class EpochTable
+{
+public:
+    explicit EpochTable(const KDateTime::Spec &spec)
+        : mSpec(spec)
+    {
+    }
+
+    bool isValid() const
+    {
+        return mSpec.isValid();
+    }
+    EpochTime epochTime(const QDate &date, const QTime &time, bool secondOccurrence) const;
+    EpochTime lowerBound(const KDateTime &dt) const;
+    EpochTime upperBound(const KDateTime &dt) const;
+    bool lessThan(const EpochTime &t1, const EpochTime &t2) const;
+    KDateTime dateTime(const EpochTime &t) const;
+    DateTimeList dateTimes(const EpochList &list) const;
+
+private:
+    qint64 utc(const EpochTime &t) const;
+    int utcOffset(const QDate &date, const QTime &time) const;
+
+    const KDateTime::Spec mSpec;
+    mutable QHash<qint64, int> mDayOffsets;   // UTC offset of each day, or VARYING_OFFSET
+};
+
+EpochTime EpochTable::epochTime(const QDate &date, const QTime &time, bool secondOccurrence) const
+{
+    EpochTime t;
+    t.secs = epochSeconds(date, time);
+    // KDateTime only keeps the flag for time zones
+    t.secondOccurrence = secondOccurrence && mSpec.type() == KDateTime::TimeZone;
+    return t;
+}
+
+// The first second not before a date/time, in the same time specification
+EpochTime EpochTable::lowerBound(const KDateTime &dt) const
+{
+    if (!dt.isValid()) {
+        EpochTime t = { std::numeric_limits<qint64>::min(), false };
+        return t;
+    }
+    if (dt.isDateOnly()) {
+        return epochTime(dt.date(), QTime(0, 0, 0), false);
+    }
+    EpochTime t = epochTime(dt.date(), dt.time(), dt.isSecondOccurrence());
+    if (dt.time().msec() > 0) {
+        ++t.secs;
+    }
+    return t;
+}
+
+// The last second not after a date/time, in the same time specification
+EpochTime EpochTable::upperBound(const KDateTime &dt) const
+{
+    if (!dt.isValid()) {
+        EpochTime t = { std::numeric_limits<qint64>::max(), false };
+        return t;
+    }
+    if (dt.isDateOnly()) {
+        return epochTime(dt.date(), QTime(23, 59, 59), false);
+    }
+    return epochTime(dt.date(), dt.time(), dt.isSecondOccurrence());
+}
+
+bool EpochTable::lessThan(const EpochTime &t1, const EpochTime &t2) const
+{
+    if (t1.secondOccurrence == t2.secondOccurrence) {
+        return t1.secs < t2.secs;
+    }
+    return utc(t1) < utc(t2);
+}
+
+KDateTime EpochTable::dateTime(const EpochTime &t) const
+{
+    const qint64 day = epochDay(t.secs);
+    KDateTime dt(QDate::fromJulianDay(day + EPOCH_JULIAN_DAY),
+                 QTime(0, 0, 0).addSecs(static_cast<int>(t.secs - day * 86400)), mSpec);
+    if (t.secondOccurrence) {
+        dt.setSecondOccurrence(true);
+    }
+    return dt;
+}
+
+DateTimeList EpochTable::dateTimes(const EpochList &list) const
+{
+    DateTimeList result;
+    result.reserve(list.count());
+    for (int i = 0, iend = list.count();  i < iend;  ++i) {
+        result += dateTime(list[i]);
+    }
+    return result;
+}
+
+// Only times with the second occurrence flag, which is only kept for time
+// zones, are ever converted to UTC.
+qint64 EpochTable::utc(const EpochTime &t) const
+{
+    const qint64 day = epochDay(t.secs);
+    QHash<qint64, int>::ConstIterator it = mDayOffsets.constFind(day);
+    if (it == mDayOffsets.constEnd()) {
+        const QDate date = QDate::fromJulianDay(day + EPOCH_JULIAN_DAY);
+        const int offset = utcOffset(date, QTime(0, 0, 0));
+        it = mDayOffsets.insert(day, offset == utcOffset(date, QTime(23, 59, 59)) ? offset : VARYING_OFFSET);
+    }
+    if (it.value() != VARYING_OFFSET) {
+        return t.secs - it.value();
+    }
+    const QDateTime dt = dateTime(t).toUtc().dateTime();
+    return epochSeconds(dt.date(), dt.time());
+}
+
+int EpochTable::utcOffset(const QDate &date, const QTime &time) const
+{
+    const QDateTime dt = KDateTime(date, time, mSpec).toUtc().dateTime();
+    return static_cast<int>(epochSeconds(date, time) - epochSeconds(dt.date(), dt.time()));
+}
+//@endcond
+
 /**************************************************************************
  *                               Constraint                               *
  **************************************************************************/
@@ -276,8 +462,9 @@ public:
     bool isConsistent(RecurrenceRule::PeriodType period) const;
     bool increase(RecurrenceRule::PeriodType type, int freq);
     KDateTime intervalDateTime(RecurrenceRule::PeriodType type) const;
-    QList<KDateTime> dateTimes(RecurrenceRule::PeriodType type) const;
-    void appendDateTime(const QDate &date, const QTime &time, QList<KDateTime> &list) const;
+    EpochList dateTimes(RecurrenceRule::PeriodType type, const EpochTable &table) const;
+    void appendDateTime(const QDate &date, const QTime &time, RecurrenceRule::PeriodType type,
+                        const EpochTable &table, EpochList &list) const;
     void dump() const;
 
 private:
@@ -383,7 +570,7 @@ bool Constraint::matches(const QDate &dt, RecurrenceRule::PeriodType type) const
     if (yearday > 0 && yearday != dt.dayOfYear()) {
         return false;
     }
-    if (yearday < 0 && yearday != dt.daysInYear() - dt.dayOfYear() + 1) {
+    if (yearday < 0 && -yearday != dt.daysInYear() - dt.dayOfYear() + 1) {
         return false;
     }
     return true;
@@ -504,9 +691,9 @@ bool Constraint::merge(const Constraint &interval)
 //           x       | x  x  x |  x  ?  | (-)| (-)
 // 5) All possiblecases have already been treated, so this must be an error!
 
-QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
+EpochList Constraint::dateTimes(RecurrenceRule::PeriodType type, const EpochTable &table) const
 {
-    QList<KDateTime> result;
+    EpochList result;
     bool done = false;
     if (!isConsistent(type)) {
         return result;
@@ -516,7 +703,7 @@ QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
     QTime tm(hour, minute, second);
 
     if (!done && day && month > 0) {
-        appendDateTime(DateHelper::getDate(year, month, day), tm, result);
+        appendDateTime(DateHelper::getDate(year, month, day), tm, type, table, result);
         done = true;
     }
 
@@ -538,7 +725,7 @@ QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
             }
             uint d = dstart;
             for (QDate dt(year, m, dstart); ; dt = dt.addDays(1)) {
-                appendDateTime(dt, tm, result);
+                appendDateTime(dt, tm, type, table, result);
                 if (++d > dend) {
                     break;
                 }
@@ -553,7 +740,7 @@ QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
         // yearday < 0 means from end of year, so we'll need Jan 1 of the next year
         QDate d(year + ((yearday > 0) ? 0 : 1), 1, 1);
         d = d.addDays(yearday - ((yearday > 0) ? 1 : 0));
-        appendDateTime(d, tm, result);
+        appendDateTime(d, tm, type, table, result);
         done = true;
     }
 
@@ -562,10 +749,10 @@ QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
         QDate wst(DateHelper::getNthWeek(year, weeknumber, weekstart));
         if (weekday != 0) {
             wst = wst.addDays((7 + weekday - weekstart) % 7);
-            appendDateTime(wst, tm, result);
+            appendDateTime(wst, tm, type, table, result);
         } else {
             for (int i = 0; i < 7; ++i) {
-                appendDateTime(wst, tm, result);
+                appendDateTime(wst, tm, type, table, result);
                 wst = wst.addDays(1);
             }
         }
@@ -597,41 +784,45 @@ QList<KDateTime> Constraint::dateTimes(RecurrenceRule::PeriodType type) const
 
         if (weekdaynr > 0) {
             dt = dt.addDays((weekdaynr - 1) * 7);
-            appendDateTime(dt, tm, result);
+            appendDateTime(dt, tm, type, table, result);
         } else if (weekdaynr < 0) {
             dt = dt.addDays(weekdaynr * 7);
-            appendDateTime(dt, tm, result);
+            appendDateTime(dt, tm, type, table, result);
         } else {
             // loop through all possible weeks, non-matching will be filtered later
             for (int i = 0; i < maxloop; ++i) {
-                appendDateTime(dt, tm, result);
+                appendDateTime(dt, tm, type, table, result);
                 dt = dt.addDays(7);
             }
         }
     } // weekday != 0
 
-    // Only use those times that really match all other constraints, too
-    QList<KDateTime> valid;
-    for (int i = 0, iend = result.count();  i < iend;  ++i) {
-        if (matches(result[i], type)) {
-            valid.append(result[i]);
-        }
-    }
     // Don't sort it here, would be unnecessary work. The results from all
     // constraints will be merged to one big list of the interval. Sort that one!
-    return valid;
+    return result;
 }
 
+// Append a date/time, if it really matches all the other constraints, too.
+// The time is made of the constraint's own fields, so it can only fail to
+// match in a time zone, where a time may be skipped or repeated by a daylight
+// savings shift. Only then is the full date/time checked.
 void Constraint::appendDateTime(const QDate &date, const QTime &time,
-                                QList<KDateTime> &list) const
+                                RecurrenceRule::PeriodType type,
+                                const EpochTable &table, EpochList &list) const
 {
-    KDateTime dt(date, time, timespec);
-    if (dt.isValid()) {
+    if (!date.isValid() || !time.isValid() || !table.isValid() || !matches(date, type)) {
+        return;
+    }
+    if (timespec.type() == KDateTime::TimeZone) {
+        KDateTime dt(date, time, timespec);
         if (secondOccurrence) {
             dt.setSecondOccurrence(true);
         }
-        list.append(dt);
+        if (!dt.isValid() || !matches(dt, type)) {
+            return;
+        }
     }
+    list.append(table.epochTime(date, time, secondOccurrence));
 }
 
 bool Constraint::increase(RecurrenceRule::PeriodType type, int freq)
@@ -701,6 +892,487 @@ bool Constraint::readDateTime(const KDateTime &dt, RecurrenceRule::PeriodType ty
     useCachedDt = false;
     return true;
 }
+
+QDataStream &operator<<(QDataStream &out, const Constraint &c);
+QDataStream &operator>>(QDataStream &in, Constraint &c);
+//@endcond
+
+/**************************************************************************
+ *                            ConstraintMatcher                           *
+ **************************************************************************/
+
+//@cond PRIVATE
+// The constraints of a rule compiled into bit sets, which tell whether a date
+// or time matches any of them without looping over the constraints. This
+// relies on the constraints being the cross product of the BY* lists of the
+// rule: a date then matches one of them if each of its fields is in the set
+// of values which the constraints allow for it. build() checks that, and
+// leaves the matcher invalid otherwise.
+class ConstraintMatcher
+{
+public:
+    ConstraintMatcher();
+    void build(const Constraint::List &constraints, RecurrenceRule::PeriodType type);
+    bool isValid() const
+    {
+        return mValid;
+    }
+    bool matches(const QDate &date) const;
+    bool matches(const KDateTime &dt) const;
+
+private:
+    enum Field {
+        MonthField = 0x01,
+        MonthDayField = 0x02,
+        YearDayField = 0x04,
+        WeekNumberField = 0x08,
+        WeekdayField = 0x10,
+        HourField = 0x20,
+        MinuteField = 0x40,
+        SecondField = 0x80
+    };
+
+    static uint fields(const Constraint &c);
+    static bool setBit(quint64 *bits, int n, int max);
+    static bool setSignedBit(quint64 *positive, quint64 *negative, int n, int max);
+    static bool testBit(const quint64 *bits, int n)
+    {
+        return bits[n >> 6] & (Q_UINT64_C(1) << (n & 63));
+    }
+    static int countBits(const quint64 *bits, int words);
+
+    bool mValid;
+    bool mMonthPositions;       // BYDAY positions are counted in the month, not the year
+    uint mFields;               // the Fields which are constrained
+    short mWeekStart;
+    quint64 mMonths;
+    quint64 mMonthDays[2];      // bit n of [0]: day n, of [1]: n-th last day
+    quint64 mYearDays[2][6];    // bit n of [0]: day n, of [1]: n-th last day
+    quint64 mWeekNumbers[2];    // bit n of [0]: week n, of [1]: n-th last week
+    quint64 mWeekdays[8][2];    // for each weekday, bit n of [0]: n-th one,
+                                // of [1]: n-th last one, bit 0 of [0]: any
+    quint64 mHours;
+    quint64 mMinutes;
+    quint64 mSeconds;
+};
+
+ConstraintMatcher::ConstraintMatcher()
+    : mValid(false),
+      mMonthPositions(false),
+      mFields(0),
+      mWeekStart(1),
+      mMonths(0),
+      mHours(0),
+      mMinutes(0),
+      mSeconds(0)
+{
+    for (int i = 0; i < 2; ++i) {
+        mMonthDays[i] = 0;
+        mWeekNumbers[i] = 0;
+        for (int j = 0; j < 6; ++j) {
+            mYearDays[i][j] = 0;
+        }
+        for (int j = 0; j < 8; ++j) {
+            mWeekdays[j][i] = 0;
+        }
+    }
+}
+
+uint ConstraintMatcher::fields(const Constraint &c)
+{
+    return (c.month != 0 ? MonthField : 0) |
+           (c.day != 0 ? MonthDayField : 0) |
+           (c.yearday != 0 ? YearDayField : 0) |
+           (c.weeknumber != 0 ? WeekNumberField : 0) |
+           (c.weekday != 0 || c.weekdaynr != 0 ? WeekdayField : 0) |
+           (c.hour >= 0 ? HourField : 0) |
+           (c.minute >= 0 ? MinuteField : 0) |
+           (c.second >= 0 ? SecondField : 0);
+}
+
+bool ConstraintMatcher::setBit(quint64 *bits, int n, int max)
+{
+    if (n < 0 || n > max) {
+        return false;
+    }
+    bits[n >> 6] |= Q_UINT64_C(1) << (n & 63);
+    return true;
+}
+
+bool ConstraintMatcher::setSignedBit(quint64 *positive, quint64 *negative, int n, int max)
+{
+    if (n == 0) {
+        return false;
+    }
+    return n > 0 ? setBit(positive, n, max) : setBit(negative, -n, max);
+}
+
+int ConstraintMatcher::countBits(const quint64 *bits, int words)
+{
+    int count = 0;
+    for (int i = 0; i < words; ++i) {
+        count += qPopulationCount(bits[i]);
+    }
+    return count;
+}
+
+void ConstraintMatcher::build(const Constraint::List &constraints,
+                              RecurrenceRule::PeriodType type)
+{
+    *this = ConstraintMatcher();
+    if (constraints.isEmpty()) {
+        return;
+    }
+    const Constraint &first = constraints.first();
+    mFields = fields(first);
+    mWeekStart = first.weekstart;
+    // If it's a yearly recurrence and a month is given, the position is
+    // still in the month, not in the year.
+    mMonthPositions = type == RecurrenceRule::rMonthly ||
+                      (type == RecurrenceRule::rYearly && first.month > 0);
+
+    foreach (const Constraint &c, constraints) {
+        if (fields(c) != mFields || c.year > 0 || c.secondOccurrence ||
+                c.weekstart != mWeekStart) {
+            return;
+        }
+        if (((mFields & MonthField) && !setBit(&mMonths, c.month, 12)) ||
+                ((mFields & MonthDayField) &&
+                 !setSignedBit(&mMonthDays[0], &mMonthDays[1], c.day, 31)) ||
+                ((mFields & YearDayField) &&
+                 !setSignedBit(mYearDays[0], mYearDays[1], c.yearday, 366)) ||
+                ((mFields & WeekNumberField) &&
+                 !setSignedBit(&mWeekNumbers[0], &mWeekNumbers[1], c.weeknumber, 53)) ||
+                ((mFields & HourField) && !setBit(&mHours, c.hour, 23)) ||
+                ((mFields & MinuteField) && !setBit(&mMinutes, c.minute, 59)) ||
+                ((mFields & SecondField) && !setBit(&mSeconds, c.second, 59))) {
+            return;
+        }
+        if (mFields & WeekdayField) {
+            if (c.weekday < 1 || c.weekday > 7) {
+                return;
+            }
+            quint64 *positions = mWeekdays[c.weekday];
+            if (c.weekdaynr == 0) {
+                positions[0] |= 1;
+            } else if (!setSignedBit(&positions[0], &positions[1], c.weekdaynr, 53)) {
+                return;
+            }
+        }
+    }
+
+    // The constraints are all different, so they are the cross product of the
+    // allowed values if there are as many of them as combinations of values
+    qint64 combinations = 1;
+    if (mFields & MonthField) {
+        combinations *= countBits(&mMonths, 1);
+    }
+    if (mFields & MonthDayField) {
+        combinations *= countBits(mMonthDays, 2);
+    }
+    if (mFields & YearDayField) {
+        combinations *= countBits(mYearDays[0], 6) + countBits(mYearDays[1], 6);
+    }
+    if (mFields & WeekNumberField) {
+        combinations *= countBits(mWeekNumbers, 2);
+    }
+    if (mFields & WeekdayField) {
+        int count = 0;
+        for (int weekday = 1; weekday <= 7; ++weekday) {
+            count += countBits(mWeekdays[weekday], 2);
+        }
+        combinations *= count;
+    }
+    if (mFields & HourField) {
+        combinations *= countBits(&mHours, 1);
+    }
+    if (mFields & MinuteField) {
+        combinations *= countBits(&mMinutes, 1);
+    }
+    if (mFields & SecondField) {
+        combinations *= countBits(&mSeconds, 1);
+    }
+    mValid = combinations == constraints.count();
+}
+
+bool ConstraintMatcher::matches(const QDate &date) const
+{
+    if ((mFields & MonthField) && !testBit(&mMonths, date.month())) {
+        return false;
+    }
+    if (mFields & MonthDayField) {
+        const int day = date.day();
+        if (!testBit(&mMonthDays[0], day) &&
+                !testBit(&mMonthDays[1], date.daysInMonth() - day + 1)) {
+            return false;
+        }
+    }
+    if (mFields & YearDayField) {
+        const int day = date.dayOfYear();
+        if (!testBit(mYearDays[0], day) &&
+                !testBit(mYearDays[1], date.daysInYear() - day + 1)) {
+            return false;
+        }
+    }
+    if (mFields & WeekNumberField) {
+        int year;
+        if (!testBit(&mWeekNumbers[0], DateHelper::getWeekNumber(date, mWeekStart, &year)) &&
+                !testBit(&mWeekNumbers[1], -DateHelper::getWeekNumberNeg(date, mWeekStart, &year))) {
+            return false;
+        }
+    }
+    if (mFields & WeekdayField) {
+        const quint64 *positions = mWeekdays[date.dayOfWeek()];
+        if (!(positions[0] & 1)) {
+            int position;
+            int lastPosition;
+            if (mMonthPositions) {
+                position = (date.day() - 1) / 7 + 1;
+                lastPosition = (date.daysInMonth() - date.day()) / 7 + 1;
+            } else {
+                position = (date.dayOfYear() - 1) / 7 + 1;
+                lastPosition = (date.daysInYear() - date.dayOfYear()) / 7 + 1;
+            }
+            if (!testBit(&positions[0], position) && !testBit(&positions[1], lastPosition)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ConstraintMatcher::matches(const KDateTime &dt) const
+{
+    const QTime time = dt.time();
+    if (((mFields & HourField) &&
+            (dt.isSecondOccurrence() || !testBit(&mHours, time.hour()))) ||
+            ((mFields & MinuteField) && !testBit(&mMinutes, time.minute())) ||
+            ((mFields & SecondField) && !testBit(&mSeconds, time.second()))) {
+        return false;
+    }
+    return matches(dt.date());
+}
+
+// The constraints of a rule and their matcher
+class CompiledConstraints
+{
+public:
+    CompiledConstraints(const Constraint::List &constraints, RecurrenceRule::PeriodType type)
+        : mConstraints(constraints),
+          mType(type),
+          mHours(0),
+          mMinutes(0),
+          mSeconds(0)
+    {
+        mMatcher.build(mConstraints, mType);
+        for (int i = 0, iend = mConstraints.count();  i < iend;  ++i) {
+            const Constraint &c = mConstraints[i];
+            mHours |= (c.hour < 0) ? ~Q_UINT64_C(0) : (c.hour < 64) ? Q_UINT64_C(1) << c.hour : 0;
+            mMinutes |= (c.minute < 0) ? ~Q_UINT64_C(0) : (c.minute < 64) ? Q_UINT64_C(1) << c.minute : 0;
+            mSeconds |= (c.second < 0) ? ~Q_UINT64_C(0) : (c.second < 64) ? Q_UINT64_C(1) << c.second : 0;
+        }
+    }
+
+    // Whether a date or date/time matches at least one of the constraints
+    template<class T>
+    bool matches(const T &dt) const
+    {
+        if (mMatcher.isValid()) {
+            return mMatcher.matches(dt);
+        }
+        for (int i = 0, iend = mConstraints.count();  i < iend;  ++i) {
+            if (mConstraints[i].matches(dt, mType)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether any of the constraints accepts an hour, minute or second
+    bool acceptsHour(int hour) const
+    {
+        return mHours & (Q_UINT64_C(1) << hour);
+    }
+    bool acceptsMinute(int minute) const
+    {
+        return mMinutes & (Q_UINT64_C(1) << minute);
+    }
+    bool acceptsSecond(int second) const
+    {
+        return mSeconds & (Q_UINT64_C(1) << second);
+    }
+
+    const Constraint::List mConstraints;
+    const RecurrenceRule::PeriodType mType;
+    ConstraintMatcher mMatcher;
+    quint64 mHours;     // bit n: hour n is accepted
+    quint64 mMinutes;   // bit n: minute n is accepted
+    quint64 mSeconds;   // bit n: second n is accepted
+};
+//@endcond
+
+/**************************************************************************
+ *                               RuleRegistry                             *
+ **************************************************************************/
+
+//@cond PRIVATE
+// Process-wide registry of the data which rules compile from their
+// definition, so that all the rules with the same definition share a single
+// copy of it. The registry only holds weak references: the data is deleted
+// with the last rule using it, and the expired entries are purged as the
+// registry grows.
+template<class T>
+class RuleRegistry
+{
+public:
+    RuleRegistry()
+        : mPurgeSize(64)
+    {
+    }
+
+    // Returns the data registered for key, or null if there is none.
+    QSharedPointer<T> find(const QByteArray &key)
+    {
+        QMutexLocker locker(&mMutex);
+        return mEntries.value(key).toStrongRef();
+    }
+
+    // Returns the data registered for key, or registers and returns value
+    // if there is none. Use find() first to avoid building value needlessly.
+    QSharedPointer<T> intern(const QByteArray &key, const QSharedPointer<T> &value)
+    {
+        QMutexLocker locker(&mMutex);
+        QSharedPointer<T> shared = mEntries.value(key).toStrongRef();
+        if (shared) {
+            return shared;
+        }
+        if (mEntries.count() >= mPurgeSize) {
+            for (typename QHash<QByteArray, QWeakPointer<T> >::Iterator it = mEntries.begin();
+                    it != mEntries.end();) {
+                if (it.value().isNull()) {
+                    it = mEntries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            mPurgeSize = qMax(64, 2 * mEntries.count());
+        }
+        mEntries.insert(key, value.toWeakRef());
+        return value;
+    }
+
+private:
+    QHash<QByteArray, QWeakPointer<T> > mEntries;
+    int mPurgeSize;
+    QMutex mMutex;
+};
+
+// The occurrence caches of a rule, shared by the rules with the same
+// definition. They are built lazily by const methods: mCached is only set,
+// with release semantics, once the other members have been filled in under
+// mCacheMutex, so concurrent readers never see a partial cache. The
+// date/times are stored through shareable(), as readers in other threads
+// compare and convert them.
+class OccurrenceCache
+{
+public:
+    OccurrenceCache()
+        : mCached(false),
+          mEndCached(false)
+    {
+    }
+
+    // Cache for duration
+    DateTimeList mCachedDates;
+    KDateTime mCachedDateEnd;
+    KDateTime mCachedLastDate;   // when mCachedDateEnd invalid, last date checked
+    QAtomicInt mCached;
+    QMutex mCacheMutex;
+
+    // End of a rule with a count, found without building the cache above.
+    // It is also guarded by mCacheMutex, and mEndCached is set like mCached.
+    KDateTime mEndDate;          // invalid if there are not enough occurrences
+    QAtomicInt mEndCached;
+
+    // Cache for rules without end: all the occurrences from mWindowStart to
+    // mWindowEnd inclusive. It is also guarded by mCacheMutex.
+    DateTimeList mWindowDates;
+    KDateTime mWindowStart;
+    KDateTime mWindowEnd;
+};
+
+// Returns a copy of a date/time which can be read by several threads.
+// KDateTime copies share their data, in which conversions, e.g. when
+// comparing date/times in different time specs, cache the UTC value. The copy
+// gets its own data with that cache already filled in, so reading it never
+// writes to it.
+static KDateTime shareable(const KDateTime &dt)
+{
+    KDateTime copy(dt);
+    copy.detach();
+    copy.toUtc();
+    return copy;
+}
+
+static DateTimeList shareable(const DateTimeList &list)
+{
+    DateTimeList result;
+    result.reserve(list.count());
+    for (int i = 0, iend = list.count();  i < iend;  ++i) {
+        result += shareable(list[i]);
+    }
+    return result;
+}
+
+typedef QSharedPointer<const CompiledConstraints> SharedConstraints;
+
+// The registry keys only hold the name of a time zone, and calendars may
+// define different zones with the same name, so the keys of rules in a time
+// zone also hold the definition of the zone: its phases and transitions.
+static void writeTimeZone(QDataStream &out, const KDateTime::Spec &spec)
+{
+    if (spec.type() != KDateTime::TimeZone) {
+        return;
+    }
+    const KTimeZone zone = spec.timeZone();
+    const QList<KTimeZone::Phase> phases = zone.phases();
+    out << static_cast<quint32>(phases.count());
+    foreach (const KTimeZone::Phase &phase, phases) {
+        out << phase.utcOffset() << phase.isDst() << phase.abbreviations();
+    }
+    const QList<KTimeZone::Transition> transitions = zone.transitions();
+    out << static_cast<quint32>(transitions.count());
+    foreach (const KTimeZone::Transition &transition, transitions) {
+        out << transition.time() << transition.phase().utcOffset()
+            << transition.phase().isDst() << transition.phase().abbreviations();
+    }
+}
+
+static SharedConstraints internConstraints(const Constraint::List &constraints,
+        RecurrenceRule::PeriodType type, const KDateTime::Spec &spec)
+{
+    static RuleRegistry<const CompiledConstraints> registry;
+
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out << static_cast<quint32>(type) << constraints;
+    writeTimeZone(out, spec);
+    SharedConstraints shared = registry.find(key);
+    if (shared) {
+        return shared;
+    }
+    return registry.intern(key, SharedConstraints(new CompiledConstraints(constraints, type)));
+}
+
+static QSharedPointer<OccurrenceCache> internOccurrenceCache(const QByteArray &definition)
+{
+    static RuleRegistry<OccurrenceCache> registry;
+    QSharedPointer<OccurrenceCache> shared = registry.find(definition);
+    if (shared) {
+        return shared;
+    }
+    return registry.intern(definition, QSharedPointer<OccurrenceCache>(new OccurrenceCache));
+}
 //@endcond
 
 /**************************************************************************
@@ -729,11 +1401,42 @@ public:
     bool operator==(const Private &other) const;
     void clear();
     void setDirty();
+    void ensureCompiled() const;
+    void compile();
+    QByteArray definition() const;
     void buildConstraints();
     bool buildCache() const;
+    void buildEndDate() const;
+    int countOccurrences(const KDateTime &to, int limit, KDateTime *last) const;
     Constraint getNextValidDateInterval(const KDateTime &preDate, PeriodType type) const;
     Constraint getPreviousValidDateInterval(const KDateTime &afterDate, PeriodType type) const;
+    bool skipIntervals(Constraint &interval, bool backwards) const;
+    EpochList epochsForInterval(const Constraint &interval, PeriodType type,
+                                const EpochTable &table) const;
     DateTimeList datesForInterval(const Constraint &interval, PeriodType type) const;
+    DateTimeList datesInInterval(const KDateTime &start, const KDateTime &enddt,
+                                 const KDateTime &end, bool *complete = 0) const;
+
+    // Occurrence window of rules without end, see windowDates()
+    KDateTime addPeriods(const KDateTime &dt, int periods) const;
+    DateTimeList windowDates(const KDateTime &start, const KDateTime &end) const;
+    bool windowNextDate(const KDateTime &dt, KDateTime &next) const;
+    bool windowPreviousDate(const KDateTime &dt, KDateTime &previous) const;
+
+    // Closed-form evaluation of simple rules, see buildSimpleRule()
+    void buildSimpleRule();
+    int simplePeriodIndex(const QDate &date) const;
+    QDate simplePeriodStart(int period) const;
+    QDate simplePeriodEnd(int period) const;
+    bool simpleDayMatches(const QDate &date) const;
+    bool simpleDateMatches(const QDate &date) const;
+    QDate simpleNextDate(const QDate &date) const;
+    QDate simplePreviousDate(const QDate &date) const;
+    int simpleCountBefore(const QDate &date) const;
+    QDate simpleNthDate(int n) const;
+    KDateTime simpleDateTime(const QDate &date) const;
+    KDateTime simpleNextDateTime(const KDateTime &dt, bool inclusive) const;
+    KDateTime simplePreviousDateTime(const KDateTime &dt, bool inclusive) const;
 
     RecurrenceRule *mParent;
     QString mRRule;            // RRULE string
@@ -760,19 +1463,27 @@ public:
     QList<int> mBySetPos;      // values: position -366 to -1 and 1-366
     short mWeekStart;               // first day of the week (1=Monday, 7=Sunday)
 
-    Constraint::List mConstraints;
+    // Compiled from the definition above on first use, see ensureCompiled(),
+    // and shared with the identical rules
+    SharedConstraints mConstraints;
+    QSharedPointer<OccurrenceCache> mCache;
+    mutable QAtomicInt mCompiled;
+    mutable QMutex mCompileMutex;
     QList<RuleObserver *> mObservers;
 
-    // Cache for duration
-    mutable DateTimeList mCachedDates;
-    mutable KDateTime mCachedDateEnd;
-    mutable KDateTime mCachedLastDate;   // when mCachedDateEnd invalid, last date checked
-    mutable bool mCached;
-
     bool mIsReadOnly;
     bool mAllDay;
     bool mNoByRules;        // no BySeconds, ByMinutes, ... rules exist
     uint mTimedRepetition;  // repeats at a regular number of seconds interval, or 0
+
+    // A daily, weekly or monthly rule which only selects days, and so recurs
+    // at most once a day at the time of mDateStart. Its occurrences are
+    // computed directly instead of through the constraints.
+    bool mSimple;
+    QTime mSimpleTime;      // time of the occurrences
+    QDate mSimpleFirstDate; // first date which can have an occurrence
+    uint mSimpleDays;       // bit n: weekday n (daily, weekly) or month day n (monthly)
+    uint mSimpleLastDays;   // bit n: n-th last day of the month (monthly)
 };
 
 RecurrenceRule::Private::Private(RecurrenceRule *parent, const Private &p)
@@ -838,6 +1549,8 @@ RecurrenceRule::Private &RecurrenceRule::Private::operator=(const Private &p)
 
 bool RecurrenceRule::Private::operator==(const Private &r) const
 {
+    ensureCompiled();
+    r.ensureCompiled();
     return
         mPeriod == r.mPeriod &&
         ((mDateStart == r.mDateStart) ||
@@ -884,23 +1597,62 @@ void RecurrenceRule::Private::clear()
 
 void RecurrenceRule::Private::setDirty()
 {
-    buildConstraints();
-    mCached = false;
-    mCachedDates.clear();
+    // Setters often come in a row, e.g. when parsing, so only compile the
+    // rule once it is queried
+    mCompiled.storeRelease(0);
     for (int i = 0, iend = mObservers.count();  i < iend;  ++i) {
         if (mObservers[i]) {
             mObservers[i]->recurrenceChanged(mParent);
         }
     }
 }
-//@endcond
-
-/**************************************************************************
- *                              RecurrenceRule                            *
- **************************************************************************/
 
-RecurrenceRule::RecurrenceRule()
-    : d(new Private(this))
+// Compiles the rule if it changed since it was last compiled. Queries are
+// const and may run concurrently, so this is done under a lock, and
+// mCompiled is only set once the compiled data is complete.
+void RecurrenceRule::Private::ensureCompiled() const
+{
+    if (mCompiled.loadAcquire()) {
+        return;
+    }
+    QMutexLocker locker(&mCompileMutex);
+    if (!mCompiled.load()) {
+        const_cast<Private *>(this)->compile();
+        mCompiled.storeRelease(1);
+    }
+}
+
+// Look up the compiled form of the rule, sharing it with the rules which
+// have the same definition. Occurrence caches hold absolute date/times, so
+// they are only shared by rules with the same start.
+void RecurrenceRule::Private::compile()
+{
+    buildConstraints();
+    buildSimpleRule();
+    mCache = internOccurrenceCache(definition());
+}
+
+// Serialize everything which the occurrences depend on
+QByteArray RecurrenceRule::Private::definition() const
+{
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out << static_cast<quint32>(mPeriod) << mDateStart << mFrequency << mDuration << mDateEnd
+        << mBySeconds << mByMinutes << mByHours << mByDays << mByMonthDays
+        << mByYearDays << mByWeekNumbers << mByMonths << mBySetPos
+        << mWeekStart << mAllDay;
+    writeTimeZone(out, mDateStart.timeSpec());
+    writeTimeZone(out, mDateEnd.timeSpec());
+    return key;
+}
+//@endcond
+
+/**************************************************************************
+ *                              RecurrenceRule                            *
+ **************************************************************************/
+
+RecurrenceRule::RecurrenceRule()
+    : d(new Private(this))
 {
 }
 
@@ -956,6 +1708,7 @@ void RecurrenceRule::setRecurrenceType(PeriodType period)
 
 KDateTime RecurrenceRule::endDt(bool *result) const
 {
+    d->ensureCompiled();
     if (result) {
         *result = false;
     }
@@ -972,17 +1725,17 @@ KDateTime RecurrenceRule::endDt(bool *result) const
         return d->mDateEnd;
     }
 
-    // N occurrences. Check if we have a full cache. If so, return the cached end date.
-    if (!d->mCached) {
-        // If not enough occurrences can be found (i.e. inconsistent constraints)
-        if (!d->buildCache()) {
-            return KDateTime();
-        }
+    // N occurrences. The end date is found once, without caching all the
+    // occurrences unless they already are.
+    if (!d->mCache->mEndCached.loadAcquire()) {
+        d->buildEndDate();
     }
+    // If not enough occurrences can be found (i.e. inconsistent constraints),
+    // the end date is invalid
     if (result) {
-        *result = true;
+        *result = d->mCache->mEndDate.isValid();
     }
-    return d->mCachedDateEnd;
+    return d->mCache->mEndDate;
 }
 
 void RecurrenceRule::setEndDt(const KDateTime &dateTime)
@@ -1203,12 +1956,12 @@ void RecurrenceRule::Private::buildConstraints()
 {
     mTimedRepetition = 0;
     mNoByRules = mBySetPos.isEmpty();
-    mConstraints.clear();
+    Constraint::List constraints;
     Constraint con(mDateStart.timeSpec());
     if (mWeekStart > 0) {
         con.setWeekstart(mWeekStart);
     }
-    mConstraints.append(con);
+    constraints.append(con);
 
     int c, cend;
     int i, iend;
@@ -1219,19 +1972,19 @@ void RecurrenceRule::Private::buildConstraints()
         mNoByRules = false; \
         iend = list.count(); \
         if ( iend == 1 ) { \
-            for ( c = 0, cend = mConstraints.count();  c < cend;  ++c ) { \
-                mConstraints[c].setElement( list[0] ); \
+            for ( c = 0, cend = constraints.count();  c < cend;  ++c ) { \
+                constraints[c].setElement( list[0] ); \
             } \
         } else { \
-            tmp.reserve(mConstraints.count() * iend); \
-            for ( c = 0, cend = mConstraints.count();  c < cend;  ++c ) { \
+            tmp.reserve(constraints.count() * iend); \
+            for ( c = 0, cend = constraints.count();  c < cend;  ++c ) { \
                 for ( i = 0;  i < iend;  ++i ) { \
-                    con = mConstraints[c]; \
+                    con = constraints[c]; \
                     con.setElement( list[i] ); \
                     tmp.append( con ); \
                 } \
             } \
-            mConstraints = tmp; \
+            constraints = tmp; \
             tmp.clear(); \
         } \
     }
@@ -1247,23 +2000,23 @@ void RecurrenceRule::Private::buildConstraints()
 
     if (!mByDays.isEmpty()) {
         mNoByRules = false;
-        tmp.reserve(mConstraints.count() * mByDays.count());
-        for (c = 0, cend = mConstraints.count();  c < cend;  ++c) {
+        tmp.reserve(constraints.count() * mByDays.count());
+        for (c = 0, cend = constraints.count();  c < cend;  ++c) {
             for (i = 0, iend = mByDays.count();  i < iend;  ++i) {
-                con = mConstraints[c];
+                con = constraints[c];
                 con.setWeekday(mByDays[i].day());
                 con.setWeekdaynr(mByDays[i].pos());
                 tmp.append(con);
             }
         }
-        mConstraints = tmp;
+        constraints = tmp;
         tmp.clear();
     }
 
 #define fixConstraint( setElement, value ) \
     { \
-        for ( c = 0, cend = mConstraints.count();  c < cend;  ++c ) { \
-            mConstraints[c].setElement( value );                        \
+        for ( c = 0, cend = constraints.count();  c < cend;  ++c ) { \
+            constraints[c].setElement( value );                        \
         } \
     }
     // Now determine missing values from DTSTART. This can speed up things,
@@ -1321,15 +2074,16 @@ void RecurrenceRule::Private::buildConstraints()
             break;
         }
     } else {
-        for (c = 0, cend = mConstraints.count(); c < cend;) {
-            if (mConstraints[c].isConsistent(mPeriod)) {
+        for (c = 0, cend = constraints.count(); c < cend;) {
+            if (constraints[c].isConsistent(mPeriod)) {
                 ++c;
             } else {
-                mConstraints.removeAt(c);
+                constraints.removeAt(c);
                 --cend;
             }
         }
     }
+    mConstraints = internConstraints(constraints, mPeriod, mDateStart.timeSpec());
 }
 
 // Build and cache a list of all occurrences.
@@ -1337,63 +2091,153 @@ void RecurrenceRule::Private::buildConstraints()
 bool RecurrenceRule::Private::buildCache() const
 {
     Q_ASSERT(mDuration > 0);
+    QMutexLocker locker(&mCache->mCacheMutex);
+    if (mCache->mCached.load()) {
+        // Built by another thread while we were waiting for the lock
+        return mCache->mCachedDateEnd.isValid();
+    }
+
+    if (mSimple) {
+        DateTimeList dts;
+        QDate date = simpleNextDate(mSimpleFirstDate);
+        for (; date.isValid() && dts.count() < mDuration; date = simpleNextDate(date.addDays(1))) {
+            dts += simpleDateTime(date);
+        }
+        mCache->mCachedDates = shareable(dts);
+        const bool complete = (int(dts.count()) == mDuration);
+        mCache->mCachedDateEnd = complete ? mCache->mCachedDates.last() : KDateTime();
+        mCache->mCachedLastDate = dts.isEmpty() ? shareable(mDateStart) : mCache->mCachedDates.last();
+        mCache->mCached.storeRelease(true);
+        return complete;
+    }
+
     // Build the list of all occurrences of this event (we need that to determine
     // the end date!)
     Constraint interval(getNextValidDateInterval(mDateStart, mPeriod));
-    QDateTime next;
+    const EpochTable table(interval.timespec);
 
-    DateTimeList dts = datesForInterval(interval, mPeriod);
+    EpochList epochs = epochsForInterval(interval, mPeriod, table);
     // Only use dates after the event has started (start date is only included
     // if it matches)
-    int i = dts.findLT(mDateStart);
-    if (i >= 0) {
-        dts.erase(dts.begin(), dts.begin() + i + 1);
+    const EpochTime first = table.lowerBound(mDateStart);
+    int i = 0;
+    while (i < epochs.count() && table.lessThan(epochs[i], first)) {
+        ++i;
     }
+    epochs.erase(epochs.begin(), epochs.begin() + i);
 
     // some validity checks to avoid infinite loops (i.e. if we have
     // done this loop already 10000 times, bail out )
-    for (int loopnr = 0; loopnr < LOOP_LIMIT && dts.count() < mDuration; ++loopnr) {
+    for (int loopnr = 0; loopnr < LOOP_LIMIT && epochs.count() < mDuration; ++loopnr) {
         interval.increase(mPeriod, mFrequency);
+        if (!skipIntervals(interval, false)) {
+            break;
+        }
         // The returned date list is already sorted!
-        dts += datesForInterval(interval, mPeriod);
+        epochs += epochsForInterval(interval, mPeriod, table);
     }
-    if (dts.count() > mDuration) {
+    if (epochs.count() > mDuration) {
         // we have picked up more occurrences than necessary, remove them
-        dts.erase(dts.begin() + mDuration, dts.end());
+        epochs.erase(epochs.begin() + mDuration, epochs.end());
     }
-    mCached = true;
-    mCachedDates = dts;
+    const DateTimeList dts = shareable(table.dateTimes(epochs));
+    mCache->mCachedDates = dts;
 
 // it = dts.begin();
 // while ( it != dts.end() ) {
 //   qCDebug(KCALCORE_LOG) << "            -=>" << dumpTime(*it);
 //   ++it;
 // }
-    if (int(dts.count()) == mDuration) {
-        mCachedDateEnd = dts.last();
-        return true;
+    const bool complete = (int(dts.count()) == mDuration);
+    if (complete) {
+        mCache->mCachedDateEnd = dts.last();
     } else {
         // The cached date list is incomplete
-        mCachedDateEnd = KDateTime();
-        mCachedLastDate = interval.intervalDateTime(mPeriod);
-        return false;
+        mCache->mCachedDateEnd = KDateTime();
+        mCache->mCachedLastDate = shareable(interval.intervalDateTime(mPeriod));
+    }
+    mCache->mCached.storeRelease(true);
+    return complete;
+}
+
+// Find the end date of a rule with a count. It is computed directly for
+// timed and simple rules, and by counting the occurrences otherwise.
+// Only call buildEndDate() if mDuration > 0.
+void RecurrenceRule::Private::buildEndDate() const
+{
+    Q_ASSERT(mDuration > 0);
+    QMutexLocker locker(&mCache->mCacheMutex);
+    if (mCache->mEndCached.load()) {
+        // Found by another thread while we were waiting for the lock
+        return;
+    }
+
+    KDateTime end;
+    if (mCache->mCached.load()) {
+        end = mCache->mCachedDateEnd;
+    } else if (mTimedRepetition) {
+        end = mDateStart.addSecs(static_cast<qint64>(mDuration - 1) * mTimedRepetition);
+    } else if (mSimple) {
+        const QDate date = simpleNthDate(mDuration);
+        if (date.isValid()) {
+            end = simpleDateTime(date);
+        }
+    } else {
+        KDateTime last;
+        if (countOccurrences(KDateTime(), mDuration, &last) == mDuration) {
+            end = last;
+        }
     }
+    mCache->mEndDate = shareable(end);
+    mCache->mEndCached.storeRelease(true);
+}
+
+// Count the occurrences from the start of the rule up to a date/time, or up
+// to the loop limit if it is invalid, stopping once 'limit' are found. The
+// last one counted is returned in 'last'.
+int RecurrenceRule::Private::countOccurrences(const KDateTime &to, int limit, KDateTime *last) const
+{
+    Constraint interval(getNextValidDateInterval(mDateStart, mPeriod));
+    const EpochTable table(interval.timespec);
+    const EpochTime first = table.lowerBound(mDateStart);
+    const EpochTime end = table.upperBound(to);
+    EpochTime lastTime = first;
+    int count = 0;
+    bool more = skipIntervals(interval, false);
+    for (int loop = 0;  more && loop < LOOP_LIMIT;  ++loop) {
+        const EpochList dts = epochsForInterval(interval, mPeriod, table);
+        for (int i = 0, iend = dts.count();  i < iend && more;  ++i) {
+            if (table.lessThan(dts[i], first)) {
+                continue;
+            }
+            if (table.lessThan(end, dts[i])) {
+                more = false;
+            } else {
+                lastTime = dts[i];
+                more = (++count < limit);
+            }
+        }
+        interval.increase(mPeriod, mFrequency);
+        more = more && skipIntervals(interval, false) &&
+               (!to.isValid() || !(to < interval.intervalDateTime(mPeriod)));
+    }
+    if (last && count > 0) {
+        *last = table.dateTime(lastTime);
+    }
+    return count;
 }
 //@endcond
 
 bool RecurrenceRule::dateMatchesRules(const KDateTime &kdt) const
 {
+    d->ensureCompiled();
     KDateTime dt = kdt.toTimeSpec(d->mDateStart.timeSpec());
-    for (int i = 0, iend = d->mConstraints.count();  i < iend;  ++i) {
-        if (d->mConstraints[i].matches(dt, recurrenceType())) {
-            return true;
-        }
-    }
-    return false;
+    return d->mConstraints->matches(dt);
 }
 
 bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec) const
 {
+    d->ensureCompiled();
     int i, iend;
 
     if (!qd.isValid() || !d->mDateStart.isValid()) {
@@ -1416,13 +2260,13 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
             }
         }
 
+        if (d->mSimple) {
+            return d->simpleDateMatches(qd);
+        }
+
         // The date must be in an appropriate interval (getNextValidDateInterval),
         // Plus it must match at least one of the constraints
-        bool match = false;
-        for (i = 0, iend = d->mConstraints.count();  i < iend && !match;  ++i) {
-            match = d->mConstraints[i].matches(qd, recurrenceType());
-        }
-        if (!match) {
+        if (!d->mConstraints->matches(qd)) {
             return false;
         }
 
@@ -1452,6 +2296,7 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
     // It's a date-time rule, so we need to take the time specification into account.
     KDateTime start(qd, QTime(0, 0, 0), timeSpec);
     KDateTime end = start.addDays(1).toTimeSpec(d->mDateStart.timeSpec());
+    const KDateTime dayEnd = end;
     start = start.toTimeSpec(d->mDateStart.timeSpec());
     if (end < d->mDateStart) {
         return false;
@@ -1479,6 +2324,12 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
         return start.addSecs(d->mTimedRepetition - n) < end;
     }
 
+    if (d->mSimple) {
+        // An occurrence at the very end of the day belongs to the next day
+        const KDateTime next = d->simpleNextDateTime(start, true);
+        return next.isValid() && next <= end && next < dayEnd;
+    }
+
     // Find the start and end dates in the time spec for the rule
     QDate startDay = start.date();
     QDate endDay = end.addSecs(-1).date();
@@ -1487,11 +2338,8 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
     // The date must be in an appropriate interval (getNextValidDateInterval),
     // Plus it must match at least one of the constraints
     bool match = false;
-    for (i = 0, iend = d->mConstraints.count();  i < iend && !match;  ++i) {
-        match = d->mConstraints[i].matches(startDay, recurrenceType());
-        for (int day = 1;  day < dayCount && !match;  ++day) {
-            match = d->mConstraints[i].matches(startDay.addDays(day), recurrenceType());
-        }
+    for (int day = 0;  day < dayCount && !match;  ++day) {
+        match = d->mConstraints->matches(startDay.addDays(day));
     }
     if (!match) {
         return false;
@@ -1523,7 +2371,7 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
         DateTimeList dts = d->datesForInterval(interval, recurrenceType());
         int i = dts.findGE(start);
         if (i >= 0) {
-            return dts[i] <= end;
+            return dts[i] <= end && dts[i] < dayEnd;
         }
         interval.increase(recurrenceType(), frequency());
     } while (interval.intervalDateTime(recurrenceType()) < end);
@@ -1533,6 +2381,7 @@ bool RecurrenceRule::recursOn(const QDate &qd, const KDateTime::Spec &timeSpec)
 
 bool RecurrenceRule::recursAt(const KDateTime &kdt) const
 {
+    d->ensureCompiled();
     // Convert to the time spec used by this recurrence rule
     KDateTime dt(kdt.toTimeSpec(d->mDateStart.timeSpec()));
 
@@ -1552,6 +2401,15 @@ bool RecurrenceRule::recursAt(const KDateTime &kdt) const
         return !(d->mDateStart.secsTo(dt) % d->mTimedRepetition);
     }
 
+    if (d->mSimple) {
+        const QTime time = dt.time();
+        return !dt.isSecondOccurrence() &&
+               time.hour() == d->mSimpleTime.hour() &&
+               time.minute() == d->mSimpleTime.minute() &&
+               time.second() == d->mSimpleTime.second() &&
+               d->simpleDateMatches(dt.date());
+    }
+
     // The date must be in an appropriate interval (getNextValidDateInterval),
     // Plus it must match at least one of the constraints
     if (!dateMatchesRules(dt)) {
@@ -1569,12 +2427,25 @@ bool RecurrenceRule::recursAt(const KDateTime &kdt) const
 
 TimeList RecurrenceRule::recurTimesOn(const QDate &date, const KDateTime::Spec &timeSpec) const
 {
+    d->ensureCompiled();
     TimeList lst;
     if (allDay()) {
         return lst;
     }
     KDateTime start(date, QTime(0, 0, 0), timeSpec);
     KDateTime end = start.addDays(1).addSecs(-1);
+    if (!d->mTimedRepetition && !d->mSimple && d->mDateStart.isValid()) {
+        // Don't look for the times if no day of the interval matches the rule
+        const QDate startDay = start.toTimeSpec(d->mDateStart.timeSpec()).date();
+        const QDate endDay = end.toTimeSpec(d->mDateStart.timeSpec()).date();
+        bool match = false;
+        for (QDate day = startDay;  day <= endDay && !match;  day = day.addDays(1)) {
+            match = d->mConstraints->matches(day);
+        }
+        if (!match) {
+            return lst;
+        }
+    }
     DateTimeList dts = timesInInterval(start, end);     // returns between start and end inclusive
     for (int i = 0, iend = dts.count();  i < iend;  ++i) {
         lst += dts[i].toTimeSpec(timeSpec).time();
@@ -1585,6 +2456,7 @@ TimeList RecurrenceRule::recurTimesOn(const QDate &date, const KDateTime::Spec &
 /** Returns the number of recurrences up to and including the date/time specified. */
 int RecurrenceRule::durationTo(const KDateTime &dt) const
 {
+    d->ensureCompiled();
     // Convert to the time spec used by this recurrence rule
     KDateTime toDate(dt.toTimeSpec(d->mDateStart.timeSpec()));
     // Easy cases:
@@ -1593,13 +2465,39 @@ int RecurrenceRule::durationTo(const KDateTime &dt) const
         return 0;
     }
     // Start date is only included if it really matches
-    if (d->mDuration > 0 && toDate >= endDt()) {
-        return d->mDuration;
+    if (d->mDuration > 0) {
+        bool ok;
+        const KDateTime end = endDt(&ok);
+        if (ok && toDate >= end) {
+            return d->mDuration;
+        }
     }
 
     if (d->mTimedRepetition) {
-        // It's a simple sub-daily recurrence with no constraints
-        return static_cast<int>(d->mDateStart.secsTo(toDate) / d->mTimedRepetition);
+        // It's a simple sub-daily recurrence with no constraints, which
+        // includes the start date/time
+        return static_cast<int>(d->mDateStart.secsTo(toDate) / d->mTimedRepetition) + 1;
+    }
+
+    if (d->mSimple) {
+        if (d->mDuration == 0 && toDate >= d->mDateEnd) {
+            toDate = d->mDateEnd.toTimeSpec(d->mDateStart.timeSpec());
+        }
+        const QDate date = toDate.date();
+        int count = d->simpleCountBefore(date);
+        if (d->simpleDateMatches(date) && !(toDate < d->simpleDateTime(date))) {
+            ++count;
+        }
+        return count;
+    }
+
+    if (d->mDuration > 0) {
+        // Use the cached occurrences if there are any, but don't build them
+        if (d->mCache->mCached.loadAcquire()) {
+            const int i = d->mCache->mCachedDates.findGT(toDate);
+            return (i >= 0) ? i : d->mCache->mCachedDates.count();
+        }
+        return d->countOccurrences(toDate, d->mDuration, 0);
     }
 
     return timesInInterval(d->mDateStart, toDate).count();
@@ -1610,8 +2508,61 @@ int RecurrenceRule::durationTo(const QDate &date) const
     return durationTo(KDateTime(date, QTime(23, 59, 59), d->mDateStart.timeSpec()));
 }
 
+QBitArray RecurrenceRule::recursOnRange(const QDate &from, const QDate &to,
+        const KDateTime::Spec &timeSpec) const
+{
+    d->ensureCompiled();
+    if (!from.isValid() || !to.isValid() || to < from) {
+        return QBitArray();
+    }
+    const int days = static_cast<int>(from.daysTo(to)) + 1;
+    QBitArray result(days);
+    if (!d->mDateStart.isValid()) {
+        return result;
+    }
+
+    // Sub-daily rules are checked one day at a time, as they can have too many
+    // occurrences to list, as are ranges longer than timesInInterval() covers
+    if (d->mTimedRepetition || d->mPeriod == rNone ||
+            (!d->mSimple && d->mPeriod < rDaily) || days > LOOP_LIMIT) {
+        for (int day = 0;  day < days;  ++day) {
+            result.setBit(day, recursOn(from.addDays(day), timeSpec));
+        }
+        return result;
+    }
+
+    // A date-only rule has no time specification, so ignore 'timeSpec'
+    KDateTime start;
+    KDateTime end;
+    if (allDay()) {
+        start = KDateTime(from, QTime(0, 0, 0), d->mDateStart.timeSpec());
+        end = KDateTime(to, QTime(23, 59, 59), d->mDateStart.timeSpec());
+    } else {
+        start = KDateTime(from, QTime(0, 0, 0), timeSpec);
+        end = KDateTime(to.addDays(1), QTime(0, 0, 0), timeSpec).addSecs(-1);
+    }
+    const DateTimeList dts = timesInInterval(start, end);
+    int day = -1;
+    for (int i = 0, iend = dts.count();  i < iend;  ++i) {
+        if (!dts[i].isValid()) {
+            // The list is incomplete: check the remaining days one at a time
+            for (day = qMax(day + 1, 0);  day < days;  ++day) {
+                result.setBit(day, recursOn(from.addDays(day), timeSpec));
+            }
+            break;
+        }
+        const QDate date = allDay() ? dts[i].date() : dts[i].toTimeSpec(timeSpec).date();
+        day = static_cast<int>(from.daysTo(date));
+        if (day >= 0 && day < days) {
+            result.setBit(day);
+        }
+    }
+    return result;
+}
+
 KDateTime RecurrenceRule::getPreviousDate(const KDateTime &afterDate) const
 {
+    d->ensureCompiled();
     // Convert to the time spec used by this recurrence rule
     KDateTime toDate(afterDate.toTimeSpec(d->mDateStart.timeSpec()));
 
@@ -1634,18 +2585,37 @@ KDateTime RecurrenceRule::getPreviousDate(const KDateTime &afterDate) const
         return prev >= d->mDateStart ? prev : KDateTime();
     }
 
+    if (d->mSimple) {
+        if (d->mDuration >= 0 && endDt().isValid() && toDate > endDt()) {
+            return d->simplePreviousDateTime(endDt().toTimeSpec(d->mDateStart.timeSpec()), true);
+        }
+        return d->simplePreviousDateTime(toDate, false);
+    }
+
     // If we have a cache (duration given), use that
     if (d->mDuration > 0) {
-        if (!d->mCached) {
+        if (!d->mCache->mCached.loadAcquire()) {
             d->buildCache();
         }
-        int i = d->mCachedDates.findLT(toDate);
+        int i = d->mCache->mCachedDates.findLT(toDate);
         if (i >= 0) {
-            return d->mCachedDates[i];
+            return d->mCache->mCachedDates.at(i);
         }
         return KDateTime();
     }
 
+    if (d->mDuration < 0 && occurrenceCacheSize() > 0) {
+        KDateTime previous;
+        if (d->windowPreviousDate(toDate, previous)) {
+            return previous;
+        }
+        const DateTimeList dts = d->windowDates(d->addPeriods(toDate, -WINDOW_PERIODS), toDate);
+        const int i = dts.findLT(toDate);
+        if (i >= 0) {
+            return dts[i];
+        }
+    }
+
     KDateTime prev = toDate;
     if (d->mDuration >= 0 && endDt().isValid() && toDate > endDt()) {
         prev = endDt().addSecs(1).toTimeSpec(d->mDateStart.timeSpec());
@@ -1661,6 +2631,9 @@ KDateTime RecurrenceRule::getPreviousDate(const KDateTime &afterDate) const
     // Previous interval. As soon as we find an occurrence, we're done.
     while (interval.intervalDateTime(recurrenceType()) > d->mDateStart) {
         interval.increase(recurrenceType(), -int(frequency()));
+        if (!d->skipIntervals(interval, true)) {
+            break;
+        }
         // The returned date list is sorted
         DateTimeList dts = d->datesForInterval(interval, recurrenceType());
         // The list is sorted, so take the last one.
@@ -1678,6 +2651,7 @@ KDateTime RecurrenceRule::getPreviousDate(const KDateTime &afterDate) const
 
 KDateTime RecurrenceRule::getNextDate(const KDateTime &preDate) const
 {
+    d->ensureCompiled();
     // Convert to the time spec used by this recurrence rule
     KDateTime fromDate(preDate.toTimeSpec(d->mDateStart.timeSpec()));
     // Beyond end of recurrence
@@ -1697,13 +2671,30 @@ KDateTime RecurrenceRule::getNextDate(const KDateTime &preDate) const
         return d->mDuration < 0 || !endDt().isValid() || next <= endDt() ? next : KDateTime();
     }
 
+    if (d->mSimple) {
+        const KDateTime next = d->simpleNextDateTime(fromDate, false);
+        return next.isValid() && (d->mDuration < 0 || next <= endDt()) ? next : KDateTime();
+    }
+
     if (d->mDuration > 0) {
-        if (!d->mCached) {
+        if (!d->mCache->mCached.loadAcquire()) {
             d->buildCache();
         }
-        int i = d->mCachedDates.findGT(fromDate);
+        int i = d->mCache->mCachedDates.findGT(fromDate);
+        if (i >= 0) {
+            return d->mCache->mCachedDates.at(i);
+        }
+    }
+
+    if (d->mDuration < 0 && occurrenceCacheSize() > 0) {
+        KDateTime next;
+        if (d->windowNextDate(fromDate, next)) {
+            return next;
+        }
+        const DateTimeList dts = d->windowDates(fromDate, d->addPeriods(fromDate, WINDOW_PERIODS));
+        const int i = dts.findGT(fromDate);
         if (i >= 0) {
-            return d->mCachedDates[i];
+            return dts[i];
         }
     }
 
@@ -1715,7 +2706,8 @@ KDateTime RecurrenceRule::getNextDate(const KDateTime &preDate) const
         return (d->mDuration < 0 || dts[i] <= end) ? dts[i] : KDateTime();
     }
     interval.increase(recurrenceType(), frequency());
-    if (d->mDuration >= 0 && interval.intervalDateTime(recurrenceType()) > end) {
+    if (!d->skipIntervals(interval, false) ||
+            (d->mDuration >= 0 && interval.intervalDateTime(recurrenceType()) > end)) {
         return KDateTime();
     }
 
@@ -1734,6 +2726,9 @@ KDateTime RecurrenceRule::getNextDate(const KDateTime &preDate) const
             }
         }
         interval.increase(recurrenceType(), frequency());
+        if (!d->skipIntervals(interval, false)) {
+            break;
+        }
     } while (++loop < LOOP_LIMIT &&
              (d->mDuration < 0 || interval.intervalDateTime(recurrenceType()) < end));
     return KDateTime();
@@ -1742,6 +2737,7 @@ KDateTime RecurrenceRule::getNextDate(const KDateTime &preDate) const
 DateTimeList RecurrenceRule::timesInInterval(const KDateTime &dtStart,
         const KDateTime &dtEnd) const
 {
+    d->ensureCompiled();
     const KDateTime start = dtStart.toTimeSpec(d->mDateStart.timeSpec());
     const KDateTime end = dtEnd.toTimeSpec(d->mDateStart.timeSpec());
     DateTimeList result;
@@ -1787,28 +2783,42 @@ DateTimeList RecurrenceRule::timesInInterval(const KDateTime &dtStart,
         return result;
     }
 
+    // Start date is only included if it really matches
     KDateTime st = start;
+    if (st < d->mDateStart) {
+        st = d->mDateStart;
+    }
+
+    if (d->mSimple && enddt.isValid()) {
+        for (KDateTime dt = d->simpleNextDateTime(st, true); dt.isValid() && dt <= enddt;) {
+            result += dt;
+            const QDate date = d->simpleNextDate(dt.date().addDays(1));
+            dt = date.isValid() ? d->simpleDateTime(date) : KDateTime();
+        }
+        return result;
+    }
+
     bool done = false;
     if (d->mDuration > 0) {
-        if (!d->mCached) {
+        if (!d->mCache->mCached.loadAcquire()) {
             d->buildCache();
         }
-        if (d->mCachedDateEnd.isValid() && start > d->mCachedDateEnd) {
+        if (d->mCache->mCachedDateEnd.isValid() && start > d->mCache->mCachedDateEnd) {
             return result;    // beyond end of recurrence
         }
-        int i = d->mCachedDates.findGE(start);
+        int i = d->mCache->mCachedDates.findGE(start);
         if (i >= 0) {
-            int iend = d->mCachedDates.findGT(enddt, i);
+            int iend = d->mCache->mCachedDates.findGT(enddt, i);
             if (iend < 0) {
-                iend = d->mCachedDates.count();
+                iend = d->mCache->mCachedDates.count();
             } else {
                 done = true;
             }
             while (i < iend) {
-                result += d->mCachedDates[i++];
+                result += d->mCache->mCachedDates.at(i++);
             }
         }
-        if (d->mCachedDateEnd.isValid()) {
+        if (d->mCache->mCachedDateEnd.isValid()) {
             done = true;
         } else if (!result.isEmpty()) {
             result += KDateTime();    // indicate that the returned list is incomplete
@@ -1818,34 +2828,39 @@ DateTimeList RecurrenceRule::timesInInterval(const KDateTime &dtStart,
             return result;
         }
         // We don't have any result yet, but we reached the end of the incomplete cache
-        st = d->mCachedLastDate.addSecs(1);
+        st = d->mCache->mCachedLastDate.addSecs(1);
     }
 
-    Constraint interval(d->getNextValidDateInterval(st, recurrenceType()));
-    int loop = 0;
-    do {
-        DateTimeList dts = d->datesForInterval(interval, recurrenceType());
-        int i = 0;
-        int iend = dts.count();
-        if (loop == 0) {
-            i = dts.findGE(st);
-            if (i < 0) {
-                i = iend;
-            }
-        }
-        int j = dts.findGT(enddt, i);
-        if (j >= 0) {
-            iend = j;
-            loop = LOOP_LIMIT;
-        }
-        while (i < iend) {
-            result += dts[i++];
-        }
-        // Increase the interval.
-        interval.increase(recurrenceType(), frequency());
-    } while (++loop < LOOP_LIMIT &&
-             interval.intervalDateTime(recurrenceType()) < end);
-    return result;
+    if (d->mDuration < 0 && enddt.isValid()) {
+        return d->windowDates(st, enddt);
+    }
+    return d->datesInInterval(st, enddt, end);
+}
+
+void RecurrenceRule::setOccurrenceCacheSize(int size)
+{
+    occurrenceCacheMaxSize.storeRelease(qMax(size, 0));
+}
+
+int RecurrenceRule::occurrenceCacheSize()
+{
+    return occurrenceCacheMaxSize.loadAcquire();
+}
+
+int RecurrenceRule::occurrenceCacheHits()
+{
+    return occurrenceCacheHitCount.load();
+}
+
+int RecurrenceRule::occurrenceCacheMisses()
+{
+    return occurrenceCacheMissCount.load();
+}
+
+void RecurrenceRule::resetOccurrenceCacheStatistics()
+{
+    occurrenceCacheHitCount.store(0);
+    occurrenceCacheMissCount.store(0);
 }
 
 //@cond PRIVATE
@@ -1993,8 +3008,84 @@ Constraint RecurrenceRule::Private::getNextValidDateInterval(const KDateTime &dt
     return Constraint(nextValid, type, mWeekStart);
 }
 
-DateTimeList RecurrenceRule::Private::datesForInterval(const Constraint &interval,
-        PeriodType type) const
+// Move the interval of a daily or sub-daily rule forwards (or backwards) to
+// the first interval which can contain an occurrence. The intervals on the
+// days, hours, minutes or seconds which no constraint accepts are skipped
+// at once, by jumping straight to the period of the next accepted value,
+// so that sparse rules don't step through every interval.
+// Return false if there is no such interval within the loop limit.
+bool RecurrenceRule::Private::skipIntervals(Constraint &interval, bool backwards) const
+{
+    if (mPeriod == rNone || mPeriod > rDaily) {
+        return true;
+    }
+    const int step = backwards ? -1 : 1;
+    for (int loop = 0;  loop < LOOP_LIMIT;  ++loop) {
+        const KDateTime dt = interval.intervalDateTime(mPeriod);
+        QDate date = dt.date();
+        int hour = dt.time().hour();
+        int minute = dt.time().minute();
+        int second = dt.time().second();
+        if (!mConstraints->matches(date)) {
+            int n = 0;
+            do {
+                date = date.addDays(step);
+            } while (!mConstraints->matches(date) && ++n < LOOP_LIMIT);
+            if (n >= LOOP_LIMIT) {
+                return false;
+            }
+            hour = backwards ? 23 : 0;
+            minute = second = backwards ? 59 : 0;
+        } else if (mPeriod <= rHourly && !mConstraints->acceptsHour(hour)) {
+            do {
+                hour += step;
+            } while (hour >= 0 && hour < 24 && !mConstraints->acceptsHour(hour));
+            minute = second = backwards ? 59 : 0;
+        } else if (mPeriod <= rMinutely && !mConstraints->acceptsMinute(minute)) {
+            do {
+                minute += step;
+            } while (minute >= 0 && minute < 60 && !mConstraints->acceptsMinute(minute));
+            second = backwards ? 59 : 0;
+        } else if (mPeriod == rSecondly && !mConstraints->acceptsSecond(second)) {
+            do {
+                second += step;
+            } while (second >= 0 && second < 60 && !mConstraints->acceptsSecond(second));
+        } else {
+            return true;
+        }
+
+        // Carry any overflow into the next (or previous) minute, hour or day
+        if (second < 0 || second > 59) {
+            second = backwards ? 59 : 0;
+            minute += step;
+        }
+        if (minute < 0 || minute > 59) {
+            minute = backwards ? 59 : 0;
+            hour += step;
+        }
+        if (hour < 0 || hour > 23) {
+            hour = backwards ? 23 : 0;
+            date = date.addDays(step);
+        }
+
+        const KDateTime to(date, QTime(hour, minute, second), mDateStart.timeSpec());
+        if (backwards) {
+            if (to < mDateStart) {
+                return false;
+            }
+            interval = getPreviousValidDateInterval(to, mPeriod);
+        } else {
+            interval = getNextValidDateInterval(to, mPeriod);
+            if (interval.intervalDateTime(mPeriod) < to) {
+                interval.increase(mPeriod, mFrequency);
+            }
+        }
+    }
+    return false;
+}
+
+EpochList RecurrenceRule::Private::epochsForInterval(const Constraint &interval,
+        PeriodType type, const EpochTable &table) const
 {
     /* -) Loop through constraints,
        -) merge interval with each constraint
@@ -2002,33 +3093,24 @@ DateTimeList RecurrenceRule::Private::datesForInterval(const Constraint &interva
        -) if complete => add that one date to the date list
        -) Loop through all missing fields => For each add the resulting
     */
-    DateTimeList lst;
-    for (int i = 0, iend = mConstraints.count();  i < iend;  ++i) {
+    EpochList lst;
+    for (int i = 0, iend = mConstraints->mConstraints.count();  i < iend;  ++i) {
         Constraint merged(interval);
-        if (merged.merge(mConstraints[i])) {
+        if (merged.merge(mConstraints->mConstraints[i])) {
             // If the information is incomplete, we can't use this constraint
             if (merged.year > 0 && merged.hour >= 0 && merged.minute >= 0 && merged.second >= 0) {
                 // We have a valid constraint, so get all datetimes that match it andd
                 // append it to all date/times of this interval
-                QList<KDateTime> lstnew = merged.dateTimes(type);
-                lst += lstnew;
+                lst += merged.dateTimes(type, table);
             }
         }
     }
     // Sort it so we can apply the BySetPos. Also some logic relies on this being sorted
-    lst.sortUnique();
+    std::sort(lst.begin(), lst.end());
+    lst.erase(std::unique(lst.begin(), lst.end()), lst.end());
 
-    /*if ( lst.isEmpty() ) {
-      qCDebug(KCALCORE_LOG) << "         No Dates in Interval";
-    } else {
-      qCDebug(KCALCORE_LOG) << "         Dates:";
-      for ( int i = 0, iend = lst.count();  i < iend;  ++i ) {
-        qCDebug(KCALCORE_LOG)<< "              -)" << dumpTime(lst[i]);
-      }
-      qCDebug(KCALCORE_LOG) << "       ---------------------";
-    }*/
     if (!mBySetPos.isEmpty()) {
-        DateTimeList tmplst = lst;
+        const EpochList tmplst = lst;
         lst.clear();
         for (int i = 0, iend = mBySetPos.count();  i < iend;  ++i) {
             int pos = mBySetPos[i];
@@ -2042,15 +3124,570 @@ DateTimeList RecurrenceRule::Private::datesForInterval(const Constraint &interva
                 lst.append(tmplst[pos]);
             }
         }
-        lst.sortUnique();
+        std::sort(lst.begin(), lst.end());
+        lst.erase(std::unique(lst.begin(), lst.end()), lst.end());
     }
 
     return lst;
 }
+
+DateTimeList RecurrenceRule::Private::datesForInterval(const Constraint &interval,
+        PeriodType type) const
+{
+    const EpochTable table(interval.timespec);
+    DateTimeList lst = table.dateTimes(epochsForInterval(interval, type, table));
+
+    /*if ( lst.isEmpty() ) {
+      qCDebug(KCALCORE_LOG) << "         No Dates in Interval";
+    } else {
+      qCDebug(KCALCORE_LOG) << "         Dates:";
+      for ( int i = 0, iend = lst.count();  i < iend;  ++i ) {
+        qCDebug(KCALCORE_LOG)<< "              -)" << dumpTime(lst[i]);
+      }
+      qCDebug(KCALCORE_LOG) << "       ---------------------";
+    }*/
+    return lst;
+}
+
+// Find the occurrences from start to enddt, looping through the intervals
+// until one of them begins at or after end. If complete is non-null, it is
+// set to false if the loop limit was reached before that.
+DateTimeList RecurrenceRule::Private::datesInInterval(const KDateTime &start,
+        const KDateTime &enddt,
+        const KDateTime &end,
+        bool *complete) const
+{
+    EpochList result;
+    Constraint interval(getNextValidDateInterval(start, mPeriod));
+    const EpochTable table(interval.timespec);
+    const EpochTime first = table.lowerBound(start);
+    const EpochTime last = table.upperBound(enddt);
+    // 'finished' is set once an interval reaches beyond the end
+    bool finished = false;
+    bool more = skipIntervals(interval, false);
+    for (int loop = 0;  more && !finished;) {
+        const EpochList dts = epochsForInterval(interval, mPeriod, table);
+        int i = 0;
+        const int iend = dts.count();
+        if (loop == 0) {
+            while (i < iend && table.lessThan(dts[i], first)) {
+                ++i;
+            }
+        }
+        for (; i < iend; ++i) {
+            if (table.lessThan(last, dts[i])) {
+                finished = true;
+                break;
+            }
+            result += dts[i];
+        }
+        if (!finished) {
+            // Increase the interval, skipping those which can't have occurrences
+            interval.increase(mPeriod, mFrequency);
+            more = skipIntervals(interval, false);
+            finished = more && !(interval.intervalDateTime(mPeriod) < end);
+            more = more && ++loop < LOOP_LIMIT;
+        }
+    }
+    if (complete) {
+        *complete = finished;
+    }
+    return table.dateTimes(result);
+}
+
+KDateTime RecurrenceRule::Private::addPeriods(const KDateTime &dt, int periods) const
+{
+    const int n = periods * static_cast<int>(mFrequency);
+    switch (mPeriod) {
+    case rSecondly:
+        return dt.addSecs(n);
+    case rMinutely:
+        return dt.addSecs(60 * n);
+    case rHourly:
+        return dt.addSecs(3600 * n);
+    case rDaily:
+        return dt.addDays(n);
+    case rWeekly:
+        return dt.addDays(7 * n);
+    case rMonthly:
+        return dt.addMonths(n);
+    case rYearly:
+        return dt.addYears(n);
+    default:
+        return dt;
+    }
+}
+
+// Returns the occurrences of a rule without end from start to end.
+//
+// The occurrences of the last requested interval are kept in a window, so
+// that repeated queries for the same period are answered from it. A query
+// overlapping the window only computes the part which is missing from it, and
+// the window then slides towards that part, dropping the occurrences furthest
+// away from it once it holds more than occurrenceCacheSize() of them.
+DateTimeList RecurrenceRule::Private::windowDates(const KDateTime &dtStart,
+        const KDateTime &end) const
+{
+    const KDateTime start = dtStart < mDateStart ? mDateStart : dtStart;
+    const int size = occurrenceCacheMaxSize.loadAcquire();
+    if (size <= 0) {
+        return datesInInterval(start, end, end);
+    }
+
+    // Work on a copy, so that the occurrences are computed without holding
+    // the lock
+    DateTimeList dates;
+    KDateTime windowStart;
+    KDateTime windowEnd;
+    {
+        QMutexLocker locker(&mCache->mCacheMutex);
+        dates = mCache->mWindowDates;
+        windowStart = mCache->mWindowStart;
+        windowEnd = mCache->mWindowEnd;
+    }
+
+    const bool overlaps = windowStart.isValid() && !(end < windowStart) && !(windowEnd < start);
+    if (overlaps && !(start < windowStart) && !(windowEnd < end)) {
+        occurrenceCacheHitCount.ref();
+    } else {
+        occurrenceCacheMissCount.ref();
+        bool complete = true;
+        bool backwards = false;
+        if (overlaps) {
+            if (start < windowStart) {
+                DateTimeList before = datesInInterval(start, windowStart, windowStart, &complete);
+                const int i = before.findGE(windowStart);
+                if (i >= 0) {
+                    before.erase(before.begin() + i, before.end());
+                }
+                before += dates;
+                dates = before;
+                windowStart = start;
+                backwards = true;
+            }
+            if (complete && windowEnd < end) {
+                const DateTimeList after = datesInInterval(windowEnd, end, end, &complete);
+                const int i = after.findGT(windowEnd);
+                if (i >= 0) {
+                    dates += after.mid(i);
+                }
+                windowEnd = end;
+                backwards = false;
+            }
+        } else {
+            dates = datesInInterval(start, end, end, &complete);
+            windowStart = start;
+            windowEnd = end;
+        }
+        // A window with missing occurrences is not kept
+        if (complete) {
+            DateTimeList window = dates;
+            if (window.count() > size) {
+                if (backwards) {
+                    window.erase(window.begin() + size, window.end());
+                    windowEnd = window.last();
+                } else {
+                    window.erase(window.begin(), window.end() - size);
+                    windowStart = window.first();
+                }
+            }
+            window = shareable(window);
+            windowStart = shareable(windowStart);
+            windowEnd = shareable(windowEnd);
+            QMutexLocker locker(&mCache->mCacheMutex);
+            mCache->mWindowDates = window;
+            mCache->mWindowStart = windowStart;
+            mCache->mWindowEnd = windowEnd;
+        }
+    }
+
+    DateTimeList result;
+    int i = dates.findGE(start);
+    if (i >= 0) {
+        int iend = dates.findGT(end, i);
+        if (iend < 0) {
+            iend = dates.count();
+        }
+        while (i < iend) {
+            result += dates[i++];
+        }
+    }
+    return result;
+}
+
+// Looks up the first occurrence after dt in the window. Returns false if
+// the window doesn't show it.
+bool RecurrenceRule::Private::windowNextDate(const KDateTime &dt, KDateTime &next) const
+{
+    QMutexLocker locker(&mCache->mCacheMutex);
+    if (!mCache->mWindowStart.isValid() || dt < mCache->mWindowStart) {
+        return false;
+    }
+    const int i = mCache->mWindowDates.findGT(dt);
+    if (i < 0) {
+        return false;
+    }
+    occurrenceCacheHitCount.ref();
+    next = mCache->mWindowDates[i];
+    return true;
+}
+
+// Looks up the last occurrence before dt in the window. Returns false if
+// the window doesn't show it.
+bool RecurrenceRule::Private::windowPreviousDate(const KDateTime &dt, KDateTime &previous) const
+{
+    QMutexLocker locker(&mCache->mCacheMutex);
+    if (!mCache->mWindowStart.isValid() || mCache->mWindowEnd < dt) {
+        return false;
+    }
+    const int i = mCache->mWindowDates.findLT(dt);
+    if (i < 0) {
+        return false;
+    }
+    occurrenceCacheHitCount.ref();
+    previous = mCache->mWindowDates[i];
+    return true;
+}
+
+// Whether a time of day falls into a gap left by a time zone shifting forward
+// after a date/time. Such local times don't exist on the day of the shift,
+// which the constraints check for each occurrence, but the simple rules don't.
+static bool isInTimeZoneGap(const KDateTime &start, const QTime &time)
+{
+    if (start.timeSpec().type() != KDateTime::TimeZone) {
+        return false;
+    }
+    // Convert a copy with data of its own, as the start is shared with readers
+    KDateTime utcStart(start);
+    utcStart.detach();
+    const KTimeZone zone = start.timeZone();
+    const QList<KTimeZone::Transition> transitions = zone.transitions(utcStart.toUtc().dateTime());
+    for (int i = 0, iend = transitions.count();  i < iend;  ++i) {
+        const QDateTime utc = transitions[i].time();
+        const int before = zone.offsetAtUtc(utc.addSecs(-1));
+        const int shift = transitions[i].phase().utcOffset() - before;
+        if (shift > 0) {
+            const QTime gapStart = utc.addSecs(before).time();
+            const int secs = gapStart.secsTo(time);
+            if ((secs >= 0 && secs < shift) || (secs < 0 && secs + 86400 < shift)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Detect the rules which can be evaluated without the constraints: daily,
+// weekly or monthly rules which only select weekdays (daily, weekly) or days
+// of the month (monthly), and have no BYSETPOS. They occur at most once a day,
+// at the time of mDateStart, on the selected days of every period which is a
+// multiple of the frequency away from the period containing mDateStart.
+// Rules whose time is skipped on some day by their time zone are left to the
+// constraints.
+void RecurrenceRule::Private::buildSimpleRule()
+{
+    mSimple = false;
+    mSimpleDays = 0;
+    mSimpleLastDays = 0;
+    if (!mDateStart.isValid() || mFrequency < 1 ||
+            !mBySeconds.isEmpty() || !mByMinutes.isEmpty() || !mByHours.isEmpty() ||
+            !mByYearDays.isEmpty() || !mByWeekNumbers.isEmpty() || !mByMonths.isEmpty() ||
+            !mBySetPos.isEmpty()) {
+        return;
+    }
+
+    const QDate startDate = mDateStart.date();
+    switch (mPeriod) {
+    case rDaily:
+    case rWeekly:
+        if (!mByMonthDays.isEmpty() || mWeekStart < 1 || mWeekStart > 7) {
+            return;
+        }
+        for (int i = 0, iend = mByDays.count();  i < iend;  ++i) {
+            if (mByDays[i].pos() != 0 || mByDays[i].day() < 1 || mByDays[i].day() > 7) {
+                return;
+            }
+            mSimpleDays |= 1u << mByDays[i].day();
+        }
+        if (!mSimpleDays) {
+            mSimpleDays = (mPeriod == rDaily) ? 0xfeu : 1u << startDate.dayOfWeek();
+        }
+        break;
+    case rMonthly:
+        if (!mByDays.isEmpty()) {
+            return;
+        }
+        for (int i = 0, iend = mByMonthDays.count();  i < iend;  ++i) {
+            const int day = mByMonthDays[i];
+            if (day >= 1 && day <= 31) {
+                mSimpleDays |= 1u << day;
+            } else if (day <= -1 && day >= -31) {
+                mSimpleLastDays |= 1u << -day;
+            } else {
+                return;
+            }
+        }
+        if (!mSimpleDays && !mSimpleLastDays) {
+            mSimpleDays = 1u << startDate.day();
+        }
+        break;
+    default:
+        return;
+    }
+
+    // The constraints ignore milliseconds
+    const QTime time = mDateStart.time();
+    mSimpleTime = QTime(time.hour(), time.minute(), time.second());
+    if (!mDateStart.isDateOnly() && isInTimeZoneGap(mDateStart, mSimpleTime)) {
+        return;
+    }
+    mSimpleFirstDate = startDate;
+    mSimple = true;
+    // Start date is only included if it really matches
+    if (simpleDateTime(startDate) < mDateStart) {
+        mSimpleFirstDate = startDate.addDays(1);
+    }
+}
+
+// Index of the day, week or month containing a date, counted from the one
+// containing the start date. The date must not be before the start date.
+int RecurrenceRule::Private::simplePeriodIndex(const QDate &date) const
+{
+    const QDate startDate = mDateStart.date();
+    switch (mPeriod) {
+    case rWeekly:
+        return static_cast<int>(simplePeriodStart(0).daysTo(date) / 7);
+    case rMonthly:
+        return 12 * (date.year() - startDate.year()) + date.month() - startDate.month();
+    default:
+        return static_cast<int>(startDate.daysTo(date));
+    }
+}
+
+QDate RecurrenceRule::Private::simplePeriodStart(int period) const
+{
+    const QDate startDate = mDateStart.date();
+    switch (mPeriod) {
+    case rWeekly:
+        return startDate.addDays(7 * period - (7 + startDate.dayOfWeek() - mWeekStart) % 7);
+    case rMonthly:
+        return QDate(startDate.year(), startDate.month(), 1).addMonths(period);
+    default:
+        return startDate.addDays(period);
+    }
+}
+
+QDate RecurrenceRule::Private::simplePeriodEnd(int period) const
+{
+    switch (mPeriod) {
+    case rWeekly:
+        return simplePeriodStart(period).addDays(6);
+    case rMonthly:
+        return simplePeriodStart(period + 1).addDays(-1);
+    default:
+        return simplePeriodStart(period);
+    }
+}
+
+// Whether a day is selected, regardless of the period it is in
+bool RecurrenceRule::Private::simpleDayMatches(const QDate &date) const
+{
+    if (mPeriod == rMonthly) {
+        return (mSimpleDays & (1u << date.day())) ||
+               (mSimpleLastDays & (1u << (date.daysInMonth() - date.day() + 1)));
+    }
+    return mSimpleDays & (1u << date.dayOfWeek());
+}
+
+// Whether the rule has an occurrence on a date
+bool RecurrenceRule::Private::simpleDateMatches(const QDate &date) const
+{
+    return date >= mSimpleFirstDate &&
+           simplePeriodIndex(date) % static_cast<int>(mFrequency) == 0 &&
+           simpleDayMatches(date);
+}
+
+// First date at or after a date with an occurrence
+QDate RecurrenceRule::Private::simpleNextDate(const QDate &date) const
+{
+    const int freq = static_cast<int>(mFrequency);
+    QDate dt = qMax(date, mSimpleFirstDate);
+    int period = simplePeriodIndex(dt);
+    for (int loop = 0;  loop < LOOP_LIMIT;  ++loop) {
+        const int offset = period % freq;
+        if (offset) {
+            period += freq - offset;
+            dt = simplePeriodStart(period);
+        }
+        for (const QDate end = simplePeriodEnd(period);  dt <= end;  dt = dt.addDays(1)) {
+            if (simpleDayMatches(dt)) {
+                return dt;
+            }
+        }
+        period += freq;
+        dt = simplePeriodStart(period);
+    }
+    return QDate();
+}
+
+// Last date at or before a date with an occurrence
+QDate RecurrenceRule::Private::simplePreviousDate(const QDate &date) const
+{
+    if (date < mSimpleFirstDate) {
+        return QDate();
+    }
+    const int freq = static_cast<int>(mFrequency);
+    QDate dt = date;
+    int period = simplePeriodIndex(dt);
+    for (int loop = 0;  loop < LOOP_LIMIT;  ++loop) {
+        const int offset = period % freq;
+        if (offset) {
+            period -= offset;
+            dt = simplePeriodEnd(period);
+        }
+        for (const QDate start = qMax(simplePeriodStart(period), mSimpleFirstDate);  dt >= start;  dt = dt.addDays(-1)) {
+            if (simpleDayMatches(dt)) {
+                return dt;
+            }
+        }
+        if (period < freq) {
+            break;
+        }
+        period -= freq;
+        dt = simplePeriodEnd(period);
+    }
+    return QDate();
+}
+
+// Number of dates with an occurrence before a date
+int RecurrenceRule::Private::simpleCountBefore(const QDate &date) const
+{
+    if (date <= mSimpleFirstDate) {
+        return 0;
+    }
+    const int freq = static_cast<int>(mFrequency);
+    const int last = simplePeriodIndex(date);
+    const int periods = (last + freq - 1) / freq;   // whole periods before date
+    int count = 0;
+    switch (mPeriod) {
+    case rDaily: {
+        // The weekdays of the periods repeat every seven periods
+        const QDate startDate = mDateStart.date();
+        int perCycle = 0;
+        for (int i = 0;  i < 7;  ++i) {
+            if (simpleDayMatches(startDate.addDays(i * freq))) {
+                ++perCycle;
+                if (i < periods % 7) {
+                    ++count;
+                }
+            }
+        }
+        count += (periods / 7) * perCycle;
+        break;
+    }
+    case rWeekly:
+        count = periods * static_cast<int>(qPopulationCount(mSimpleDays));
+        break;
+    case rMonthly:
+        for (int period = 0;  period < last;  period += freq) {
+            for (QDate dt = simplePeriodStart(period), end = simplePeriodEnd(period);  dt <= end;  dt = dt.addDays(1)) {
+                if (simpleDayMatches(dt)) {
+                    ++count;
+                }
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Days of the period containing date, up to date
+    if (last % freq == 0) {
+        for (QDate dt = simplePeriodStart(last);  dt < date;  dt = dt.addDays(1)) {
+            if (simpleDayMatches(dt)) {
+                ++count;
+            }
+        }
+    }
+    // Days of the first period before the first occurrence
+    for (QDate dt = simplePeriodStart(0);  dt < mSimpleFirstDate;  dt = dt.addDays(1)) {
+        if (simpleDayMatches(dt)) {
+            --count;
+        }
+    }
+    return count;
+}
+
+// Date of the n-th occurrence, counting from 1, or invalid if there is none
+// within the loop limit
+QDate RecurrenceRule::Private::simpleNthDate(int n) const
+{
+    // Find a date with at least n occurrences before it, by doubling the
+    // number of days, then search between it and the last date tried before.
+    // The rules repeat, so give up only if no occurrence is found at all.
+    const qint64 maxDays = static_cast<qint64>(LOOP_LIMIT) * 31 * mFrequency;
+    QDate low = mSimpleFirstDate;
+    QDate high;
+    for (qint64 days = 32;  ;  days *= 2) {
+        high = mSimpleFirstDate.addDays(days);
+        if (!high.isValid()) {
+            return QDate();
+        }
+        const int count = simpleCountBefore(high);
+        if (count >= n) {
+            break;
+        }
+        if (count == 0 && days > maxDays) {
+            return QDate();
+        }
+        low = high;
+    }
+    // There are fewer than n occurrences before 'low', and at least n before 'high'
+    while (low.daysTo(high) > 1) {
+        const QDate mid = low.addDays(low.daysTo(high) / 2);
+        if (simpleCountBefore(mid) >= n) {
+            high = mid;
+        } else {
+            low = mid;
+        }
+    }
+    return low;
+}
+
+// The occurrence on a date for which simpleDateMatches() is true
+KDateTime RecurrenceRule::Private::simpleDateTime(const QDate &date) const
+{
+    return KDateTime(date, mSimpleTime, mDateStart.timeSpec());
+}
+
+// First occurrence after, or at if @p inclusive, a date/time in the rule's time spec
+KDateTime RecurrenceRule::Private::simpleNextDateTime(const KDateTime &dt, bool inclusive) const
+{
+    for (QDate date = simpleNextDate(dt.date());  date.isValid();  date = simpleNextDate(date.addDays(1))) {
+        const KDateTime next = simpleDateTime(date);
+        if (inclusive ? !(next < dt) : dt < next) {
+            return next;
+        }
+    }
+    return KDateTime();
+}
+
+// Last occurrence before, or at if @p inclusive, a date/time in the rule's time spec
+KDateTime RecurrenceRule::Private::simplePreviousDateTime(const KDateTime &dt, bool inclusive) const
+{
+    for (QDate date = simplePreviousDate(dt.date());  date.isValid();  date = simplePreviousDate(date.addDays(-1))) {
+        const KDateTime prev = simpleDateTime(date);
+        if (inclusive ? !(dt < prev) : prev < dt) {
+            return prev;
+        }
+    }
+    return KDateTime();
+}
 //@endcond
 
 void RecurrenceRule::dump() const
 {
+    d->ensureCompiled();
 #ifndef NDEBUG
     qCDebug(KCALCORE_LOG);
     if (!d->mRRule.isEmpty()) {
@@ -2094,8 +3731,8 @@ void RecurrenceRule::dump() const
 
     qCDebug(KCALCORE_LOG) << "   Constraints:";
     // dump constraints
-    for (int i = 0, iend = d->mConstraints.count();  i < iend;  ++i) {
-        d->mConstraints[i].dump();
+    for (int i = 0, iend = d->mConstraints->mConstraints.count();  i < iend;  ++i) {
+        d->mConstraints->mConstraints[i].dump();
     }
 #endif
 }
@@ -2270,6 +3907,63 @@ int RecurrenceRule::WDayPos::pos() const
     return mPos;
 }
 
+//@cond PRIVATE
+class Q_DECL_HIDDEN KCalCore::RecurrenceRule::Cursor::Private : public OccurrenceWalker
+{
+public:
+    Private(const RecurrenceRule *rule, const KDateTime &position)
+        : OccurrenceWalker(position.isValid() ? position : before(rule->startDt()),
+                           windowSeconds(rule)),
+          mRule(rule)
+    {
+    }
+
+protected:
+    DateTimeList times(const KDateTime &start, const KDateTime &end) const Q_DECL_OVERRIDE
+    {
+        return mRule->timesInInterval(start, end);
+    }
+
+    KDateTime nextAfter(const KDateTime &dt) const Q_DECL_OVERRIDE
+    {
+        return mRule->getNextDate(dt);
+    }
+
+    KDateTime previousBefore(const KDateTime &dt) const Q_DECL_OVERRIDE
+    {
+        return mRule->getPreviousDate(dt);
+    }
+
+private:
+    const RecurrenceRule *const mRule;
+};
+//@endcond
+
+RecurrenceRule::Cursor::Cursor(const RecurrenceRule *rule, const KDateTime &position)
+    : d(new Private(rule, position))
+{
+}
+
+RecurrenceRule::Cursor::~Cursor()
+{
+    delete d;
+}
+
+KDateTime RecurrenceRule::Cursor::next()
+{
+    return d->next();
+}
+
+KDateTime RecurrenceRule::Cursor::previous()
+{
+    return d->previous();
+}
+
+KDateTime RecurrenceRule::Cursor::position() const
+{
+    return d->position();
+}
+
 QDataStream &operator<<(QDataStream &out, const Constraint &c)
 {
     out << c.year << c.month << c.day << c.hour << c.minute << c.second
@@ -2306,10 +4000,11 @@ KCALCORE_EXPORT QDataStream &KCalCore::operator<<(QDataStream &out, const KCalCo
     }
 
     RecurrenceRule::Private *d = r->d;
+    d->ensureCompiled();
     out << d->mRRule << static_cast<quint32>(d->mPeriod) << d->mDateStart << d->mFrequency << d->mDuration << d->mDateEnd
         << d->mBySeconds << d->mByMinutes << d->mByHours << d->mByDays << d->mByMonthDays
         << d->mByYearDays << d->mByWeekNumbers << d->mByMonths << d->mBySetPos
-        << d->mWeekStart << d->mConstraints << d->mAllDay << d->mNoByRules << d->mTimedRepetition
+        << d->mWeekStart << d->mConstraints->mConstraints << d->mAllDay << d->mNoByRules << d->mTimedRepetition
         << d->mIsReadOnly;
 
     return out;
@@ -2323,13 +4018,17 @@ KCALCORE_EXPORT QDataStream &KCalCore::operator>>(QDataStream &in, const KCalCor
 
     RecurrenceRule::Private *d = r->d;
     quint32 period;
+    // The constraints are compiled again from the definition below on first
+    // use, which finds the ones already shared by identical rules
+    Constraint::List constraints;
     in >> d->mRRule >> period >> d->mDateStart >> d->mFrequency >> d->mDuration >> d->mDateEnd
        >> d->mBySeconds >> d->mByMinutes >> d->mByHours >> d->mByDays >> d->mByMonthDays
        >> d->mByYearDays >> d->mByWeekNumbers >> d->mByMonths >> d->mBySetPos
-       >> d->mWeekStart >> d->mConstraints >> d->mAllDay >> d->mNoByRules >> d->mTimedRepetition
+       >> d->mWeekStart >> constraints >> d->mAllDay >> d->mNoByRules >> d->mTimedRepetition
        >> d->mIsReadOnly;
 
     d->mPeriod = static_cast<RecurrenceRule::PeriodType>(period);
+    d->mCompiled.storeRelease(0);
 
     return in;
 }
@@ -29,6 +29,8 @@
 
 #include <KDateTime>
 
+class QBitArray;
+
 namespace KCalCore
 {
 
@@ -87,6 +89,59 @@ public:
         friend KCALCORE_EXPORT QDataStream &operator>>(QDataStream &in, KCalCore::RecurrenceRule::WDayPos &);
     };
 
+    /**
+      A cursor stepping through the occurrences of a rule, forwards or
+      backwards, one at a time.
+
+      Unlike repeated calls to getNextDate() or getPreviousDate(), the cursor
+      keeps its position among the occurrences which it has already computed,
+      so each step usually costs only an index increment. Occurrences are
+      computed a window at a time as the cursor moves on.
+
+      The rule must not be changed or deleted while the cursor is used.
+      @since 5.15
+    */
+    class KCALCORE_EXPORT Cursor
+    {
+    public:
+        /**
+          Constructs a cursor on the occurrences of @p rule.
+          @param rule the rule whose occurrences to step through.
+          @param position the position to start from. next() returns the
+          first occurrence after it and previous() the last one before it.
+          If invalid, the cursor starts just before the start of the rule.
+        */
+        explicit Cursor(const RecurrenceRule *rule, const KDateTime &position = KDateTime());
+        ~Cursor();
+
+        /**
+          Moves to the next occurrence after the current position.
+          @return the occurrence, or an invalid date/time if there are no
+          more occurrences, in which case the position doesn't change.
+        */
+        KDateTime next();
+
+        /**
+          Moves to the previous occurrence before the current position.
+          @return the occurrence, or an invalid date/time if there are no
+          earlier occurrences, in which case the position doesn't change.
+        */
+        KDateTime previous();
+
+        /**
+          Returns the current position, which is the last occurrence returned,
+          or the position the cursor started from.
+        */
+        KDateTime position() const;
+
+    private:
+        Q_DISABLE_COPY(Cursor)
+        //@cond PRIVATE
+        class Private;
+        Private *const d;
+        //@endcond
+    };
+
     RecurrenceRule();
     RecurrenceRule(const RecurrenceRule &r);
     ~RecurrenceRule();
@@ -209,6 +264,21 @@ public:
      */
     bool recursOn(const QDate &date, const KDateTime::Spec &timeSpec) const;
 
+    /** Returns for each day of a date range whether the rule recurs on it, as
+     * recursOn() does for a single date. The occurrences of the whole range
+     * are computed at once, instead of once for each day.
+     *
+     * @param from first date of the range
+     * @param to last date of the range
+     * @param timeSpec time specification for the dates
+     * @return an array with one bit per day from @p from to @p to, set for the
+     *         days on which the rule recurs; an empty array if @p to is before
+     *         @p from
+     * @since 5.15
+     */
+    QBitArray recursOnRange(const QDate &from, const QDate &to,
+                            const KDateTime::Spec &timeSpec) const;
+
     /** Returns true if the date/time specified is one at which the event will
      * recur. Times are rounded down to the nearest minute to determine the result.
      * The start date/time returns true only if it actually matches the rule.
@@ -262,6 +332,54 @@ public:
      */
     KDateTime getPreviousDate(const KDateTime &afterDateTime) const;
 
+    /**
+      Sets the maximum number of occurrences which each rule without end keeps
+      in its occurrence cache.
+
+      A rule which recurs forever can't compute all its occurrences once and
+      for all, so it keeps those of the most recently requested period, which
+      answer repeated calls to timesInInterval(), getNextDate() and
+      getPreviousDate() for the same period. The cache follows the requests
+      as they move on, and is shared by all the rules with the same definition
+      and start, so that a rule which is changed stops using it.
+      The setting applies to all rules. A size of 0 disables the cache.
+
+      @param size the maximum number of cached occurrences per rule
+      @see occurrenceCacheHits(), occurrenceCacheMisses()
+      @since 5.15
+    */
+    static void setOccurrenceCacheSize(int size);
+
+    /**
+      Returns the maximum number of occurrences which each rule without end
+      keeps in its occurrence cache.
+      @see setOccurrenceCacheSize()
+      @since 5.15
+    */
+    static int occurrenceCacheSize();
+
+    /**
+      Returns the number of requests to rules without end which were answered
+      from their occurrence caches, since the last call to
+      resetOccurrenceCacheStatistics().
+      @since 5.15
+    */
+    static int occurrenceCacheHits();
+
+    /**
+      Returns the number of requests to rules without end for which the
+      occurrences had to be computed, since the last call to
+      resetOccurrenceCacheStatistics().
+      @since 5.15
+    */
+    static int occurrenceCacheMisses();
+
+    /**
+      Resets the occurrence cache hit and miss counters to 0.
+      @since 5.15
+    */
+    static void resetOccurrenceCacheStatistics();
+
     void setBySeconds(const QList<int> &bySeconds);
     void setByMinutes(const QList<int> &byMinutes);
     void setByHours(const QList<int> &byHours);